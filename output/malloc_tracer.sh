@@ -1,35 +1,59 @@
 #!/bin/bash
 
-# Processes the malloc trace output, create .dat files from gnuplot and plot
-# graph
+# Summarizes the heap profile written by the FTL when MALLOC_TRACE_ENABLED:
+# The call stacks holding the most bytes when the FTL exited, with their
+# functions. The profile is in the heap profile format pprof reads, so pprof
+# can be used on it as well
 
 
-# Stack trace output
+# Heap profile and the FTL it is of
 MALLOC_TRACE_OUTFILE="./malloc_trace.dat"
+FTL_EXE="../build/myFTL"
+
+# Number of call stacks to show
+MALLOC_TRACE_TOP=${1:-20}
 
 if [ ! -f $MALLOC_TRACE_OUTFILE ]; then
     echo "$MALLOC_TRACE_OUTFILE File not found."
     exit 1
 fi
 
+head -1 $MALLOC_TRACE_OUTFILE
+
+# Where the FTL is loaded, to turn addresses into offsets in $FTL_EXE
+FTL_BASE=$(awk '/^MAPPED_LIBRARIES:/ { maps = 1; next }
+	maps && $3 == "00000000" && $6 ~ /\/myFTL$/ {
+		split($1, range, "-"); print range[1]; exit }' $MALLOC_TRACE_OUTFILE)
+
+if [ -z "$FTL_BASE" ]; then
+    echo "FTL not found in mappings of $MALLOC_TRACE_OUTFILE"
+    exit 1
+fi
+
 #############
-# Plot graph
+# Stacks holding the most bytes, with offsets of the FTL's frames
 #############
 
-# If too many points to display, xticks becomes clobbered due to being too
-# close
-
-gnuplot -persist <<-EOFMarker
-	set title 'Heap Usage Tracker'
-	set ylabel 'Heap Usage(bytes)'
-	set ytics nomirror textcolor lt 1
-	set xtics rotate font "Times-Roman, 6"
-	plot \
-		"$MALLOC_TRACE_OUTFILE" using 1:xtic(2) with line title 'Cumulative Heap Change' linetype 1
-	if (GPVAL_ERRNO != 0) exit
-	# Save the graph to file
-	set term png
-	set output "malloc_trace_graph.png"
-	replot
-	set term xterm
-EOFMarker
+sed -n '2,/^$/p' $MALLOC_TRACE_OUTFILE | sort -t: -k2 -n -r |
+    head -n $MALLOC_TRACE_TOP | while read -r live bytes rest; do
+    allocs=${rest#[}
+    allocs=${allocs%%:*}
+    echo
+    echo "${bytes} bytes in ${live%:} blocks ($allocs allocations)"
+
+    # Only frames in the FTL, libraries are mapped far above it
+    offsets=""
+    for addr in ${rest#*@}; do
+        # Return addresses are after the call - Step back into it
+        offset=$((addr - 0x$FTL_BASE - 1))
+        if [ $offset -ge 0 ] && [ $offset -lt $((0x10000000)) ]; then
+            offsets="$offsets $(printf '0x%x' $offset)"
+        fi
+    done
+
+    if [ -n "$offsets" ]; then
+        addr2line -Cfpe $FTL_EXE $offsets | sed 's/^/    /'
+    else
+        echo "    (Not by the FTL)"
+    fi
+done
@@ -13,9 +13,12 @@
 
 #include "746FTL.h"
 
+#include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -45,12 +48,12 @@ size_t get_cur_stack_size(void);
 #endif /* MEMCHECK_ENABLED */
 
 /*
- * Note: pipes for communication have been opened by parent (FlashSim) before
- * forking
+ * Note: rings for communication have been created by parent (FlashSim)
+ * before forking, pipes only tell us if the parent died
  */
 
 /*
- * SendParentBytes - Sends the parent process bytes over pipe (IPC)
+ * SendParentBytes - Sends the parent process bytes over ring (IPC)
  *
  * If failure here, probably can't continue, so terminate
  *
@@ -58,35 +61,27 @@ size_t get_cur_stack_size(void);
  * size - Size of data in buffer in bytes
  */
 static void SendParentBytes(void *buf, size_t size) {
-  /* Parent's rx is child's tx */
-  ssize_t ret = write(Common.pipefd[PIPE_TX_END], buf, size);
-  if (ret < 0) {
-    perror("FATAL: Couldn't send child data");
-    assert(0 && "Failure in writing to child's rx pipe");
-  }
+  Common.tx_ring->Write(buf, size, Common.pipefd[PIPE_RX_END]);
 }
 
 /*
- * RecvParentBytes - Recevives from parent process bytes over pipe (IPC)
+ * RecvParentBytes - Recevives from parent process bytes over ring (IPC)
  *
  * If failure here, probably can't continue, so terminate
  *
  * buf - Buffer which hold's data to send
  * size_t - Size of data that buffer can hold
  *
- * Returns the actual bytes reveived
+ * Returns the actual bytes reveived - Blocks until buffer is full
  */
 static size_t RecvParentBytes(void *buf, size_t size) {
-  ssize_t ret;
-
-  /* Parent's rx is child's tx - Should block if no data */
-  ret = read(Common.pipefd[PIPE_RX_END], buf, size);
-  if (ret < 0) {
-    perror("FATAL: Couldn't recv parent data");
-    assert(0 && "Failure in reading from parent's tx pipe");
-  }
+  /*
+   * Note: If the parent gets terminated, the ring notices that
+   * the pipe from it has been closed and terminates us
+   */
+  Common.rx_ring->Read(buf, size, Common.pipefd[PIPE_RX_END]);
 
-  return ret;
+  return size;
 }
 
 /*
@@ -97,24 +92,7 @@ static size_t RecvParentBytes(void *buf, size_t size) {
  * TODO: Remove if not used.
  */
 int IsRecvMsgPending(void) {
-  IPC_Format msg;
-  struct pollfd pfd;
-  int ret;
-
-  pfd.fd = Common.pipefd[PIPE_RX_END];
-  pfd.events = POLLIN;
-
-  do {
-    ret = poll(&pfd, 1, 0);
-
-  } while (ret < 0 && errno == EINTR);
-
-  if (ret < 0) {
-    perror("FATAL: Poll failed");
-    assert(0 && "Poll failed on pipe read");
-  }
-
-  if (ret == 0) /* empty */
+  if (Common.rx_ring->Readable() == 0) /* empty */
     return 0;
   else
     return 1;
@@ -125,85 +103,84 @@ int IsRecvMsgPending(void) {
  *
  * should_block - Block or nonblock
  * rx_msg - Pointer to where to store the received message.
- * Returns empty message if no mesaage is in pipe
+ * Returns empty message if no mesaage is in ring
  */
 static void RecvMsgFromFlashSim(IPC_Format *rx_msg, int should_block) {
-  int ret;
   size_t size;
-  int timeout;
-  struct pollfd pfd;
-
-  pfd.fd = Common.pipefd[PIPE_RX_END];
-  pfd.events = POLLIN;
 
-  if (should_block) /* Infinite timeout */
-    timeout = -1;
-  else
-    /* Non blocking */
-    timeout = 0;
+  if (!should_block && !IsRecvMsgPending()) {
+    /* No data to read - Return empty message */
+    rx_msg->type_ = MSG_EMPTY;
+    return;
+  }
 
-  do {
-    ret = poll(&pfd, 1, timeout);
+  /* Copy data */
+  size = RecvParentBytes((void *)rx_msg, sizeof(*rx_msg));
+  if (size != sizeof(*rx_msg)) assert(0 && "Unknown message size");
 
-  } while (ret < 0 && errno == EINTR);
+  /* Message should be from parent, speaking our wire format */
+  assert(rx_msg->version_ == IPC_WIRE_VERSION && "Unknown wire format");
+  assert(rx_msg->owner_ == OWNER_FLASHSIM && "Unknown owner_");
+}
 
-  if (ret < 0) {
-    perror("FATAL: Poll failed");
-    assert(0 && "Poll failed on pipe read");
-  }
+/* Max responses to host operations held back by QueueResponse() */
+#define RESP_BATCH_MAX 16
 
-  if (ret == 0) {
-    /* No data to read - Return empty message */
-    assert(should_block == 0 && "No data even on blocking poll");
-    rx_msg->type_ = MSG_EMPTY;
-    return;
+/* Responses to host operations not sent yet, oldest first */
+static IPC_Format resp_batch[RESP_BATCH_MAX];
+static size_t resp_batch_count;
 
-  } else {
-    /* Copy data */
-    size = RecvParentBytes((void *)rx_msg, sizeof(*rx_msg));
-    if (size != sizeof(*rx_msg)) {
-      if (size == 0) {
-        /*
-         * Note: We might get 0 bytes from parent,
-         * if parent to closes the pipe (mainly because
-         * it gets terminated). Under normal circumstance,
-         * parent waits for child to die before it
-         * terminates.
-         */
-        assert(0 && "Parent process shouldn't have died");
-      }
-      assert(0 && "Unknown message size");
-    }
+/*
+ * FlushResponses - Sends the responses held back by QueueResponse() at once
+ */
+static void FlushResponses(void) {
+  if (resp_batch_count == 0) return;
 
-    /* Message should be from parent */
-    assert(rx_msg->owner_ == OWNER_FLASHSIM && "Unknown owner_");
-    return;
-  }
+  SendParentBytes((void *)resp_batch, resp_batch_count * sizeof(IPC_Format));
+  resp_batch_count = 0;
 }
 
 /*
  * SendMsgToFlashSim - Send messages to the flashsim (parent)
  *
+ * Held back responses go first, so flashsim sees every message in the order
+ * they were produced
+ *
  * tx_msg - Pointer to the message.
  */
 static void SendMsgToFlashSim(IPC_Format *tx_msg) {
   /* The message to be transmitted must come from flashsim here */
   assert((tx_msg->owner_ == OWNER_FTL) && "Unknown owner_");
 
+  FlushResponses();
   SendParentBytes((void *)tx_msg, sizeof(*tx_msg));
 }
 
+/*
+ * QueueResponse - Sends the response to a host operation. While flashsim
+ * has posted more operations, responses are held back and sent together
+ *
+ * tx_msg - Pointer to the message.
+ */
+static void QueueResponse(IPC_Format *tx_msg) {
+  assert((tx_msg->owner_ == OWNER_FTL) && "Unknown owner_");
+
+  resp_batch[resp_batch_count++] = *tx_msg;
+  if (resp_batch_count == RESP_BATCH_MAX || !IsRecvMsgPending())
+    FlushResponses();
+}
+
 /*
  * ProcessRequestFromFlashSim - Process and replies to the request pending in
- * pipe from Flashsim
+ * ring from Flashsim
  *
  * ftl - MyFTL object used to fulfill requests - typecast as FTLBase
  * ecb - ExecCallBack object passed to MyFTL functions
  * pending_recv_msg - Any pending previous requests? (Optional)
- * should_block - Should read block if no messages in read pipe?
+ * should_block - Should read block if no messages in read ring?
  *
- * This function ends when either pipe is empty (and call in nonblocking),
- * or pipe now contains a request from Flashsim
+ * This function ends when either ring is empty (and call in nonblocking),
+ * or ring now contains a request from Flashsim
  */
 static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
                                        FTLExecCallBack &ecb,
@@ -228,7 +205,7 @@ static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
       lba = recv_msg.lba_;
       send_msg.type_ = MSG_FTL_READ_RESP;
       read_write_resp = ftl->ReadTranslate(lba, ecb);
-      send_msg.ftl_resp_addr_ = read_write_resp.second;
+      send_msg.ftl_resp_addr_ = AddressCodec::Pack(read_write_resp.second);
       send_msg.ftl_resp_execstate_ = read_write_resp.first;
 
       break;
@@ -238,7 +215,7 @@ static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
       lba = recv_msg.lba_;
       send_msg.type_ = MSG_FTL_WRITE_RESP;
       read_write_resp = ftl->WriteTranslate(lba, ecb);
-      send_msg.ftl_resp_addr_ = read_write_resp.second;
+      send_msg.ftl_resp_addr_ = AddressCodec::Pack(read_write_resp.second);
       send_msg.ftl_resp_execstate_ = read_write_resp.first;
 
       break;
@@ -260,14 +237,18 @@ static void ProcessRequestFromFlashSim(FTLBase<TEST_PAGE_TYPE> *ftl,
 #else  /* MEMCHECK_ENABLED */
       send_msg.child_stack_size_ = 0;
 #endif /* MEMCEHCK_ENABLED */
-      break;
+
+      /* Send the response now */
+      SendMsgToFlashSim(&send_msg);
+      return;
 
     default:
       assert(0 && "Unknown message from Flashsim");
   } /* Switch */
 
-  /* Send the response now */
-  SendMsgToFlashSim(&send_msg);
+  /* Response to a host operation - Flashsim matches it by sequence id */
+  send_msg.seq_ = recv_msg.seq_;
+  QueueResponse(&send_msg);
 }
 
 /*
@@ -324,22 +305,59 @@ void SendReqToFlashSim(IPC_Format *tx_msg, IPC_Format *rx_msg) {
       exp_rx_typ = MSG_CONF_RES_GCPOLICY;
       break;
 
-    /* Ask for any of the flashsim services - Empty message expected */
-    case MSG_SIM_REQ_READ:
+    case MSG_CONF_REQ_GC_LOW_WATERMARK:
 
-      exp_rx_typ = MSG_EMPTY;
+      exp_rx_typ = MSG_CONF_RES_GC_LOW_WATERMARK;
       break;
 
-    case MSG_SIM_REQ_WRITE:
+    case MSG_CONF_REQ_GC_HIGH_WATERMARK:
 
-      exp_rx_typ = MSG_EMPTY;
+      exp_rx_typ = MSG_CONF_RES_GC_HIGH_WATERMARK;
       break;
 
-    case MSG_SIM_REQ_ERASE:
+    case MSG_CONF_REQ_GC_MAX_PAGES_PER_WRITE:
+
+      exp_rx_typ = MSG_CONF_RES_GC_MAX_PAGES_PER_WRITE;
+      break;
+
+    case MSG_CONF_REQ_WEAR_LEVELING_THRESHOLD:
+
+      exp_rx_typ = MSG_CONF_RES_WEAR_LEVELING_THRESHOLD;
+      break;
+
+    case MSG_CONF_REQ_MAPPING_CACHE_SIZE:
+
+      exp_rx_typ = MSG_CONF_RES_MAPPING_CACHE_SIZE;
+      break;
+
+    case MSG_CONF_REQ_TRANSLATION_PAGE_ENTRIES:
+
+      exp_rx_typ = MSG_CONF_RES_TRANSLATION_PAGE_ENTRIES;
+      break;
+
+    case MSG_CONF_REQ_ALLOCATION_STRIPING:
 
-      exp_rx_typ = MSG_EMPTY;
+      exp_rx_typ = MSG_CONF_RES_ALLOCATION_STRIPING;
       break;
 
+    /* Read a spare area - Answered, unlike the other flashsim services */
+    case MSG_SIM_REQ_READ_SPARE:
+
+      exp_rx_typ = MSG_SIM_RES_READ_SPARE;
+      break;
+
+    /*
+     * Ask for any of the flashsim services - No response, flashsim
+     * reports failures along with the response to the host operation
+     */
+    case MSG_SIM_REQ_READ:
+    case MSG_SIM_REQ_WRITE:
+    case MSG_SIM_REQ_ERASE:
+
+      SendMsgToFlashSim(tx_msg);
+      rx_msg->type_ = MSG_EMPTY;
+      return;
+
     default:
       assert(0 && "Unknown msg typ");
   }
@@ -347,150 +365,619 @@ void SendReqToFlashSim(IPC_Format *tx_msg, IPC_Format *rx_msg) {
   /* Send the child request */
   SendMsgToFlashSim(tx_msg);
 
-  /* Now wait for response - Blocking wait */
-  RecvMsgFromFlashSim(rx_msg, 1);
+  /*
+   * Now wait for response - Blocking wait. It comes on its own ring, as
+   * flashsim may have posted host operations meanwhile
+   */
+  Common.reply_ring->Read((void *)rx_msg, sizeof(*rx_msg),
+                          Common.pipefd[PIPE_RX_END]);
 
+  assert(rx_msg->version_ == IPC_WIRE_VERSION && "Unknown wire format");
+  assert(rx_msg->owner_ == OWNER_FLASHSIM && "Unknown owner_");
   if (rx_msg->type_ != exp_rx_typ) assert(0 && "Unknown response received");
 
   /* Received message is the response */
 }
 
+/*
+ * SendBatchToFlashSim - Sends a list of commands to the flashsim (parent) to
+ * execute in order. Like any request for flashsim services, it is not
+ * answered
+ *
+ * commands - The commands, sent right after the request message
+ * count - Number of commands, at most EXEC_BATCH_MAX
+ */
+void SendBatchToFlashSim(const Command *commands, size_t count) {
+  IPC_Format tx_msg;
+
+  assert(count <= EXEC_BATCH_MAX && "Batch too large");
+
+  tx_msg.owner_ = OWNER_FTL;
+  tx_msg.type_ = MSG_SIM_REQ_BATCH;
+  tx_msg.sim_req_count_ = count;
+
+  SendMsgToFlashSim(&tx_msg);
+  SendParentBytes((void *)commands, count * sizeof(Command));
+}
+
+/*
+ * SendMetadataToFlashSim - Sends the flashsim (parent) an FTL metadata page
+ * to program. Like any request for flashsim services, it is not answered
+ *
+ * addr - Page to program
+ * tag - Tag for the spare area of the page
+ * data - Content of the page, sent right after the request
+ * size - Size of the content in bytes
+ */
+void SendMetadataToFlashSim(Address addr, uint64_t tag, const void *data,
+                            size_t size) {
+  IPC_Format tx_msg;
+  MetadataXfer xfer;
+
+  tx_msg.owner_ = OWNER_FTL;
+  tx_msg.type_ = MSG_SIM_REQ_WRITE_METADATA;
+  xfer.addr = AddressCodec::Pack(addr);
+  xfer.tag = tag;
+  xfer.size = size;
+
+  SendMsgToFlashSim(&tx_msg);
+  SendParentBytes((void *)&xfer, sizeof(xfer));
+  SendParentBytes((void *)data, size);
+}
+
+/*
+ * RecvMetadataFromFlashSim - Reads an FTL metadata page from the flashsim
+ * (parent)
+ *
+ * addr - Page to read
+ * data - Where to store the content of the page, which follows the
+ *        response on the reply ring
+ * size - Size of data in bytes
+ */
+void RecvMetadataFromFlashSim(Address addr, void *data, size_t size) {
+  IPC_Format tx_msg, rx_msg;
+  MetadataXfer xfer;
+
+  tx_msg.owner_ = OWNER_FTL;
+  tx_msg.type_ = MSG_SIM_REQ_READ_METADATA;
+  xfer.addr = AddressCodec::Pack(addr);
+  xfer.tag = SPARE_ERASED;
+  xfer.size = size;
+
+  SendMsgToFlashSim(&tx_msg);
+  SendParentBytes((void *)&xfer, sizeof(xfer));
+
+  Common.reply_ring->Read((void *)&rx_msg, sizeof(rx_msg),
+                          Common.pipefd[PIPE_RX_END]);
+  assert(rx_msg.version_ == IPC_WIRE_VERSION && "Unknown wire format");
+  assert(rx_msg.owner_ == OWNER_FLASHSIM && "Unknown owner_");
+  if (rx_msg.type_ != MSG_SIM_RES_READ_METADATA) {
+    assert(0 && "Unknown response received");
+  }
+  Common.reply_ring->Read(data, size, Common.pipefd[PIPE_RX_END]);
+}
+
 #if MALLOC_TRACE_ENABLED
 
+/*
+ * Heap profiler - The child's malloc and friends are defined here, which
+ * takes precedence over (i.e. interposes) those of the C library for the
+ * whole process. Every allocation is charged to the call stack making it,
+ * in tables kept per thread so that no locks are needed. The profile is
+ * written to MALLOC_TRACE_FILE when the child exits
+ */
+
+/* Frames kept of a call stack, and call stacks kept per thread */
+#define MALLOC_TRACE_DEPTH 16
+#define MALLOC_TRACE_SITES 4096
+
+/*
+ * Frames of the profiler on a captured stack (charge_site(), trace_alloc()
+ * or trace_realloc(), and malloc() or the like)
+ */
+#define MALLOC_TRACE_SKIP 3
+
+/* Bytes in front of an allocation - Keeps it aligned as malloc does */
+#define MALLOC_TRACE_HEADER 16
+
+/* For allocations made while looking up the C library's allocator */
+#define MALLOC_TRACE_BOOTSTRAP 4096
+
+/* Allocations charged to one call stack */
+struct malloc_trace_site_t {
+  /* Return addresses, innermost first - Zero after the last */
+  uintptr_t stack[MALLOC_TRACE_DEPTH];
+  size_t hash;
+  bool used;
+
+  /* Allocations made, and those not freed yet - Freed by any thread */
+  size_t allocs;
+  size_t alloc_bytes;
+  std::atomic<size_t> live;
+  std::atomic<size_t> live_bytes;
+};
+
+/* Sites of a thread, only it adds to them */
+struct malloc_trace_table_t {
+  struct malloc_trace_table_t *next;
+
+  /* Frames are only followed below this */
+  uintptr_t stack_top;
+
+  struct malloc_trace_site_t sites[MALLOC_TRACE_SITES];
+};
+
+/*
+ * In front of each allocation. If the lowest bit of site is set, the
+ * allocation was aligned more than malloc does, and the word in front of
+ * this has where it starts
+ */
+struct malloc_trace_header_t {
+  uintptr_t site;
+  size_t size;
+};
+
 int malloc_trace_fd;
-void *(*old_malloc_hook)(size_t size, const void *caller);
-void (*old_free_hook)(void *ptr, const void *caller);
-void *(*old_realloc_hook)(void *ptr, size_t size, const void *caller);
-void *(*old_memalign_hook)(size_t alignment, size_t size, const void *caller);
-
-static void *my_malloc_hook(size_t size, const void *caller);
-static void my_free_hook(void *ptr, const void *caller);
-static void *my_realloc_hook(void *ptr, size_t size, const void *caller);
-static void *my_memalign_hook(size_t alignment, size_t size,
-                              const void *caller);
-
-static void restore_old_hooks() {
-  __malloc_hook = old_malloc_hook;
-  __free_hook = old_free_hook;
-  __realloc_hook = old_realloc_hook;
-  __memalign_hook = old_memalign_hook;
-}
-static void set_new_hooks() {
-  __malloc_hook = my_malloc_hook;
-  __free_hook = my_free_hook;
-  __realloc_hook = my_realloc_hook;
-  __memalign_hook = my_memalign_hook;
-}
-
-static void *my_malloc_hook(size_t size, const void *caller) {
-  struct mallinfo mi;
-  void *result;
-  char buf[100];
-  ssize_t buf_size, wsize;
 
-  (void)caller;
+/* Allocator of the C library */
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t nmemb, size_t size);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void *(*real_memalign)(size_t alignment, size_t size);
+static void (*real_free)(void *ptr);
+static int resolving;
 
-  /* Restore all old hooks */
-  restore_old_hooks();
+static char bootstrap[MALLOC_TRACE_BOOTSTRAP] __attribute__((aligned(16)));
+static size_t bootstrap_used;
 
-  result = malloc(size);
-  mi = mallinfo();
+/* Tables of all threads, for the profile */
+static std::atomic<struct malloc_trace_table_t *> malloc_trace_tables;
 
-  buf_size = sprintf(buf, "%d\n", mi.uordblks);
-  wsize = write(malloc_trace_fd, buf, buf_size);
-  assert(wsize >= 0);
+/* Bytes allocated and not freed by the process, now and at most */
+static std::atomic<size_t> malloc_trace_live_bytes;
+static std::atomic<size_t> malloc_trace_peak_bytes;
+
+static thread_local struct malloc_trace_table_t *malloc_trace_table;
+
+/* Set while profiling, so that allocations made doing so aren't */
+static thread_local int in_malloc_trace;
+
+/* Start of the main thread's stack, from the dynamic linker */
+extern "C" void *__libc_stack_end;
 
-  /* Restore our own hooks */
-  set_new_hooks();
+static void resolve_allocator(void) {
+  resolving = 1;
+  real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+  real_memalign = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+  real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+  resolving = 0;
 
-  return result;
+  if (real_malloc == NULL || real_calloc == NULL || real_realloc == NULL ||
+      real_memalign == NULL || real_free == NULL)
+    assert(0 && "C library allocator not found");
 }
 
-static void my_free_hook(void *ptr, const void *caller) {
-  struct mallinfo mi;
-  char buf[100];
-  ssize_t buf_size, wsize;
+/*
+ * Returns the table of the calling thread, creating it on its first
+ * allocation
+ */
+static struct malloc_trace_table_t *get_malloc_trace_table(void) {
+  struct malloc_trace_table_t *table = malloc_trace_table;
+  pthread_attr_t attr;
+  void *stack_addr;
+  size_t stack_size;
+
+  if (table != NULL) return table;
+
+  table = (struct malloc_trace_table_t *)mmap(
+      NULL, sizeof(*table), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) return NULL;
+
+  if (syscall(SYS_gettid) == getpid()) {
+    table->stack_top = (uintptr_t)__libc_stack_end;
+  } else if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0)
+      table->stack_top = (uintptr_t)stack_addr + stack_size;
+    pthread_attr_destroy(&attr);
+  }
 
-  (void)caller;
+  table->next = malloc_trace_tables.load();
+  while (!malloc_trace_tables.compare_exchange_weak(table->next, table)) {
+  }
 
-  /* Restore all old hooks */
-  restore_old_hooks();
+  malloc_trace_table = table;
+  return table;
+}
 
-  free(ptr);
-  mi = mallinfo();
+/*
+ * Fills stack with the return addresses of the caller of the allocator and
+ * its callers, by following frame pointers. The FTL is built without
+ * optimization, so its functions keep frame pointers. Those of libraries
+ * that don't are skipped over
+ */
+static __attribute__((noinline)) void capture_stack(uintptr_t *stack,
+                                                    uintptr_t stack_top) {
+  uintptr_t *fp = (uintptr_t *)__builtin_frame_address(0);
+  int skip = MALLOC_TRACE_SKIP;
+  int depth = 0;
 
-  buf_size = sprintf(buf, "%d\n", mi.uordblks);
-  wsize = write(malloc_trace_fd, buf, buf_size);
-  assert(wsize >= 0);
+  memset(stack, 0, MALLOC_TRACE_DEPTH * sizeof(*stack));
+
+  while (depth < MALLOC_TRACE_DEPTH) {
+    uintptr_t *next = (uintptr_t *)fp[0];
 
-  /* Restore our own hooks */
-  set_new_hooks();
+    if (fp[1] == 0) break;
+
+    if (skip > 0)
+      skip--;
+    else
+      stack[depth++] = fp[1];
+
+    /* Frames only go up the stack - Anything else isn't a frame */
+    if (next <= fp || (uintptr_t)(next + 2) > stack_top ||
+        ((uintptr_t)next & (sizeof(*next) - 1)) != 0)
+      break;
+
+    fp = next;
+  }
 }
 
-static void *my_realloc_hook(void *ptr, size_t size, const void *caller) {
-  struct mallinfo mi;
-  char buf[100];
-  ssize_t buf_size, wsize;
-  void *result;
+/*
+ * Charges an allocation of size bytes to the stack making it
+ * Returns the site charged, NULL if not profiled
+ */
+static struct malloc_trace_site_t *charge_site(size_t size) {
+  struct malloc_trace_table_t *table;
+  struct malloc_trace_site_t *site = NULL;
+  uintptr_t stack[MALLOC_TRACE_DEPTH];
+  size_t hash = 0, live, peak;
+
+  if (in_malloc_trace || resolving) return NULL;
+  in_malloc_trace = 1;
+
+  table = get_malloc_trace_table();
+  if (table == NULL) goto out;
+
+  capture_stack(stack, table->stack_top);
+  for (int i = 0; i < MALLOC_TRACE_DEPTH; i++)
+    hash = (hash ^ stack[i]) * 0x100000001b3ULL;
+
+  /* Open addressing - Once the table is full, sites aren't profiled */
+  for (size_t i = 0; i < MALLOC_TRACE_SITES; i++) {
+    struct malloc_trace_site_t *cur =
+        &table->sites[(hash + i) % MALLOC_TRACE_SITES];
+
+    if (!cur->used) {
+      memcpy(cur->stack, stack, sizeof(stack));
+      cur->hash = hash;
+      cur->used = true;
+      site = cur;
+      break;
+    }
 
-  (void)caller;
+    if (cur->hash == hash && memcmp(cur->stack, stack, sizeof(stack)) == 0) {
+      site = cur;
+      break;
+    }
+  }
 
-  /* Restore all old hooks */
-  restore_old_hooks();
+  if (site == NULL) goto out;
 
-  result = realloc(ptr, size);
-  mi = mallinfo();
+  site->allocs++;
+  site->alloc_bytes += size;
+  site->live.fetch_add(1, std::memory_order_relaxed);
+  site->live_bytes.fetch_add(size, std::memory_order_relaxed);
 
-  buf_size = sprintf(buf, "%d\n", mi.uordblks);
-  wsize = write(malloc_trace_fd, buf, buf_size);
-  assert(wsize >= 0);
+  live = malloc_trace_live_bytes.fetch_add(size) + size;
+  peak = malloc_trace_peak_bytes.load();
+  while (live > peak &&
+         !malloc_trace_peak_bytes.compare_exchange_weak(peak, live)) {
+  }
+
+out:
+  in_malloc_trace = 0;
+  return site;
+}
+
+static void uncharge_site(uintptr_t site_word, size_t size) {
+  struct malloc_trace_site_t *site =
+      (struct malloc_trace_site_t *)(site_word & ~(uintptr_t)1);
 
-  /* Restore our own hooks */
-  set_new_hooks();
+  if (site == NULL) return;
 
-  return result;
+  site->live.fetch_sub(1, std::memory_order_relaxed);
+  site->live_bytes.fetch_sub(size, std::memory_order_relaxed);
+  malloc_trace_live_bytes.fetch_sub(size);
 }
 
-static void *my_memalign_hook(size_t alignment, size_t size,
-                              const void *caller) {
-  struct mallinfo mi;
-  char buf[100];
-  ssize_t buf_size, wsize;
-  void *result;
+static struct malloc_trace_header_t *get_header(void *ptr) {
+  return (struct malloc_trace_header_t *)((char *)ptr - MALLOC_TRACE_HEADER);
+}
 
-  (void)caller;
+/* Where the allocation with this header starts */
+static void *get_block(struct malloc_trace_header_t *header) {
+  if (header->site & 1) return ((void **)header)[-1];
+  return header;
+}
 
-  /* Restore all old hooks */
-  restore_old_hooks();
+static bool is_bootstrap(void *block) {
+  return (char *)block >= bootstrap &&
+         (char *)block < bootstrap + sizeof(bootstrap);
+}
 
-  result = memalign(alignment, size);
-  mi = mallinfo();
+/*
+ * Allocates size bytes aligned to alignment (0 if as malloc does),
+ * zeroed if asked for
+ */
+static void *trace_alloc(size_t size, size_t alignment, int zero) {
+  struct malloc_trace_header_t *header;
+  size_t extra = MAX(alignment, (size_t)MALLOC_TRACE_HEADER);
+  char *block;
+
+  if (size > SIZE_MAX - extra) {
+    errno = ENOMEM;
+    return NULL;
+  }
 
-  buf_size = sprintf(buf, "%d\n", mi.uordblks);
-  wsize = write(malloc_trace_fd, buf, buf_size);
-  assert(wsize >= 0);
+  if (real_malloc == NULL && !resolving) resolve_allocator();
+
+  if (real_malloc == NULL) {
+    /* Looking up the allocator - Static memory is zeroed already */
+    if (bootstrap_used + size + extra > sizeof(bootstrap))
+      assert(0 && "Bootstrap memory exhausted");
+    block = &bootstrap[bootstrap_used];
+    bootstrap_used += (size + extra + 15) & ~(size_t)15;
+  } else if (extra > MALLOC_TRACE_HEADER) {
+    block = (char *)real_memalign(alignment, size + extra);
+    if (block != NULL && zero) memset(block + extra, 0, size);
+  } else if (zero) {
+    block = (char *)real_calloc(1, size + extra);
+  } else {
+    block = (char *)real_malloc(size + extra);
+  }
 
-  /* Restore our own hooks */
-  set_new_hooks();
+  if (block == NULL) return NULL;
 
-  return result;
+  header = get_header(block + extra);
+  header->site = (uintptr_t)charge_site(size);
+  header->size = size;
+  if (extra > MALLOC_TRACE_HEADER) {
+    ((void **)header)[-1] = block;
+    header->site |= 1;
+  }
+
+  return block + extra;
+}
+
+/* Resizes an allocation, charging it to the stack resizing it */
+static void *trace_realloc(void *ptr, size_t size) {
+  struct malloc_trace_header_t *header = get_header(ptr);
+  void *block = get_block(header);
+  void *new_ptr;
+
+  /* Aligned or bootstrap allocations are moved */
+  if ((header->site & 1) || is_bootstrap(block)) {
+    new_ptr = trace_alloc(size, 0, 0);
+    if (new_ptr == NULL) return NULL;
+
+    memcpy(new_ptr, ptr, std::min(size, header->size));
+    free(ptr);
+    return new_ptr;
+  }
+
+  if (size > SIZE_MAX - MALLOC_TRACE_HEADER) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  header = (struct malloc_trace_header_t *)real_realloc(
+      block, size + MALLOC_TRACE_HEADER);
+  if (header == NULL) return NULL;
+
+  uncharge_site(header->site, header->size);
+  header->site = (uintptr_t)charge_site(size);
+  header->size = size;
+
+  return (char *)header + MALLOC_TRACE_HEADER;
 }
 
-/* Calloc calls malloc internally so is not needed to be trapped */
+void *malloc(size_t size) noexcept { return trace_alloc(size, 0, 0); }
+
+void *calloc(size_t nmemb, size_t size) noexcept {
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return trace_alloc(nmemb * size, 0, 1);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  if (ptr == NULL) return trace_alloc(size, 0, 0);
+
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  return trace_realloc(ptr, size);
+}
+
+void free(void *ptr) noexcept {
+  struct malloc_trace_header_t *header;
+  void *block;
+
+  if (ptr == NULL) return;
+
+  header = get_header(ptr);
+  block = get_block(header);
+  uncharge_site(header->site, header->size);
+
+  /* Bootstrap memory is never given back */
+  if (is_bootstrap(block)) return;
+
+  real_free(block);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+  return trace_alloc(size, alignment, 0);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  return trace_alloc(size, alignment, 0);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+  void *ptr;
+
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  ptr = trace_alloc(size, alignment, 0);
+  if (ptr == NULL) return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+void *valloc(size_t size) noexcept {
+  return trace_alloc(size, PAGE_SIZE, 0);
+}
+
+void *pvalloc(size_t size) noexcept {
+  return trace_alloc((size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1),
+                     PAGE_SIZE, 0);
+}
+
+size_t malloc_usable_size(void *ptr) noexcept {
+  return ptr == NULL ? 0 : get_header(ptr)->size;
+}
 
 static int init_malloc_trace() {
   malloc_trace_fd =
       open(MALLOC_TRACE_FILE, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
   if (malloc_trace_fd < 0) return malloc_trace_fd;
 
-  old_malloc_hook = __malloc_hook;
-  old_free_hook = __free_hook;
-  old_realloc_hook = __realloc_hook;
-  old_memalign_hook = __memalign_hook;
+  return 0;
+}
+
+/*
+ * Append a string or a number to a line of the profile, dropping what doesn't
+ * fit. The last byte of the buffer is left for the newline. The profile is
+ * written from the SIGUSR1 handler, where printf isn't safe to call
+ */
+static size_t trace_puts(char *buf, size_t size, size_t len, const char *str) {
+  while (*str != '\0' && len < size - 1) buf[len++] = *str++;
+  return len;
+}
 
-  set_new_hooks();
+static size_t trace_putn(char *buf, size_t size, size_t len, size_t value,
+                         unsigned int base) {
+  char digits[3 * sizeof(size_t) + 1];
+  int i = sizeof(digits) - 1;
 
-  return 0;
+  digits[i] = '\0';
+  do {
+    digits[--i] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value != 0);
+
+  return trace_puts(buf, size, len, &digits[i]);
+}
+
+static void trace_write(const char *buf, size_t len) {
+  ssize_t wsize = write(malloc_trace_fd, buf, len);
+  assert(wsize >= 0);
+}
+
+/* Counts of a line: "live: live bytes [allocs: alloc bytes] @" */
+static size_t trace_counts(char *buf, size_t size, size_t live,
+                           size_t live_bytes, size_t allocs,
+                           size_t alloc_bytes) {
+  size_t len = trace_putn(buf, size, 0, live, 10);
+  len = trace_puts(buf, size, len, ": ");
+  len = trace_putn(buf, size, len, live_bytes, 10);
+  len = trace_puts(buf, size, len, " [");
+  len = trace_putn(buf, size, len, allocs, 10);
+  len = trace_puts(buf, size, len, ": ");
+  len = trace_putn(buf, size, len, alloc_bytes, 10);
+  return trace_puts(buf, size, len, "] @");
+}
+
+/*
+ * Writes the profile, in the heap profile format pprof reads: A line per
+ * call stack with the allocations not freed and bytes in them, then all
+ * allocations and bytes, then the stack. The mappings of the process follow,
+ * for pprof to find the functions. Only async-signal-safe calls are made
+ */
+static void dump_malloc_trace(void) {
+  struct malloc_trace_table_t *table;
+  size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0, sites = 0;
+  /* Enough for a line of a call stack */
+  char buf[64 + MALLOC_TRACE_DEPTH * 20];
+  static const char maps_header[] = "\nMAPPED_LIBRARIES:\n";
+  size_t len;
+  ssize_t rsize;
+  int maps_fd;
+
+  in_malloc_trace = 1;
+
+  for (table = malloc_trace_tables.load(); table != NULL; table = table->next) {
+    for (int i = 0; i < MALLOC_TRACE_SITES; i++) {
+      struct malloc_trace_site_t *site = &table->sites[i];
+
+      if (!site->used) continue;
+
+      live += site->live.load();
+      live_bytes += site->live_bytes.load();
+      allocs += site->allocs;
+      alloc_bytes += site->alloc_bytes;
+      sites++;
+    }
+  }
+
+  len = trace_counts(buf, sizeof(buf), live, live_bytes, allocs, alloc_bytes);
+  len = trace_puts(buf, sizeof(buf), len, " heapprofile");
+  buf[len++] = '\n';
+  trace_write(buf, len);
+
+  for (table = malloc_trace_tables.load(); table != NULL; table = table->next) {
+    for (int i = 0; i < MALLOC_TRACE_SITES; i++) {
+      struct malloc_trace_site_t *site = &table->sites[i];
+
+      if (!site->used) continue;
+
+      len = trace_counts(buf, sizeof(buf), site->live.load(),
+                         site->live_bytes.load(), site->allocs,
+                         site->alloc_bytes);
+      for (int j = 0; j < MALLOC_TRACE_DEPTH && site->stack[j] != 0; j++) {
+        len = trace_puts(buf, sizeof(buf), len, " 0x");
+        len = trace_putn(buf, sizeof(buf), len, site->stack[j], 16);
+      }
+      buf[len++] = '\n';
+      trace_write(buf, len);
+    }
+  }
+
+  trace_write(maps_header, sizeof(maps_header) - 1);
+
+  maps_fd = open("/proc/self/maps", O_RDONLY);
+  assert(maps_fd >= 0);
+  while ((rsize = read(maps_fd, buf, sizeof(buf))) > 0) trace_write(buf, rsize);
+  close(maps_fd);
+
+  len = trace_puts(buf, sizeof(buf), 0, "Heap profile of ");
+  len = trace_putn(buf, sizeof(buf), len, sites, 10);
+  len = trace_puts(buf, sizeof(buf), len, " call stacks in " MALLOC_TRACE_FILE
+                   ", peak ");
+  len = trace_putn(buf, sizeof(buf), len, malloc_trace_peak_bytes.load(), 10);
+  len = trace_puts(buf, sizeof(buf), len, " bytes live");
+  buf[len++] = '\n';
+  rsize = write(STDOUT_FILENO, buf, len);
+  assert(rsize >= 0);
 }
 
 #endif /* MALLOC_TRACE_ENABLED */
@@ -563,6 +1050,7 @@ void term_handler(int signal) {
 #endif /* PRINT_STATS_ENABLE */
 
 #if MALLOC_TRACE_ENABLED
+  dump_malloc_trace();
   close(malloc_trace_fd);
 #endif
   /* Simply exit - No need to cleanup */
@@ -753,7 +1241,7 @@ static int init_memcheck_child(void) {
    * So lets make it page size (can't make malloc do better than that)
    * This too makes the system calls increase in number
    */
-  ret = mallopt(M_TOP_PAD, 1);
+  ret = mallopt(M_TOP_PAD, MALLOC_TOP_PAD);
   if (ret == 0) return -1;
 
   ret = mallopt(M_MXFAST, 0);
@@ -768,14 +1256,15 @@ static int init_memcheck_child(void) {
  */
 int main(int argc, char **argv) {
   IPC_Format recv_msg, tx_msg;
+  ShmRings *rings;
+  int shm_fd;
 
 #if MEMCHECK_ENABLED || MALLOC_TRACE_ENABLED
   int ret;
 #endif
 
   /* Fetch arguments */
-  if ((argc < CHILD_PIPE_RX_FD_ARGV_OFF + 1))
-    assert(0 && "Too few arguments");
+  if ((argc < CHILD_SHM_FD_ARGV_OFF + 1)) assert(0 && "Too few arguments");
 
   /* Child's rx pipefd */
   sscanf(argv[CHILD_PIPE_RX_FD_ARGV_OFF], "%d", &Common.pipefd[PIPE_RX_END]);
@@ -783,6 +1272,15 @@ int main(int argc, char **argv) {
   /* Child's tx pipefd */
   sscanf(argv[CHILD_PIPE_TX_FD_ARGV_OFF], "%d", &Common.pipefd[PIPE_TX_END]);
 
+  /* Rings shared with parent - The mapping outlives the fd */
+  sscanf(argv[CHILD_SHM_FD_ARGV_OFF], "%d", &shm_fd);
+  rings = ShmRings::Map(shm_fd);
+  close(shm_fd);
+  Common.rx_ring = &rings->to_ftl;
+  Common.tx_ring = &rings->to_flashsim;
+  Common.reply_ring = &rings->replies_to_ftl;
+  Common.host_op_time = &rings->host_op_time;
+
   /* We are the child */
   Common.child_pid = 0;
 
@@ -793,7 +1291,7 @@ int main(int argc, char **argv) {
 #endif
 
 #if MALLOC_TRACE_ENABLED
-  /* This needs to be called before first malloc is issued */
+  /* Open the profile's file now, to not find it can't be at exit */
   ret = init_malloc_trace();
   if (ret < 0) return ret;
 #endif
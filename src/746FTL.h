@@ -12,6 +12,10 @@
 #include "common.h"
 
 void SendReqToFlashSim(IPC_Format *tx_msg, IPC_Format *rx_msg);
+void SendBatchToFlashSim(const Command *commands, size_t count);
+void SendMetadataToFlashSim(Address addr, uint64_t tag, const void *data,
+                            size_t size);
+void RecvMetadataFromFlashSim(Address addr, void *data, size_t size);
 /*
  * class FTLConf - Use this class to get configuration of flash
  *
@@ -64,6 +68,41 @@ class FTLConf : public ConfBase {
     return SendConfReqToFlashSim(MSG_CONF_REQ_GCPOLICY);
   }
 
+  /* Returns the free block count at which incremental GC starts */
+  size_t GetGCLowWatermark(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_GC_LOW_WATERMARK);
+  }
+
+  /* Returns the free block count at which incremental GC stops */
+  size_t GetGCHighWatermark(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_GC_HIGH_WATERMARK);
+  }
+
+  /* Returns the max pages incremental GC migrates per write */
+  size_t GetGCMaxPagesPerWrite(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_GC_MAX_PAGES_PER_WRITE);
+  }
+
+  /* Returns the erase count spread that triggers wear leveling */
+  size_t GetWearLevelingThreshold(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_WEAR_LEVELING_THRESHOLD);
+  }
+
+  /* Returns the RAM (in bytes) the FTL may use for cached mappings */
+  size_t GetMappingCacheSize(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_MAPPING_CACHE_SIZE);
+  }
+
+  /* Returns the number of mappings per translation page */
+  size_t GetTranslationPageEntries(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_TRANSLATION_PAGE_ENTRIES);
+  }
+
+  /* Returns how host writes are striped over dies or planes */
+  size_t GetAllocationStriping(void) const {
+    return SendConfReqToFlashSim(MSG_CONF_REQ_ALLOCATION_STRIPING);
+  }
+
  private:
   size_t SendConfReqToFlashSim(enum message_type_t type) const {
     IPC_Format tx_msg, rx_msg;
@@ -97,6 +136,20 @@ class FTLConf : public ConfBase {
       return GetOverprovisioning();
     else if (key.compare(CONF_S_GCPOLICY) == 0)
       return GetGCPolicy();
+    else if (key.compare(CONF_S_GC_LOW_WATERMARK) == 0)
+      return GetGCLowWatermark();
+    else if (key.compare(CONF_S_GC_HIGH_WATERMARK) == 0)
+      return GetGCHighWatermark();
+    else if (key.compare(CONF_S_GC_MAX_PAGES_PER_WRITE) == 0)
+      return GetGCMaxPagesPerWrite();
+    else if (key.compare(CONF_S_WEAR_LEVELING_THRESHOLD) == 0)
+      return GetWearLevelingThreshold();
+    else if (key.compare(CONF_S_MAPPING_CACHE_SIZE) == 0)
+      return GetMappingCacheSize();
+    else if (key.compare(CONF_S_TRANSLATION_PAGE_ENTRIES) == 0)
+      return GetTranslationPageEntries();
+    else if (key.compare(CONF_S_ALLOCATION_STRIPING) == 0)
+      return GetAllocationStriping();
     else
       assert(0 && "Unknown configuration parameter");
 
@@ -160,14 +213,63 @@ class FTLExecCallBack : public ExecCallBack<TEST_PAGE_TYPE> {
         tx_msg.type_ = MSG_SIM_REQ_ERASE;
         tx_msg.sim_req_opcode_ = OpCode::ERASE;
         break;
+      case OpCode::WRITE_METADATA:
+        tx_msg.type_ = MSG_SIM_REQ_WRITE;
+        tx_msg.sim_req_opcode_ = OpCode::WRITE_METADATA;
+        break;
       default:
         assert(0 && "Unknown operation");
         break;
     }
 
-    tx_msg.sim_req_addr_ = addr;
+    tx_msg.sim_req_addr_ = AddressCodec::Pack(addr);
+
+    /* Not answered, so rx is unimportant */
+    SendReqToFlashSim(&tx_msg, &rx_msg);
+  }
+
+  /*
+   * Submit() - Sends a list of commands to the controller in a single
+   *            request
+   */
+  virtual void Submit(const Command *commands, size_t count) const {
+    SendBatchToFlashSim(commands, count);
+  }
+
+  /*
+   * Now() - Returns the simulated time the host operation was issued at,
+   *         as published by the controller
+   */
+  virtual uint64_t Now() const {
+    return Common.host_op_time->load(std::memory_order_relaxed);
+  }
+
+  /*
+   * ProgramMetadata() - Sends an FTL metadata page to the controller
+   */
+  virtual void ProgramMetadata(Address addr, uint64_t tag, const void *data,
+                               size_t size) const {
+    SendMetadataToFlashSim(addr, tag, data, size);
+  }
+
+  /*
+   * ReadMetadata() - Reads an FTL metadata page back from the controller
+   */
+  virtual void ReadMetadata(Address addr, void *data, size_t size) const {
+    RecvMetadataFromFlashSim(addr, data, size);
+  }
+
+  /*
+   * ReadSpare() - Asks the controller for the spare area of a page
+   */
+  virtual uint64_t ReadSpare(Address addr) const {
+    IPC_Format tx_msg, rx_msg;
+
+    tx_msg.owner_ = OWNER_FTL;
+    tx_msg.type_ = MSG_SIM_REQ_READ_SPARE;
+    tx_msg.sim_req_addr_ = AddressCodec::Pack(addr);
 
     SendReqToFlashSim(&tx_msg, &rx_msg);
-    /* Since the respnse will be empty message, rx is unimportant */
+    return rx_msg.sim_resp_spare_;
   }
 };
\ No newline at end of file
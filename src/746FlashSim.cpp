@@ -6,8 +6,10 @@
  */
 #include "746FlashSim.h"
 
+#include <malloc.h>
 #include <signal.h>
 #include <sys/resource.h>
+#include <ucontext.h>
 
 #include "common.h"
 #include "config.h"
@@ -25,8 +27,9 @@ FILE *trans_trace_fp;
 /*
  * init_flashsim - Initialize flashsim framework
  *
- * The objective is to fork() a child, and open two pipes between the parent
- * and child to enable IPC.
+ * The objective is to fork() a child, and share rings (ShmRings) between
+ * the parent and child to enable IPC. Two pipes are also opened,
+ * only so that each side notices if the other dies.
  * This allows seperation of child and parent memory, while enabling
  * communication between them.
  *
@@ -43,9 +46,14 @@ void init_flashsim(void) {
    * Second Pipe - Parent read, child writes
    */
   int parent_write_pipefd[2], parent_read_pipefd[2];
+  int shm_fd;
+  ShmRings *rings;
 
   /* TODO: Make a macro for throwing these errors/exceptions */
 
+  /* Shared rings - Must exist before fork so that child inherits the fd */
+  rings = ShmRings::Create(&shm_fd);
+
   /* Open pipes */
   ret = pipe(parent_write_pipefd);
   if (ret < 0) {
@@ -66,11 +74,12 @@ void init_flashsim(void) {
     assert(0 && "Failure in forking child");
 
   } else if (Common.child_pid == 0) {
-    char *newargv[] = {CHILD_EXE_PATH, NULL, NULL, NULL};
+    char *newargv[] = {CHILD_EXE_PATH, NULL, NULL, NULL, NULL};
     char *newenviron[] = {NULL};
 
     char rx_pipe_fd[MAX_PIPEFD_STR_LEN];
     char tx_pipe_fd[MAX_PIPEFD_STR_LEN];
+    char shm_fd_str[MAX_PIPEFD_STR_LEN];
 
 #if MEMCHECK_ENABLED
 #if (STACK_CHECK == STACK_CHECK_EXPANSION)
@@ -103,6 +112,7 @@ void init_flashsim(void) {
              parent_write_pipefd[PIPE_RX_END]);
     snprintf(tx_pipe_fd, sizeof(tx_pipe_fd), "%02d",
              parent_read_pipefd[PIPE_TX_END]);
+    snprintf(shm_fd_str, sizeof(shm_fd_str), "%02d", shm_fd);
 
     /*
      * Pass information to child in argv as calling execve
@@ -110,6 +120,7 @@ void init_flashsim(void) {
      */
     newargv[CHILD_PIPE_RX_FD_ARGV_OFF] = rx_pipe_fd;
     newargv[CHILD_PIPE_TX_FD_ARGV_OFF] = tx_pipe_fd;
+    newargv[CHILD_SHM_FD_ARGV_OFF] = shm_fd_str;
 
 #if MEMCHECK_ENABLED
 
@@ -140,7 +151,6 @@ void init_flashsim(void) {
     }
 
   } else {
-    struct pollfd pollfd;
     int ret;
 
     /*
@@ -163,15 +173,20 @@ void init_flashsim(void) {
     Common.pipefd[PIPE_RX_END] = parent_read_pipefd[PIPE_RX_END];
     Common.pipefd[PIPE_TX_END] = parent_write_pipefd[PIPE_TX_END];
 
-    /* First wait for child to be up - Then init memcheck */
-
-    pollfd.fd = Common.pipefd[PIPE_RX_END];
-    pollfd.events = POLLIN;
+    /* Parent stays mapped, the fd was only needed by child */
+    ret = close(shm_fd);
+    if (ret < 0) {
+      perror("FATAL: Couldn't close shared memory");
+      assert(0 && "Failure in closing shared memory");
+    }
 
-    do {
-      ret = poll(&pollfd, 1, -1);
+    Common.rx_ring = &rings->to_flashsim;
+    Common.tx_ring = &rings->to_ftl;
+    Common.reply_ring = &rings->replies_to_ftl;
+    Common.host_op_time = &rings->host_op_time;
 
-    } while (ret < 0 && errno == EINTR);
+    /* First wait for child to be up - Then init memcheck */
+    Common.rx_ring->WaitReadable(Common.pipefd[PIPE_RX_END]);
 
 #if MEMCHECK_ENABLED
     ret = init_memcheck_parent(Common.child_pid);
@@ -220,7 +235,7 @@ void deinit_flashsim(void) {
     perror("Couldn't kill child. Resources might not be freed");
     assert(0 && "Child still running");
   }
-  /* Can close pipes also */
+  /* Can close pipes and unmap rings also */
 }
 
 FTLBase<TEST_PAGE_TYPE> *FlashSimTest::CreateFlashSimFTL(
@@ -232,4 +247,407 @@ FTLBase<TEST_PAGE_TYPE> *FlashSimTest::CreateFlashSimFTL(
 void init_flashsim(void) {}
 
 void deinit_flashsim(void) {}
+
+bool FTLMeter::in_ftl;
+
+#if MEMMETER_ENABLED
+
+/* Size of the FTL stack - Far more than it's expected to use */
+#define FTL_STACK_SIZE (1024 * 1024)
+
+/*
+ * Bytes malloc takes from the heap for an allocation: Its size field
+ * (which the payload overlaps by one word), rounded to 16 bytes,
+ * and never less than a minimum sized chunk
+ */
+#define MALLOC_CHUNK_SIZE(size) MAX((size_t)32, ((size) + 8 + 15) & ~(size_t)15)
+
+/*
+ * How malloc grows the heap: By what a request needs plus MALLOC_TOP_PAD,
+ * page aligned. Requests of at least MMAP_THRESHOLD_MAX are mapped apart
+ * from the heap instead. These are what the child sets with mallopt(), which
+ * also fixes the mmap threshold. Its heap starts out as that of any process
+ * with the same libraries, grown before main() with glibc's defaults
+ */
+#define PAGE_ALIGN(size) (((size) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+
+/* Number of slots the table of charges starts with */
+#define CHARGES_MIN_SLOTS 1024
+
+/* Bounds of the static data of the process, from the linker */
+extern char __data_start[], end[];
+
+/* The allocator of glibc, which the functions below stand in front of */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+}
+
+/* Memory usage of the FTL */
+static struct {
+  /* Bytes of chunks the FTL has allocated from the heap now, and at most */
+  size_t cur_alloc_size;
+  size_t max_alloc_size;
+
+  /* Bytes of chunks the libraries allocated before main() */
+  size_t base_alloc_size;
+
+  /*
+   * Size the heap of a process holding only the FTL would have grown to,
+   * which is the most it had as the heap isn't shrunk
+   */
+  size_t max_heap_size;
+
+  /* The FTL stack - Lowest page is a guard page */
+  char *stack;
+
+  /* Contexts on and off the FTL stack */
+  ucontext_t ftl_ctx;
+  ucontext_t host_ctx;
+
+  /* Call to be made on the FTL stack */
+  void (*body)(void *);
+  void *arg;
+
+  /* Call the FTL asked to be made off its stack, if any */
+  void (*host_body)(void *);
+  void *host_arg;
+} meter;
+
+/*
+ * Allocations the FTL made that haven't been freed, by address. An open
+ * addressing table mapped apart from the heap, so keeping it doesn't
+ * allocate
+ */
+struct Charge {
+  uintptr_t addr;
+  size_t size;
+  bool mapped;
+};
+
+static struct {
+  Charge *slots;
+  size_t num_slots; /* Power of 2 */
+  size_t num_used;
+} charges;
+
+/* Exception thrown on one stack, to be rethrown on the other */
+static std::exception_ptr meter_error;
+
+/* Slot an allocation is looked for from */
+static size_t charge_home(uintptr_t addr) {
+  return (size_t)(((addr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) &
+         (charges.num_slots - 1);
+}
+
+/* Slot of an allocation, or the free slot it would go in */
+static Charge *charge_find(uintptr_t addr) {
+  size_t slot = charge_home(addr);
+
+  while (charges.slots[slot].addr != 0 && charges.slots[slot].addr != addr)
+    slot = (slot + 1) & (charges.num_slots - 1);
+
+  return &charges.slots[slot];
+}
+
+/* Doubles the number of slots */
+static void charges_grow(void) {
+  Charge *old_slots = charges.slots;
+  size_t old_num_slots = charges.num_slots;
+  size_t num_slots = MAX((size_t)CHARGES_MIN_SLOTS, 2 * old_num_slots);
+
+  charges.slots =
+      (Charge *)mmap(NULL, num_slots * sizeof(Charge), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (charges.slots == MAP_FAILED) {
+    perror("FATAL: Couldn't map FTL allocation table");
+    assert(0 && "Failure in mapping FTL allocation table");
+  }
+  charges.num_slots = num_slots;
+
+  for (size_t i = 0; i < old_num_slots; i++) {
+    if (old_slots[i].addr != 0) *charge_find(old_slots[i].addr) = old_slots[i];
+  }
+
+  if (old_slots != NULL) munmap(old_slots, old_num_slots * sizeof(Charge));
+}
+
+/*
+ * Empties a slot, moving back the allocations after it that can't be
+ * found past an empty slot otherwise
+ */
+static void charge_remove(Charge *charge) {
+  size_t mask = charges.num_slots - 1;
+  size_t hole = charge - charges.slots;
+  size_t slot = hole;
+
+  while (1) {
+    slot = (slot + 1) & mask;
+    if (charges.slots[slot].addr == 0) break;
+
+    /* Movable if the hole is between its home slot and where it is */
+    size_t home = charge_home(charges.slots[slot].addr);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      charges.slots[hole] = charges.slots[slot];
+      hole = slot;
+    }
+  }
+
+  charges.slots[hole].addr = 0;
+  charges.num_used--;
+}
+
+/*
+ * Charges an allocation to the FTL, growing the heap as malloc would for a
+ * process holding only the FTL
+ */
+static void meter_alloc(void *p, size_t size) {
+  size_t chunk_size = MALLOC_CHUNK_SIZE(size);
+  size_t heap_used;
+  Charge *charge;
+
+  if (p == NULL) return;
+
+  if (2 * (charges.num_used + 1) > charges.num_slots) charges_grow();
+  charge = charge_find((uintptr_t)p);
+  charge->addr = (uintptr_t)p;
+  charges.num_used++;
+
+  /* Mapped chunks aren't part of the heap */
+  charge->mapped = chunk_size >= MMAP_THRESHOLD_MAX;
+  if (charge->mapped) {
+    charge->size = PAGE_ALIGN(chunk_size + 8);
+    return;
+  }
+  charge->size = chunk_size;
+
+  meter.cur_alloc_size += chunk_size;
+  meter.max_alloc_size = MAX(meter.max_alloc_size, meter.cur_alloc_size);
+  heap_used = meter.base_alloc_size + meter.cur_alloc_size;
+  if (heap_used > meter.max_heap_size) {
+    meter.max_heap_size = PAGE_ALIGN(heap_used + MALLOC_TOP_PAD + 32);
+  }
+}
+
+/*
+ * Takes the heap as it is before main(), once the libraries (e.g. the
+ * exception pool of libstdc++) have allocated, for that of the child
+ */
+__attribute__((constructor(101))) static void meter_init(void) {
+  struct mallinfo2 info = mallinfo2();
+
+  meter.base_alloc_size = info.uordblks;
+  meter.max_heap_size = info.arena;
+}
+
+/* Whether an allocation is charged to the FTL */
+static bool meter_charged(void *p) {
+  if (p == NULL || charges.num_used == 0) return false;
+
+  return charge_find((uintptr_t)p)->addr != 0;
+}
+
+/* Uncharges an allocation, if it's the FTL's */
+static void meter_free(void *p) {
+  Charge *charge;
+
+  if (!meter_charged(p)) return;
+
+  charge = charge_find((uintptr_t)p);
+
+  if (!charge->mapped) meter.cur_alloc_size -= charge->size;
+
+  charge_remove(charge);
+}
+
+/*
+ * Charge allocations made while the FTL runs to it, whether made with new
+ * or malloc. Whoever frees them uncharges the FTL. Aligned allocations
+ * (memalign and the like) aren't charged
+ */
+void *malloc(size_t size) noexcept {
+  void *p = __libc_malloc(size);
+
+  if (FTLMeter::in_ftl) meter_alloc(p, size);
+  return p;
+}
+
+void *calloc(size_t num, size_t size) noexcept {
+  void *p = __libc_calloc(num, size);
+
+  /* Doesn't overflow when calloc succeeds */
+  if (FTLMeter::in_ftl) meter_alloc(p, num * size);
+  return p;
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  bool charged = FTLMeter::in_ftl || meter_charged(p);
+  void *new_p = __libc_realloc(p, size);
+
+  /* Failed, p is left as it was */
+  if (new_p == NULL && size != 0) return NULL;
+
+  /* Stays charged to whoever it was, held twice while moved */
+  if (new_p != p) {
+    if (charged) meter_alloc(new_p, size);
+    meter_free(p);
+  } else {
+    meter_free(p);
+    if (charged) meter_alloc(new_p, size);
+  }
+
+  return new_p;
+}
+
+void free(void *p) noexcept {
+  meter_free(p);
+  __libc_free(p);
+}
+
+/* Switches between the stacks */
+static void switch_stack(ucontext_t *from, ucontext_t *to) {
+  int ret = swapcontext(from, to);
+
+  if (ret < 0) {
+    perror("FATAL: Couldn't switch stack of FTL");
+    assert(0 && "Failure in switching stack of FTL");
+  }
+}
+
+/*
+ * Entry of the FTL stack - Makes the call asked for, then switches back,
+ * and so on
+ */
+static void ftl_stack_main(void) {
+  while (1) {
+    try {
+      meter.body(meter.arg);
+    } catch (...) {
+      meter_error = std::current_exception();
+    }
+
+    switch_stack(&meter.ftl_ctx, &meter.host_ctx);
+  }
+}
+
+/*
+ * Maps the FTL stack, fills it with canaries and sets up a context that
+ * starts on it
+ */
+static void init_ftl_stack(void) {
+  unsigned int *canary_p;
+  int ret;
+
+  meter.stack = (char *)mmap(NULL, FTL_STACK_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (meter.stack == MAP_FAILED) {
+    perror("FATAL: Couldn't map FTL stack");
+    assert(0 && "Failure in mapping FTL stack");
+  }
+
+  /* Overflowing the stack should fault, not corrupt memory below it */
+  ret = mprotect(meter.stack, PAGE_SIZE, PROT_NONE);
+  if (ret < 0) {
+    perror("FATAL: Couldn't protect FTL stack guard page");
+    assert(0 && "Failure in protecting FTL stack guard page");
+  }
+
+  for (canary_p = (unsigned int *)(meter.stack + PAGE_SIZE);
+       canary_p < (unsigned int *)(meter.stack + FTL_STACK_SIZE); canary_p++)
+    *canary_p = STACK_CANARY;
+
+  ret = getcontext(&meter.ftl_ctx);
+  if (ret < 0) {
+    perror("FATAL: Couldn't get context");
+    assert(0 && "Failure in getting context");
+  }
+
+  meter.ftl_ctx.uc_stack.ss_sp = meter.stack + PAGE_SIZE;
+  meter.ftl_ctx.uc_stack.ss_size = FTL_STACK_SIZE - PAGE_SIZE;
+  meter.ftl_ctx.uc_link = NULL;
+  makecontext(&meter.ftl_ctx, ftl_stack_main, 0);
+}
+
+/* Rethrows an exception thrown on the other stack */
+static void rethrow_meter_error(void) {
+  if (meter_error) {
+    std::exception_ptr err = meter_error;
+    meter_error = nullptr;
+    std::rethrow_exception(err);
+  }
+}
+
+void FTLMeter::RunOnStack(void (*body)(void *), void *arg) {
+  assert(!in_ftl && "FTL called into while running");
+
+  if (meter.stack == NULL) init_ftl_stack();
+
+  meter.body = body;
+  meter.arg = arg;
+
+  in_ftl = true;
+  switch_stack(&meter.host_ctx, &meter.ftl_ctx);
+
+  /* Make the calls the FTL asks for off its stack, until it returns */
+  while (meter.host_body != NULL) {
+    in_ftl = false;
+    try {
+      meter.host_body(meter.host_arg);
+    } catch (...) {
+      meter_error = std::current_exception();
+    }
+    meter.host_body = NULL;
+
+    in_ftl = true;
+    switch_stack(&meter.host_ctx, &meter.ftl_ctx);
+  }
+  in_ftl = false;
+
+  rethrow_meter_error();
+}
+
+void FTLMeter::RunOffStack(void (*body)(void *), void *arg) {
+  meter.host_body = body;
+  meter.host_arg = arg;
+
+  switch_stack(&meter.ftl_ctx, &meter.host_ctx);
+
+  rethrow_meter_error();
+}
+
+size_t FTLMeter::GetHeapSize(void) { return meter.max_heap_size; }
+
+size_t FTLMeter::GetAllocSize(void) { return meter.max_alloc_size; }
+
+/*
+ * Pages with static data, as the child's writable image and the anonymous
+ * mapping after it are counted by memcheck. This is the whole process's, so
+ * the test's and the simulator's statics are charged along with the FTL's,
+ * much as the child's image carries those of its IPC loop
+ */
+size_t FTLMeter::GetDataSize(void) {
+  uintptr_t page_mask = ~(uintptr_t)(PAGE_SIZE - 1);
+  uintptr_t start = (uintptr_t)__data_start & page_mask;
+  uintptr_t stop = ((uintptr_t)end + PAGE_SIZE - 1) & page_mask;
+
+  return stop - start;
+}
+
+/* The FTL stack is used down to the lowest canary overwritten */
+size_t FTLMeter::GetStackSize(void) {
+  unsigned int *canary_p;
+
+  if (meter.stack == NULL) return 0;
+
+  canary_p = (unsigned int *)(meter.stack + PAGE_SIZE);
+  while (canary_p < (unsigned int *)(meter.stack + FTL_STACK_SIZE) &&
+         *canary_p == STACK_CANARY)
+    canary_p++;
+
+  return (meter.stack + FTL_STACK_SIZE) - (char *)canary_p;
+}
+
+#endif /* MEMMETER_ENABLED */
 #endif /* CONFIG_TWOPROC */
\ No newline at end of file
@@ -14,7 +14,19 @@
  * @author (Tweaked) Ankush Jain (ankushj)
  */
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <unordered_map>
 
 #include "common.h"
 #include "config.h"
@@ -23,7 +35,7 @@
 #include "myFTL.h"
 #endif
 
-/* Maximum number of pages */
+/* Minimum number of pages in the data store - Grows with larger geometries */
 #define MAX_NUM_PAGES (1 << 20)
 
 /* Random data to write - Used by data store*/
@@ -95,6 +107,70 @@ class FlashSimException : public std::exception {
 
 /*************************** class Configuration starts ***********************/
 
+/*
+ * struct FlashSimConfValues - Every value FlashSimConf knows about, converted
+ *                             from the configuration file once when it is
+ *                             loaded
+ *
+ * Optional keys that are absent hold 0, or their default if they have one.
+ * The grading keys come in groups that are either all present or all
+ * absent, and the has_* flags tell which groups are there.
+ */
+struct FlashSimConfValues {
+  /* Geometry and lifetime */
+  size_t ssd_size;
+  size_t package_size;
+  size_t die_size;
+  size_t plane_size;
+  size_t block_size;
+  size_t block_erases;
+  size_t overprovisioning;
+
+  /* Pages in each level of the geometry, derived from the sizes above */
+  size_t pages_per_plane;
+  size_t pages_per_die;
+  size_t pages_per_package;
+  size_t pages_per_ssd;
+
+  /* FTL tuning */
+  size_t gc_policy;
+  size_t gc_low_watermark;
+  size_t gc_high_watermark;
+  size_t gc_max_pages_per_write;
+  size_t wear_leveling_threshold;
+  size_t mapping_cache_size;
+  size_t translation_page_entries;
+  size_t allocation_striping;
+
+  /* Checkpoint 3 grading */
+  bool has_grading;
+  size_t memory_baseline;
+  size_t writes_baseline;
+  double write_amplification_threshold;
+  double writes_threshold;
+
+  bool has_weights_infinite;
+  size_t weight_write_amplification_infinite;
+  size_t weight_memory_infinite;
+  size_t weight_endurance_infinite;
+
+  bool has_weights_finite;
+  size_t weight_write_amplification_finite;
+  size_t weight_memory_finite;
+
+  /* Simulated timing */
+  size_t read_latency;
+  size_t program_latency;
+  size_t erase_latency;
+  size_t bus_latency;
+  size_t host_queue_depth;
+
+  /* Host operations kept in flight by the queue API of FlashSimTest */
+  size_t host_op_window;
+
+  size_t datastore_backend;
+};
+
 /*
  * class FlashSimConf - Contains all flash configuration information taken from
  * configuration file
@@ -109,8 +185,10 @@ class FlashSimException : public std::exception {
  * PARAMETER_2 1001
  *
  * Empty lines are ignored
- * All values are stored as strings. If you want to get a numeric literal
- * out of it, please call the corresponding method
+ * All values are stored as strings. The values of the keys the simulator
+ * knows about are also checked and converted into a FlashSimConfValues right
+ * away, so a malformed value fails the load instead of the first use, and
+ * the typed getters below just read a field.
  */
 class FlashSimConf : public ConfBase {
  private:
@@ -125,9 +203,12 @@ class FlashSimConf : public ConfBase {
    */
   std::map<std::string, std::pair<std::string, int>> configuration_map;
 
+  /* The known keys, converted */
+  FlashSimConfValues values;
+
  public:
   FlashSimConf(const std::string &p_file_name)
-      : file_name{p_file_name}, configuration_map{} {
+      : file_name{p_file_name}, configuration_map{}, values() {
     /* Open the file */
     std::ifstream fp{file_name};
 
@@ -240,6 +321,8 @@ class FlashSimConf : public ConfBase {
       configuration_map[key] = std::make_pair(value, line_num);
     } /* while fp is not EOF */
 
+    ParseValues();
+
     return;
   }
 
@@ -278,54 +361,76 @@ class FlashSimConf : public ConfBase {
     return;
   }
 
+  /* Returns the converted values of all known keys */
+  const FlashSimConfValues &Values() const { return values; }
+
   /* Functions overriding base class virtual functions */
 
   /* Returns the number of packages in flash */
-  size_t GetSSDSize(void) const { return (size_t)GetInteger(CONF_S_SSD_SIZE); }
+  size_t GetSSDSize(void) const { return values.ssd_size; }
 
   /* Returns the number of dies in flash */
-  size_t GetPackageSize(void) const {
-    return (size_t)GetInteger(CONF_S_PACKAGE_SIZE);
-  }
+  size_t GetPackageSize(void) const { return values.package_size; }
 
   /* Returns the number of planes in flash */
-  size_t GetDieSize(void) const { return (size_t)GetInteger(CONF_S_DIE_SIZE); }
+  size_t GetDieSize(void) const { return values.die_size; }
 
   /* Returns the number of blocks in flash */
-  size_t GetPlaneSize(void) const {
-    return (size_t)GetInteger(CONF_S_PLANE_SIZE);
-  }
+  size_t GetPlaneSize(void) const { return values.plane_size; }
 
   /* Returns the number of pages in flash */
-  size_t GetBlockSize(void) const {
-    return (size_t)GetInteger(CONF_S_BLOCK_SIZE);
-  }
+  size_t GetBlockSize(void) const { return values.block_size; }
 
   /* Returns the block lifetime of flash */
-  size_t GetBlockEraseCount(void) const {
-    return (size_t)GetInteger(CONF_S_BLOCK_ERASES);
+  size_t GetBlockEraseCount(void) const { return values.block_erases; }
+
+  /* Returns the garbage collection policy of flash, greedy if not set */
+  virtual size_t GetGCPolicy(void) const { return values.gc_policy; }
+
+  /* Returns the overprovisioning (as percentage) of flash */
+  size_t GetOverprovisioning(void) const { return values.overprovisioning; }
+
+  /* Returns the free block count at which incremental GC starts */
+  size_t GetGCLowWatermark(void) const { return values.gc_low_watermark; }
+
+  /* Returns the free block count at which incremental GC stops */
+  size_t GetGCHighWatermark(void) const { return values.gc_high_watermark; }
+
+  /* Returns the max pages incremental GC migrates per write */
+  size_t GetGCMaxPagesPerWrite(void) const {
+    return values.gc_max_pages_per_write;
   }
 
-  /* Returns the garbage collection policy of flash */
-  virtual size_t GetGCPolicy(void) const {
-    return (size_t)GetInteger(CONF_S_GCPOLICY);
+  /* Returns the erase count spread that triggers wear leveling */
+  size_t GetWearLevelingThreshold(void) const {
+    return values.wear_leveling_threshold;
   }
 
-  /* Returns the overprovisioning (as percentage) of flash */
-  size_t GetOverprovisioning(void) const {
-    return (size_t)GetInteger(CONF_S_OVERPROVISIONING);
+  /* Returns the RAM (in bytes) the FTL may use for cached mappings */
+  size_t GetMappingCacheSize(void) const { return values.mapping_cache_size; }
+
+  /* Returns the number of mappings per translation page */
+  size_t GetTranslationPageEntries(void) const {
+    return values.translation_page_entries;
+  }
+
+  /* Returns how host writes are striped over dies or planes */
+  size_t GetAllocationStriping(void) const {
+    return values.allocation_striping;
   }
 
   // Configs for checkpoint 3 grading
 
   /* Returns the amount of memory under which full credit is assigned */
   size_t GetMemoryBaseline(void) const {
-    return (size_t)GetInteger(CONF_S_MEMORY_BASELINE);
+    RequireGroup(values.has_grading, CONF_S_MEMORY_BASELINE);
+    return values.memory_baseline;
   }
 
   /* Returns the number of writes which should be possible to achieve */
   size_t GetWritesBaseline(void) const {
-    return (size_t)GetInteger(CONF_S_WRITES_BASELINE);
+    RequireGroup(values.has_grading, CONF_S_WRITES_BASELINE);
+    return values.writes_baseline;
   }
 
   /* Returns the multiplier applied to total writes for an FTL design
@@ -333,7 +438,8 @@ class FlashSimConf : public ConfBase {
    * calculating the write amplification score.
    */
   double GetWriteAmplificationThreshold(void) const {
-    return GetDouble(CONF_S_WRITE_AMPLIFICATION_THRESHOLD);
+    RequireGroup(values.has_grading, CONF_S_WRITE_AMPLIFICATION_THRESHOLD);
+    return values.write_amplification_threshold;
   }
 
   /* Returns the multiplier applied to total writes for an FTL design
@@ -341,44 +447,76 @@ class FlashSimConf : public ConfBase {
    * calculating the write endurance score.
    */
   double GetWritesThreshold(void) const {
-    return GetDouble(CONF_S_WRITES_THRESHOLD);
+    RequireGroup(values.has_grading, CONF_S_WRITES_THRESHOLD);
+    return values.writes_threshold;
   }
 
   /* Returns the weight (out of 100) attributed to write amplification for
    * infinite-running tests.
    */
   size_t GetWeightWriteAmplificationInfinite(void) const {
-    return (size_t)GetInteger(CONF_S_WEIGHT_WRITE_AMPLIFICATION_INFINITE);
+    RequireGroup(values.has_weights_infinite,
+                 CONF_S_WEIGHT_WRITE_AMPLIFICATION_INFINITE);
+    return values.weight_write_amplification_infinite;
   }
 
   /* Returns the weight (out of 100) attributed to memory usage for
    * infinite-running tests.
    */
   size_t GetWeightMemoryInfinite(void) const {
-    return (size_t)GetInteger(CONF_S_WEIGHT_MEMORY_INFINITE);
+    RequireGroup(values.has_weights_infinite, CONF_S_WEIGHT_MEMORY_INFINITE);
+    return values.weight_memory_infinite;
   }
 
   /* Returns the weight (out of 100) attributed to write endurance for
    * infinite-running tests.
    */
   size_t GetWeightEnduranceInfinite(void) const {
-    return (size_t)GetInteger(CONF_S_WEIGHT_ENDURANCE_INFINITE);
+    RequireGroup(values.has_weights_infinite,
+                 CONF_S_WEIGHT_ENDURANCE_INFINITE);
+    return values.weight_endurance_infinite;
   }
 
   /* Returns the weight (out of 100) attributed to write amplification for
    * finite-running tests.
    */
   size_t GetWeightWriteAmplificationFinite(void) const {
-    return (size_t)GetInteger(CONF_S_WEIGHT_WRITE_AMPLIFICATION_FINITE);
+    RequireGroup(values.has_weights_finite,
+                 CONF_S_WEIGHT_WRITE_AMPLIFICATION_FINITE);
+    return values.weight_write_amplification_finite;
   }
 
   /* Returns the weight (out of 100) attributed to memory usage for
    * finite-running tests.
    */
   size_t GetWeightMemoryFinite(void) const {
-    return (size_t)GetInteger(CONF_S_WEIGHT_MEMORY_FINITE);
+    RequireGroup(values.has_weights_finite, CONF_S_WEIGHT_MEMORY_FINITE);
+    return values.weight_memory_finite;
   }
 
+  // Simulated timing, 0 when not configured
+
+  /* Returns the time (us) to read a page into the plane's register */
+  size_t GetReadLatency(void) const { return values.read_latency; }
+
+  /* Returns the time (us) to program a page from the plane's register */
+  size_t GetProgramLatency(void) const { return values.program_latency; }
+
+  /* Returns the time (us) to erase a block */
+  size_t GetEraseLatency(void) const { return values.erase_latency; }
+
+  /* Returns the time (us) to transfer a page between controller and die */
+  size_t GetBusLatency(void) const { return values.bus_latency; }
+
+  /* Returns how many host operations the simulated host keeps in flight */
+  size_t GetHostQueueDepth(void) const { return values.host_queue_depth; }
+
+  /* Returns how many submitted host operations FTL may be working on */
+  size_t GetHostOpWindow(void) const { return values.host_op_window; }
+
+  /* Returns where the data store keeps pages, the sparse file if not set */
+  size_t GetDataStoreBackend(void) const { return values.datastore_backend; }
+
   /*
    * GetString() - Returns a string which is the value of some key
    *
@@ -407,27 +545,30 @@ class FlashSimConf : public ConfBase {
    * GetInteger() - Fetch the value of a given key and convert it into an
    *                integer
    *
-   * Note that the value must be convertable to an integer, otherwise the
-   * behavior is undefined, and should not be relied on
-   *
-   * Accepted forms of integer are:
-   *
-   *   0ddd...d octoal
-   *   dddd...d decimal
-   *   0xdd...d hex
-   *   0Xdd...d hex
-   *
-   * where d is 0 - 7 for octal, 0 - 9 for decimal, and 0 - 9, a-f, A-F
-   * for hex integers.
-   *
-   * When only part of the string forms an integer starting from the
-   * beginning, the integer returned is the integer formed by the prefix
-   * of the value string. The remianing parts will be discarded.
+   * The value must be a decimal integer (optionally signed) in the range of
+   * int, and nothing else, otherwise an exception is thrown
    */
   int GetInteger(const std::string &key) const {
-    const std::string value = GetString(key);
+    long long value = ParseInteger(key);
+
+    if (value < std::numeric_limits<int>::min() ||
+        value > std::numeric_limits<int>::max()) {
+      ThrowMalformedValueError(key, "an int");
+    }
 
-    return std::stoi(value);
+    return int(value);
+  }
+
+  /*
+   * GetOptionalInteger() - Same as GetInteger(), but returns 0 instead of
+   *                        throwing when the key is not in the file
+   */
+  int GetOptionalInteger(const std::string &key) const {
+    if (configuration_map.find(key) == configuration_map.end()) {
+      return 0;
+    }
+
+    return GetInteger(key);
   }
 
   /*
@@ -435,14 +576,189 @@ class FlashSimConf : public ConfBase {
    *               double
    */
   double GetDouble(const std::string &key) const {
-    const std::string value = GetString(key);
+    const std::string &value = GetString(key);
+    const char *begin = value.c_str();
+    char *end;
+
+    errno = 0;
+    double ret = strtod(begin, &end);
+    if (end == begin || *end != '\0' || errno != 0) {
+      ThrowMalformedValueError(key, "a number");
+    }
 
-    return std::stod(value);
+    return ret;
   }
 
  private:
   /* Functions only used internally by the class */
 
+  /*
+   * ParseValues() - Converts the values of all known keys into the
+   *                 values struct
+   *
+   * Throws if a required key is missing, if only part of a group of
+   * grading keys is given, or if any value is malformed
+   */
+  void ParseValues() {
+    values.ssd_size = RequiredSize(CONF_S_SSD_SIZE, 1);
+    values.package_size = RequiredSize(CONF_S_PACKAGE_SIZE, 1);
+    values.die_size = RequiredSize(CONF_S_DIE_SIZE, 1);
+    values.plane_size = RequiredSize(CONF_S_PLANE_SIZE, 1);
+    values.block_size = RequiredSize(CONF_S_BLOCK_SIZE, 1);
+    values.block_erases = RequiredSize(CONF_S_BLOCK_ERASES, 1);
+    values.overprovisioning = RequiredSize(CONF_S_OVERPROVISIONING, 0);
+
+    values.pages_per_plane = values.plane_size * values.block_size;
+    values.pages_per_die = values.die_size * values.pages_per_plane;
+    values.pages_per_package = values.package_size * values.pages_per_die;
+    values.pages_per_ssd = values.ssd_size * values.pages_per_package;
+
+    values.gc_policy = OptionalSize(CONF_S_GCPOLICY, GC_POLICY_GREEDY);
+    values.gc_low_watermark = OptionalSize(CONF_S_GC_LOW_WATERMARK, 0);
+    values.gc_high_watermark = OptionalSize(CONF_S_GC_HIGH_WATERMARK, 0);
+    values.gc_max_pages_per_write =
+        OptionalSize(CONF_S_GC_MAX_PAGES_PER_WRITE, 0);
+    values.wear_leveling_threshold =
+        OptionalSize(CONF_S_WEAR_LEVELING_THRESHOLD, 0);
+    values.mapping_cache_size = OptionalSize(CONF_S_MAPPING_CACHE_SIZE, 0);
+    values.translation_page_entries =
+        OptionalSize(CONF_S_TRANSLATION_PAGE_ENTRIES, 0);
+    values.allocation_striping = OptionalSize(CONF_S_ALLOCATION_STRIPING, 0);
+
+    values.has_grading = HasGroup(
+        {CONF_S_MEMORY_BASELINE, CONF_S_WRITES_BASELINE,
+         CONF_S_WRITE_AMPLIFICATION_THRESHOLD, CONF_S_WRITES_THRESHOLD});
+    if (values.has_grading) {
+      values.memory_baseline = RequiredSize(CONF_S_MEMORY_BASELINE, 0);
+      values.writes_baseline = RequiredSize(CONF_S_WRITES_BASELINE, 0);
+      values.write_amplification_threshold =
+          GetDouble(CONF_S_WRITE_AMPLIFICATION_THRESHOLD);
+      values.writes_threshold = GetDouble(CONF_S_WRITES_THRESHOLD);
+    }
+
+    values.has_weights_infinite =
+        HasGroup({CONF_S_WEIGHT_WRITE_AMPLIFICATION_INFINITE,
+                  CONF_S_WEIGHT_MEMORY_INFINITE,
+                  CONF_S_WEIGHT_ENDURANCE_INFINITE});
+    if (values.has_weights_infinite) {
+      values.weight_write_amplification_infinite =
+          RequiredSize(CONF_S_WEIGHT_WRITE_AMPLIFICATION_INFINITE, 0);
+      values.weight_memory_infinite =
+          RequiredSize(CONF_S_WEIGHT_MEMORY_INFINITE, 0);
+      values.weight_endurance_infinite =
+          RequiredSize(CONF_S_WEIGHT_ENDURANCE_INFINITE, 0);
+    }
+
+    values.has_weights_finite =
+        HasGroup({CONF_S_WEIGHT_WRITE_AMPLIFICATION_FINITE,
+                  CONF_S_WEIGHT_MEMORY_FINITE});
+    if (values.has_weights_finite) {
+      values.weight_write_amplification_finite =
+          RequiredSize(CONF_S_WEIGHT_WRITE_AMPLIFICATION_FINITE, 0);
+      values.weight_memory_finite =
+          RequiredSize(CONF_S_WEIGHT_MEMORY_FINITE, 0);
+    }
+
+    values.read_latency = OptionalSize(CONF_S_READ_LATENCY, 0);
+    values.program_latency = OptionalSize(CONF_S_PROGRAM_LATENCY, 0);
+    values.erase_latency = OptionalSize(CONF_S_ERASE_LATENCY, 0);
+    values.bus_latency = OptionalSize(CONF_S_BUS_LATENCY, 0);
+    values.host_queue_depth = OptionalSize(CONF_S_HOST_QUEUE_DEPTH, 0);
+
+    values.host_op_window =
+        OptionalSize(CONF_S_HOST_OP_WINDOW, DEFAULT_HOST_OP_WINDOW);
+    if (values.host_op_window < 1 ||
+        values.host_op_window > MAX_HOST_OP_WINDOW) {
+      ThrowMalformedValueError(
+          CONF_S_HOST_OP_WINDOW,
+          "between 1 and " + std::to_string(MAX_HOST_OP_WINDOW));
+    }
+
+    values.datastore_backend =
+        OptionalSize(CONF_S_DATASTORE_BACKEND, DS_BACKEND_FILE);
+
+    return;
+  }
+
+  /*
+   * ParseInteger() - Converts the value of a key, which must be a decimal
+   *                  integer and nothing else
+   */
+  long long ParseInteger(const std::string &key) const {
+    const std::string &value = GetString(key);
+    const char *begin = value.c_str();
+    char *end;
+
+    errno = 0;
+    long long ret = strtoll(begin, &end, 10);
+    if (end == begin || *end != '\0' || errno != 0) {
+      ThrowMalformedValueError(key, "an integer");
+    }
+
+    return ret;
+  }
+
+  /*
+   * RequiredSize() - Converts the value of a key that must be in the file
+   *                  and be at least min_value
+   */
+  size_t RequiredSize(const char *key, size_t min_value) const {
+    long long value = ParseInteger(key);
+
+    if (value < 0 || size_t(value) < min_value) {
+      ThrowMalformedValueError(key, "at least " + std::to_string(min_value));
+    }
+
+    return size_t(value);
+  }
+
+  /*
+   * OptionalSize() - Converts the value of a key that may be absent, in
+   *                  which case default_value is returned
+   */
+  size_t OptionalSize(const char *key, size_t default_value) const {
+    if (configuration_map.find(key) == configuration_map.end()) {
+      return default_value;
+    }
+
+    return RequiredSize(key, 0);
+  }
+
+  /*
+   * HasGroup() - Returns whether the keys of a group are in the file,
+   *              throwing if only some of them are
+   */
+  bool HasGroup(std::initializer_list<const char *> keys) const {
+    size_t found = 0;
+    for (const char *key : keys) {
+      found += configuration_map.count(key);
+    }
+
+    if (found == 0) {
+      return false;
+    }
+
+    if (found < keys.size()) {
+      for (const char *key : keys) {
+        if (configuration_map.count(key) == 0) {
+          ThrowKeyDoesNotExistError(key);
+        }
+      }
+    }
+
+    return true;
+  }
+
+  /*
+   * RequireGroup() - Throws for a key of a group of keys that is not in the
+   *                  file
+   */
+  void RequireGroup(bool present, const char *key) const {
+    if (!present) {
+      ThrowKeyDoesNotExistError(key);
+    }
+  }
+
   /*
    * ThrowFileNotFoundError() - When file open failed call this
    */
@@ -477,6 +793,19 @@ class FlashSimConf : public ConfBase {
   void ThrowKeyDoesNotExistError(const std::string &key) const {
     throw FlashSimException("Key " + key + " does not exist");
   }
+
+  /*
+   * ThrowMalformedValueError() - This error is thrown when the value of a
+   *                              key is not of the expected form
+   */
+  void ThrowMalformedValueError(const std::string &key,
+                                const std::string &expected) const {
+    auto it = configuration_map.find(key);
+    throw FlashSimException("Configuration line " +
+                            std::to_string(it->second.second) + " : value \"" +
+                            it->second.first + "\" of key " + key +
+                            " is not " + expected);
+  }
 };
 
 /***************************** class Configuration ends ***********************/
@@ -484,41 +813,90 @@ class FlashSimConf : public ConfBase {
 /**************************** class DataStore starts **************************/
 
 /*
- * class DataStore - The actual storage where bytes inside SSD is stored
- *
- * Currently we just use a disk temporary file to achieve the effect. In
- * the future this could be extended to use mmap-ed file or even customized
- * page slab allocator (i.e. a memory-disk hybrid one)
+ * class DataStoreBackend - Where the bytes of the data store slots live
  *
- * The data store is abstracted in a way that it consists of an array of
- * slots of a certain size (both slot count and slot size could be configured)
- * by the constructor. Each read or write command just specifies the slot id
- * withoug having to specify the size of slot since they are all known
- * to the module
+ * A backend is a flat array of slot_count slots of sizeof(T) bytes each.
+ * It only moves bytes in and out of slots; DataStore checks slot IDs and
+ * tracks which slots are active before calling into it, so a backend may
+ * assume every slot ID it is given is in bound and, for Read(), written.
  *
- * For the function call that creates a temporary file, see
- *   http://linux.die.net/man/3/tmpfile
+ * The backend is chosen at runtime by DATASTORE_BACKEND in the
+ * configuration file:
  *
- * Note that since the data store layer is regarded as a simulation of real
- * SSD, it also mimics the characteristics of a SSD plus some reinforcing
- * properties:
+ *   DS_BACKEND_FILE   - Sparse temporary file accessed through stdio
+ *   DS_BACKEND_MMAP   - Anonymous MAP_NORESERVE mapping of all slots; only
+ *                       the pages actually written take up memory
+ *   DS_BACKEND_MEMORY - Plain std::vector of all slots, meant for the
+ *                       4 byte test page type
  *
- *   1. A slot could only be read after being written
- *   2. A slot could not be overwritten without being erased in between
- *   3. An active slot could be erased to make it inactive (i.e. ready
- *      for write)
- *   4. A slot becomes active after being written
+ * The last two never touch the file system.
+ */
+template <typename T>
+class DataStoreBackend {
+ public:
+  virtual ~DataStoreBackend() {}
+
+  /* Reads a slot into the given buffer */
+  virtual void Read(T *buffer, size_t slot_id) = 0;
+
+  /* Writes the given data into a slot */
+  virtual void Write(const T &data, size_t slot_id) = 0;
+
+  /*
+   * Discard() - Gives back the storage of slots that were erased, so the
+   *             footprint of the data store follows its live data
+   *
+   * Slots in the range read back as zeros or as their old contents
+   * afterwards; either is fine since DataStore never reads them before
+   * they are written again
+   */
+  virtual void Discard(size_t start_slot_id, size_t end_slot_id) = 0;
+
+  /* Bytes of storage Discard() gives back at once, 0 if it never does */
+  virtual size_t DiscardUnit() = 0;
+
+  /* Bytes of storage actually in use, e.g. allocated blocks */
+  virtual size_t ActualBytes() = 0;
+
+  /* Bytes the slots span, e.g. logical file size */
+  virtual size_t LogicalBytes() = 0;
+
+ protected:
+  /*
+   * AlignInward() - Shrinks the bytes of a slot range to the whole units of
+   *                 the given (power of two) size inside it
+   *
+   * Returns false if no whole unit is inside the range. Units only partly
+   * covered are left alone, since they may still hold live slots.
+   */
+  static bool AlignInward(size_t start_slot_id, size_t end_slot_id,
+                          size_t unit, size_t *begin_p, size_t *end_p) {
+    size_t begin = start_slot_id * sizeof(T);
+    size_t end = (end_slot_id + 1) * sizeof(T);
+
+    begin = (begin + unit - 1) & ~(unit - 1);
+    end &= ~(unit - 1);
+    if (begin >= end) {
+      return false;
+    }
+
+    *begin_p = begin;
+    *end_p = end;
+    return true;
+  }
+};
+
+/*
+ * class FileBackend - Slots stored in a temporary file
  *
- * If any of these conditions are violated an exception will be thrown
+ * For the function call that creates a temporary file, see
+ *   http://linux.die.net/man/3/tmpfile
  *
- * Also note that this class is templatized such that the templated type_
- * must be a plain old data type_, i.e. being trivially copiable by memcpy.
- * This is consistent with the data characteristic in a real SSD
+ * Slots that are never written are never allocated, since the file is
+ * sparse. Platforms without sparse file support are rejected.
  */
-
-/* sizeof(T) is the size of the slot */
 template <typename T>
-class DataStore {
+class FileBackend : public DataStoreBackend<T> {
  private:
   /*
    * File pointer to a temporary file created by system call
@@ -527,17 +905,11 @@ class DataStore {
    */
   FILE *fp;
 
-  /* The number of slots in the data store */
-  size_t slot_count;
-
-  /* This records slots that are currently active */
-  std::unordered_set<size_t> active_slot_set;
+  /* File system block size, the unit holes are punched in */
+  size_t block_bytes;
 
  public:
-  DataStore(size_t p_slot_count)
-      : fp{tmpfile()},            /* Open temp file */
-        slot_count{p_slot_count}, /* Count of slots */
-        active_slot_set{} {
+  FileBackend() : fp{tmpfile()} /* Open temp file */, block_bytes{0} {
     /* Check whether we have created the temp file successfully */
     if (fp == nullptr) {
       ThrowCreateTmpFileError();
@@ -554,52 +926,27 @@ class DataStore {
       ThrowSparseFileNotSupportedError();
     }
 
+    block_bytes = GetFileStat().st_blksize;
+
     return;
   }
 
   /*
-   * ~DataStore() - Closes the temporary file used as data store
+   * ~FileBackend() - Closes the temporary file used as data store
    *
    * It is not a necessary step since the temp file will automatically be
    * closed after program exits
    */
-  ~DataStore() {
+  ~FileBackend() {
     int ret = fclose(fp);
     assert(ret == 0);
 
     return;
   }
 
-  /*
-   * ReadSlot() - Reads a specified slot into the given buffer
-   *
-   * The buffer size must be larger than sizeof(T),
-   * and there is no run time checking to ensure this.
-   * Also if the slot ID is too large then an exception is thrown
-   *
-   * Note that if the slot being read is not active then an exception will
-   * be thrown because all read content will be garbage
-   */
-
-  void ReadSlot(T *buffer, size_t slot_id) {
-    /*
-     * First move file pointer to the correct offset
-     * If slot ID is not valid this will throw an exception
-     * We need to do this before checking for activeness
-     * because out of bound is a more severe error
-     */
+  void Read(T *buffer, size_t slot_id) {
     MoveToSlot(slot_id);
 
-    /*
-     * Then check whether the slot is currently active or not
-     * Note that the order of checking the set and checking bound
-     * are slightly different in ReadSlot() and WriteSlot()
-     */
-    auto it = active_slot_set.find(slot_id);
-    if (it == active_slot_set.end()) {
-      return;
-    }
-
     /*
      * Issue read command,
      * and verify return value which must be a success
@@ -611,30 +958,12 @@ class DataStore {
   }
 
   /*
-   * WriteSlot() - Write buffer content into a given slot
-   *
-   * This function is almost the same as its counterpart ReadSlot(), just
-   * changing fread() to fwrite()
-   *
    * Writing to a slot might result in a sparse file.
    * Since we only keep this file as a temp file it is OK because
    * no external application could read the potentially large file
    * after this program exits
-   * If the slot is currently active then an exception is thrown since
-   * a slot could not be overwritten without being erased first
    */
-
-  void WriteSlot(const T &data, size_t slot_id) {
-    /* First check whether the slot is currently active or not */
-    auto it = active_slot_set.find(slot_id);
-    if (it != active_slot_set.end()) {
-      ThrowOverwriteSlotError(slot_id);
-    }
-
-    /* Insert the slot ID into active set since it is now active */
-    active_slot_set.insert(slot_id);
-
-    /* And then just finish actual write operation */
+  void Write(const T &data, size_t slot_id) {
     MoveToSlot(slot_id);
     int ret = fwrite(&data, sizeof(T), 1, fp);
     assert(ret == 1);
@@ -643,65 +972,43 @@ class DataStore {
   }
 
   /*
-   * EraseSlot() - Mark the slot as not used
-   *
-   * Erasing a slot does not erase data in the file system because that
-   * requires punching a hole in the file which is not a
-   * standard operation.
-   * Therefore, the way we erase a slot is to just remove the slot ID from
-   * the slot id set inside the class to mark the slot as inactive
-   * and next time if a slot is read, an exception will be thrown
-   *
-   * This function is just a wrapper to EraseRange() which is used
-   * for testing but the semantics are the same
-   */
-  void EraseSlot(size_t slot_id) {
-    EraseRange(slot_id, slot_id);
-    return;
-  }
-
-  /*
-   * EraseRange() - Erase all slots in a range
-   *
-   * Arguments start_slot_id and end_slot_id specifies the range of slots
-   * being erased. This range must be valid (i.e. start <= end and
-   * end < slot_count), otherwise an exception will be thrown.
+   * Discard() - Punches a hole over the file system blocks of the range
    *
-   * Also this function treats the range as a single unit for erasure,
-   * i.e. it throws exception only when all slots in the range are empty
-   * this was done before any slot ID is removed from the active slot set
-   *
-   * On an SSD this operation is similar to a block-level erasure, but
-   * here we do not reuqire extra block alignment to make the
-   * implementation slightly simpler
-   */
-  void EraseRange(size_t start_slot_id, size_t end_slot_id) {
-    /* start < end && end < count */
-    if ((start_slot_id > end_slot_id) || (end_slot_id >= slot_count)) {
-      ThrowErasingInvalidRangeError(start_slot_id, end_slot_id);
+   * Pending writes are flushed first so that they do not land in the
+   * hole afterwards. If the file system cannot punch holes the blocks
+   * are simply kept, as they were before
+   */
+  void Discard(size_t start_slot_id, size_t end_slot_id) {
+    size_t begin, end;
+    if (!this->AlignInward(start_slot_id, end_slot_id, DiscardUnit(),
+                           &begin, &end)) {
+      return;
     }
 
-    for (size_t slot_id = start_slot_id; slot_id <= end_slot_id; slot_id++) {
-      auto it = active_slot_set.find(slot_id);
+    int ret = fflush(fp);
+    assert(ret == 0);
 
-      /*
-       * If the iterator is not a valid one then the
-       * slot id is not active and exception will be thrown
-       */
-      if (it != active_slot_set.end()) {
-        active_slot_set.erase(it);
-      }
-    }
+    fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin,
+              end - begin);
 
     return;
   }
 
+  size_t DiscardUnit() { return block_bytes; }
+
+  /* Bytes of the blocks allocated to the file */
+  size_t ActualBytes() { return GetFileStat().st_blocks * 512; }
+
+  /* Logical file size */
+  size_t LogicalBytes() { return GetFileStat().st_size; }
+
+ private:
+  /* Functions only used by the class internally */
+
   /*
-   * Print() - Report logical file size and block usage, etc.
-   *
-   * Note: For this to work, debug must be enabled
+   * GetFileStat() - Flushes stdio buffers and returns the stat of the file
    */
-  void Print() {
+  struct stat GetFileStat() {
     int ret;
 
     /* Must flush the file descriptor first */
@@ -714,16 +1021,9 @@ class DataStore {
     ret = fstat(fno, &info);
     assert(ret == 0);
 
-    dbg_printf("========== Data Store Statictics ==========\n");
-    dbg_printf("Block Usage: %lu\n", info.st_blocks);
-    dbg_printf("Logical File Size: %lu\n", info.st_size);
-
-    return;
+    return info;
   }
 
- private:
-  /* Functions only used by the class internally */
-
   /*
    * DetermineSparseFileSupport() - Determines whether sparse is supported
    *                                on the current platform
@@ -736,11 +1036,6 @@ class DataStore {
    * the current platform. This function creates a temp file that will
    * be deleted after the function returns
    */
-
-  /*
-   * TODO: As an optimization, instead of a file, memory map this file
-   * for faster access - But need to know the max size of the file
-   */
   bool DetermineSparseFileSupport() {
     FILE *fp_temp = tmpfile();
 
@@ -818,19 +1113,8 @@ class DataStore {
    * This function is the common routine for reading and writing the
    * temp file, so we put it as a separate prcedure
    */
-
   void MoveToSlot(size_t slot_id) {
-    /* If the slot is an invalid one just throw exception */
-    if (slot_id >= slot_count) {
-      ThrowSlotOutOfBoundError(slot_id);
-    }
-
     /*
-     * Otherwise get to the offset and issue read to the file system
-     * If the slot has not been written yet then this returns all 0
-     * into the buffer. This is accepted behavior since anyway we
-     * have to validate the value inside the testing routine
-     *
      * Each slot is allocated sizeof(T) bytes only
      */
     size_t byte_offset = slot_id * sizeof(T);
@@ -870,39 +1154,946 @@ class DataStore {
         " by the current platform. Please consider switcing"
         " to a different file system");
   }
+};
+
+/*
+ * class MmapBackend - Slots stored in an anonymous memory mapping
+ *
+ * The mapping covers every slot but is made with MAP_NORESERVE, so no swap
+ * is reserved for it and the kernel only backs the pages that are written,
+ * the same way a sparse file only allocates the blocks that are written.
+ */
+template <typename T>
+class MmapBackend : public DataStoreBackend<T> {
+ private:
+  /* Start of the mapping */
+  T *slots;
+
+  /* Length of the mapping in bytes */
+  size_t length;
+
+ public:
+  MmapBackend(size_t slot_count)
+      : slots{nullptr}, length{slot_count * sizeof(T)} {
+    void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      ThrowMmapError();
+    }
+    slots = static_cast<T *>(p);
+
+    return;
+  }
+
+  ~MmapBackend() {
+    int ret = munmap(slots, length);
+    assert(ret == 0);
+
+    return;
+  }
+
+  void Read(T *buffer, size_t slot_id) {
+    memcpy(buffer, slots + slot_id, sizeof(T));
+  }
+
+  void Write(const T &data, size_t slot_id) {
+    memcpy(slots + slot_id, &data, sizeof(T));
+  }
+
+  /*
+   * Discard() - Drops the memory pages of the range
+   *
+   * The mapping is private and anonymous, so MADV_DONTNEED frees the
+   * pages right away and they read back as zeros
+   */
+  void Discard(size_t start_slot_id, size_t end_slot_id) {
+    size_t begin, end;
+    if (!this->AlignInward(start_slot_id, end_slot_id, DiscardUnit(),
+                           &begin, &end)) {
+      return;
+    }
+
+    int ret = madvise(reinterpret_cast<char *>(slots) + begin, end - begin,
+                      MADV_DONTNEED);
+    assert(ret == 0);
+
+    return;
+  }
+
+  /* Memory page size */
+  size_t DiscardUnit() { return sysconf(_SC_PAGESIZE); }
+
+  /* Bytes of the mapping that are resident in memory */
+  size_t ActualBytes() {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((length + page_size - 1) / page_size);
+
+    int ret = mincore(slots, length, resident.data());
+    assert(ret == 0);
+
+    size_t resident_pages = 0;
+    for (unsigned char page : resident) {
+      resident_pages += page & 1;
+    }
+
+    return resident_pages * page_size;
+  }
+
+  /* Length of the mapping */
+  size_t LogicalBytes() { return length; }
+
+ private:
+  /*
+   * ThrowMmapError() - Throw an error indicating we failed mapping the
+   *                    slots
+   */
+  void ThrowMmapError() const {
+    int t = errno;
+
+    throw FlashSimException("Could not map " + std::to_string(length) +
+                            " bytes for the data store! Errno = " +
+                            std::to_string(t));
+  }
+};
+
+/*
+ * class MemoryBackend - Slots stored in a vector on the heap
+ *
+ * Every slot is allocated up front, so this is only sensible when slots
+ * are small (e.g. the 4 byte test page type)
+ */
+template <typename T>
+class MemoryBackend : public DataStoreBackend<T> {
+ private:
+  std::vector<T> slots;
+
+ public:
+  MemoryBackend(size_t slot_count) : slots(slot_count) {}
+
+  void Read(T *buffer, size_t slot_id) { *buffer = slots[slot_id]; }
+
+  void Write(const T &data, size_t slot_id) { slots[slot_id] = data; }
+
+  /* The vector is allocated up front, so there is nothing to give back */
+  void Discard(size_t, size_t) {}
+
+  size_t DiscardUnit() { return 0; }
+
+  size_t ActualBytes() { return slots.size() * sizeof(T); }
+
+  size_t LogicalBytes() { return slots.size() * sizeof(T); }
+};
+
+/*
+ * class DataStore - The actual storage where bytes inside SSD is stored
+ *
+ * The bytes themselves are kept by one of the DataStoreBackend classes
+ * above, selected when the data store is constructed
+ *
+ * The data store is abstracted in a way that it consists of an array of
+ * slots of a certain size (both slot count and slot size could be configured)
+ * by the constructor. Each read or write command just specifies the slot id
+ * withoug having to specify the size of slot since they are all known
+ * to the module
+ *
+ * Note that since the data store layer is regarded as a simulation of real
+ * SSD, it also mimics the characteristics of a SSD plus some reinforcing
+ * properties:
+ *
+ *   1. A slot could only be read after being written
+ *   2. A slot could not be overwritten without being erased in between
+ *   3. An active slot could be erased to make it inactive (i.e. ready
+ *      for write)
+ *   4. A slot becomes active after being written
+ *
+ * If any of these conditions are violated an exception will be thrown
+ *
+ * Also note that this class is templatized such that the templated type_
+ * must be a plain old data type_, i.e. being trivially copiable by memcpy.
+ * This is consistent with the data characteristic in a real SSD
+ */
+
+/* sizeof(T) is the size of the slot */
+template <typename T>
+class DataStore {
+ private:
+  /* Holds the bytes of the slots */
+  std::unique_ptr<DataStoreBackend<T>> backend;
+
+  /* The number of slots in the data store */
+  size_t slot_count;
+
+  /*
+   * This records slots that are currently active, as a bitmap with bit
+   * (slot_id % 64) of word (slot_id / 64) set for an active slot
+   */
+  std::vector<uint64_t> active_slots;
+
+ public:
+  /*
+   * Constructor - backend_id is one of the DS_BACKEND_* values, the sparse
+   *               file by default
+   */
+  DataStore(size_t p_slot_count, size_t backend_id = DS_BACKEND_FILE)
+      : backend{CreateBackend(backend_id, p_slot_count)},
+        slot_count{p_slot_count}, /* Count of slots */
+        active_slots((p_slot_count + 63) / 64, 0) {}
+
+  /*
+   * ReadSlot() - Reads a specified slot into the given buffer
+   *
+   * The buffer size must be larger than sizeof(T),
+   * and there is no run time checking to ensure this.
+   * Also if the slot ID is too large then an exception is thrown
+   *
+   * Note that if the slot being read is not active then an exception will
+   * be thrown because all read content will be garbage
+   */
+
+  void ReadSlot(T *buffer, size_t slot_id) {
+    /*
+     * First check the slot ID
+     * If slot ID is not valid this will throw an exception
+     * We need to do this before checking for activeness
+     * because out of bound is a more severe error
+     */
+    CheckSlotBound(slot_id);
+
+    /*
+     * Then check whether the slot is currently active or not
+     * Note that the order of checking the bitmap and checking bound
+     * are slightly different in ReadSlot() and WriteSlot()
+     */
+    if (!IsActive(slot_id)) {
+      return;
+    }
+
+    backend->Read(buffer, slot_id);
+
+    return;
+  }
+
+  /*
+   * WriteSlot() - Write buffer content into a given slot
+   *
+   * This function is almost the same as its counterpart ReadSlot(), just
+   * writing to the backend instead of reading
+   *
+   * If the slot is currently active then an exception is thrown since
+   * a slot could not be overwritten without being erased first
+   */
+
+  void WriteSlot(const T &data, size_t slot_id) {
+    /*
+     * Check the bound first since the bitmap only covers valid slots,
+     * and then whether the slot is currently active or not
+     */
+    CheckSlotBound(slot_id);
+    if (IsActive(slot_id)) {
+      ThrowOverwriteSlotError(slot_id);
+    }
+
+    /* Mark the slot as active since it is now written */
+    active_slots[slot_id / 64] |= uint64_t(1) << (slot_id % 64);
+
+    /* And then just finish actual write operation */
+    backend->Write(data, slot_id);
+
+    return;
+  }
+
+  /*
+   * EraseSlot() - Mark the slot as not used
+   *
+   * Erasing a slot does not erase data in the backend.
+   * Instead, the way we erase a slot is to just clear the bit of the slot
+   * in the bitmap inside the class to mark the slot as inactive
+   * and next time if a slot is read, an exception will be thrown
+   *
+   * This function is just a wrapper to EraseRange() which is used
+   * for testing but the semantics are the same
+   */
+  void EraseSlot(size_t slot_id) {
+    EraseRange(slot_id, slot_id);
+    return;
+  }
+
+  /*
+   * EraseRange() - Erase all slots in a range
+   *
+   * Arguments start_slot_id and end_slot_id specifies the range of slots
+   * being erased. This range must be valid (i.e. start <= end and
+   * end < slot_count), otherwise an exception will be thrown.
+   *
+   * Erasing slots that are not active is allowed. The bits of the range
+   * are cleared a word at a time, masking the partial words at its ends
+   *
+   * The storage of the erased slots is then given back to the backend.
+   * Small slots share a unit of backend storage with their neighbours, so
+   * the range is widened over the units at its ends whenever the other
+   * slots in them are not active either
+   *
+   * On an SSD this operation is similar to a block-level erasure, but
+   * here we do not reuqire extra block alignment to make the
+   * implementation slightly simpler
+   */
+  void EraseRange(size_t start_slot_id, size_t end_slot_id) {
+    /* start < end && end < count */
+    if ((start_slot_id > end_slot_id) || (end_slot_id >= slot_count)) {
+      ThrowErasingInvalidRangeError(start_slot_id, end_slot_id);
+    }
+
+    size_t first_word = start_slot_id / 64;
+    size_t last_word = end_slot_id / 64;
+
+    /* Bits from the start slot up, and from the end slot down */
+    uint64_t first_mask = ~uint64_t(0) << (start_slot_id % 64);
+    uint64_t last_mask = ~uint64_t(0) >> (63 - end_slot_id % 64);
+
+    if (first_word == last_word) {
+      active_slots[first_word] &= ~(first_mask & last_mask);
+      DiscardRange(start_slot_id, end_slot_id);
+      return;
+    }
+
+    active_slots[first_word] &= ~first_mask;
+    std::fill(active_slots.begin() + first_word + 1,
+              active_slots.begin() + last_word, 0);
+    active_slots[last_word] &= ~last_mask;
+
+    DiscardRange(start_slot_id, end_slot_id);
+
+    return;
+  }
+
+  /*
+   * NumActiveSlots() - Returns the number of slots currently written
+   */
+  size_t NumActiveSlots() const {
+    size_t count = 0;
+    for (uint64_t word : active_slots) {
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  /*
+   * Print() - Report the storage actually used by the backend against
+   *           the logical size of the slots and the live data in them
+   *
+   * Note: For this to work, debug must be enabled
+   */
+  void Print() {
+    dbg_printf("========== Data Store Statictics ==========\n");
+    dbg_printf("Actual Bytes: %zu\n", backend->ActualBytes());
+    dbg_printf("Logical Bytes: %zu\n", backend->LogicalBytes());
+    dbg_printf("Live Bytes: %zu (%zu of %zu slots)\n",
+               NumActiveSlots() * sizeof(T), NumActiveSlots(), slot_count);
+  }
+
+ private:
+  /* Functions only used by the class internally */
+
+  /*
+   * CreateBackend() - Allocates the backend given by one of the
+   *                   DS_BACKEND_* values
+   */
+  static DataStoreBackend<T> *CreateBackend(size_t backend_id,
+                                            size_t slot_count) {
+    switch (backend_id) {
+      case DS_BACKEND_FILE:
+        return new FileBackend<T>();
+      case DS_BACKEND_MMAP:
+        return new MmapBackend<T>(slot_count);
+      case DS_BACKEND_MEMORY:
+        return new MemoryBackend<T>(slot_count);
+      default:
+        throw FlashSimException("Unknown data store backend " +
+                                std::to_string(backend_id));
+    }
+  }
+
+  /*
+   * DiscardRange() - Gives back the storage of erased slots, widening the
+   *                  range over the backend units at its ends if no
+   *                  active slot is left in them
+   */
+  void DiscardRange(size_t start_slot_id, size_t end_slot_id) {
+    size_t unit = backend->DiscardUnit();
+    if (unit == 0) {
+      return;
+    }
+
+    /* First and last slot overlapping the units the range ends in */
+    size_t unit_start = start_slot_id * sizeof(T) / unit * unit / sizeof(T);
+    size_t unit_end = std::min(
+        ((end_slot_id + 1) * sizeof(T) + unit - 1) / unit * unit / sizeof(T),
+        slot_count);
+
+    if (unit_start < start_slot_id && !AnyActive(unit_start, start_slot_id)) {
+      start_slot_id = unit_start;
+    }
+    if (end_slot_id + 1 < unit_end && !AnyActive(end_slot_id + 1, unit_end)) {
+      end_slot_id = unit_end - 1;
+    }
+
+    backend->Discard(start_slot_id, end_slot_id);
+  }
+
+  /* Whether any slot in [begin, end) is active */
+  bool AnyActive(size_t begin, size_t end) const {
+    for (size_t slot_id = begin; slot_id < end;) {
+      uint64_t word = active_slots[slot_id / 64] >> (slot_id % 64);
+      size_t bits = std::min(64 - slot_id % 64, end - slot_id);
+      if (bits < 64) {
+        word &= (uint64_t(1) << bits) - 1;
+      }
+      if (word != 0) {
+        return true;
+      }
+      slot_id += bits;
+    }
+    return false;
+  }
+
+  /* Whether a slot, which must be in bound, is active */
+  bool IsActive(size_t slot_id) const {
+    return (active_slots[slot_id / 64] >> (slot_id % 64)) & 1;
+  }
+
+  /*
+   * CheckSlotBound() - Throws if the slot ID is out of bound
+   */
+  void CheckSlotBound(size_t slot_id) const {
+    if (slot_id >= slot_count) {
+      ThrowSlotOutOfBoundError(slot_id);
+    }
+  }
+
+  /*
+   * ThrowSlotOutOfBoundError() - This is called when the slot ID is
+   *                              out of bound
+   *
+   * This should be a rare case and could only happen if there is bug
+   */
+  void ThrowSlotOutOfBoundError(size_t slot_id) const {
+    throw FlashSimException(std::string{"Slot "} + std::to_string(slot_id) +
+                            " is out of bound");
+  }
+
+  /*
+   * ThrowOverwriteSlotError() - This is called when a slot is overwritten
+   *                             without being erased first
+   */
+  void ThrowOverwriteSlotError(size_t slot_id) const {
+    throw FlashSimException(std::string{"Slot "} + std::to_string(slot_id) +
+                            " could not be overwritten (write error)");
+  }
+
+  /*
+   * ThrowErasingInvalidRangeError() - This is called if the the range in
+   *                                   EraseRange() is invalid
+   */
+  void ThrowErasingInvalidRangeError(size_t start_slot_id, size_t end_slot_id) {
+    throw FlashSimException(
+        std::string{"The range ["} + std::to_string(start_slot_id) + ',' +
+        std::to_string(end_slot_id) + "] is either invalid or out of bound");
+  }
+};
+
+/***************************** class DataStore ends ***************************/
+
+/************************* class EraseCounter starts **************************/
+
+/*
+ * class EraseCounter - Number of erases performed on every block
+ *
+ * Besides the count of each block this keeps how many blocks have each
+ * count, along with running sums, so the spread of erases over the SSD
+ * (min, max, mean and standard deviation) and the number of worn out
+ * blocks are all available in constant time.
+ */
+class EraseCounter {
+ public:
+  /*
+   * Constructor - Every block starts with no erases, and wears out once it
+   *               reaches max_erases
+   */
+  EraseCounter(size_t num_blocks, size_t max_erases)
+      : erases(num_blocks, 0),
+        blocks_with(max_erases + 1, 0),
+        max_erases(max_erases),
+        min_count(0),
+        max_count(0),
+        sum(0),
+        sum_squares(0) {
+    blocks_with[0] = num_blocks;
+  }
+
+  /* Number of erases performed on the block */
+  size_t Erases(size_t block) const { return erases[block]; }
+
+  bool IsWornOut(size_t block) const { return erases[block] == max_erases; }
+
+  /*
+   * Record() - Counts one erase of the block, which must not be worn out
+   */
+  void Record(size_t block) {
+    size_t count = erases[block]++;
+    assert(count < max_erases);
+
+    blocks_with[count]--;
+    blocks_with[count + 1]++;
+    sum++;
+    sum_squares += 2 * count + 1;
+    max_count = std::max(max_count, count + 1);
+
+    /* Counts only grow, so the minimum only ever moves up */
+    while (blocks_with[min_count] == 0) {
+      min_count++;
+    }
+  }
+
+  size_t NumWornOut() const { return blocks_with[max_erases]; }
+
+  size_t Min() const { return min_count; }
+
+  size_t Max() const { return max_count; }
+
+  double Mean() const { return double(sum) / erases.size(); }
+
+  double StdDev() const {
+    double mean = Mean();
+    double var = double(sum_squares) / erases.size() - mean * mean;
+    return var > 0 ? std::sqrt(var) : 0.0;
+  }
+
+ private:
+  /* Erases performed on each block, indexed by linear block index */
+  std::vector<uint32_t> erases;
+
+  /* Number of blocks with each erase count */
+  std::vector<size_t> blocks_with;
+
+  size_t max_erases;
+  size_t min_count;
+  size_t max_count;
+
+  /* Sum of erase counts over all blocks, and of their squares */
+  uint64_t sum;
+  uint64_t sum_squares;
+};
+
+/************************** class EraseCounter ends ***************************/
+
+/************************* class TimingModel starts ***************************/
+
+/*
+ * class LatencyHistogram - Counts latencies in log-linear buckets
+ *
+ * Every power of two is split into 2^SUB_BITS buckets, so any percentile is
+ * reported within 1 / 2^SUB_BITS of its exact value, in constant memory.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts((64 - SUB_BITS + 1) << SUB_BITS, 0), total(0) {}
+
+  void Record(uint64_t value) {
+    counts[Bucket(value)]++;
+    total++;
+  }
+
+  uint64_t Count() const { return total; }
 
   /*
-   * ThrowSlotOutOfBoundError() - This is called when the slot ID is
-   *                              out of bound
+   * Percentile() - Returns the lowest value of the bucket holding the
+   *                given fraction (e.g. 0.99) of recorded values
+   */
+  uint64_t Percentile(double fraction) const {
+    uint64_t rank = uint64_t(std::ceil(fraction * total));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+      seen += counts[bucket];
+      if (seen >= rank && seen > 0) {
+        return LowestValue(bucket);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr unsigned SUB_BITS = 5;
+
+  static size_t Bucket(uint64_t value) {
+    if (value < (uint64_t(1) << SUB_BITS)) {
+      return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) +
+           ((value >> shift) & ((uint64_t(1) << SUB_BITS) - 1));
+  }
+
+  static uint64_t LowestValue(size_t bucket) {
+    if (bucket < (size_t(1) << SUB_BITS)) {
+      return bucket;
+    }
+    unsigned shift = (bucket >> SUB_BITS) - 1;
+    uint64_t sub = bucket & ((size_t(1) << SUB_BITS) - 1);
+    return ((uint64_t(1) << SUB_BITS) + sub) << shift;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+};
+
+/*
+ * class TimingModel - Discrete event timing of the flash operations
+ *
+ * Each plane has a timeline for its array operations (read, program,
+ * erase) and each die one for the page transfers on its bus. An operation
+ * starts once its inputs are ready and the resources it needs are free,
+ * and occupies them until it finishes:
+ *
+ *   READ  - Array read on the plane, then transfer out over the die bus
+ *   WRITE - Transfer in over the die bus, then array program on the plane
+ *   ERASE - Array erase on the plane, after everything issued before it by
+ *           the same host operation (e.g. moving out the live pages)
+ *
+ * The host keeps a fixed number of operations in flight: each one is issued
+ * when the one that many operations before it completes. A host operation
+ * completes with the last flash operation the FTL issued for it.
+ *
+ * All times are in microseconds.
+ */
+class TimingModel {
+ public:
+  /* Kinds of host operations latencies are reported for */
+  enum HostOp { HOST_READ, HOST_WRITE, HOST_OTHER };
+
+  TimingModel(const FlashSimConf *conf, const AddressCodec &codec)
+      : codec(codec),
+        read_latency{Latency(conf->GetReadLatency(), DEFAULT_READ_LATENCY)},
+        program_latency{
+            Latency(conf->GetProgramLatency(), DEFAULT_PROGRAM_LATENCY)},
+        erase_latency{Latency(conf->GetEraseLatency(), DEFAULT_ERASE_LATENCY)},
+        bus_latency{Latency(conf->GetBusLatency(), DEFAULT_BUS_LATENCY)},
+        in_flight(std::max<size_t>(1, conf->GetHostQueueDepth()), 0),
+        next_slot(0),
+        plane_free(codec.NumPlanes(), 0),
+        die_free(codec.NumPlanes() / conf->GetDieSize(), 0),
+        planes_per_die(conf->GetDieSize()),
+        op_issue(0),
+        op_done(0),
+        end_time(0) {}
+
+  /*
+   * BeginHostOp() / EndHostOp() - Bracket the flash operations done for
+   *                               one host operation
    *
-   * This should be a rare case and could only happen if there is bug
+   * Latencies are only recorded for host operations that succeeded
    */
-  void ThrowSlotOutOfBoundError(size_t slot_id) const {
-    throw FlashSimException(std::string{"Slot "} + std::to_string(slot_id) +
-                            " is out of bound");
+  void BeginHostOp() {
+    op_issue = in_flight[next_slot];
+    op_done = op_issue;
+  }
+
+  void EndHostOp(HostOp kind, bool succeeded) {
+    in_flight[next_slot] = op_done;
+    next_slot = (next_slot + 1) % in_flight.size();
+    end_time = std::max(end_time, op_done);
+
+    if (succeeded && kind != HOST_OTHER) {
+      latencies[kind].Record(op_done - op_issue);
+    }
+  }
+
+  /* When the host operation in progress was issued */
+  uint64_t IssueTime() const { return op_issue; }
+
+  /* Returns when the page read is out of the die */
+  uint64_t Read(const Address &addr) {
+    uint64_t &plane = plane_free[codec.PlaneIndex(addr)];
+    uint64_t &bus = die_free[codec.PlaneIndex(addr) / planes_per_die];
+
+    uint64_t read_done = std::max(op_issue, plane) + read_latency;
+    uint64_t done = std::max(read_done, bus) + bus_latency;
+    /* The data occupies the plane's register until transferred out */
+    plane = done;
+    bus = done;
+    return Finish(done);
+  }
+
+  /* Returns when the page is programmed, its data being ready at ready */
+  uint64_t Program(const Address &addr, uint64_t ready) {
+    uint64_t &plane = plane_free[codec.PlaneIndex(addr)];
+    uint64_t &bus = die_free[codec.PlaneIndex(addr) / planes_per_die];
+
+    uint64_t transfer_done =
+        std::max(std::max(op_issue, ready), std::max(bus, plane)) +
+        bus_latency;
+    bus = transfer_done;
+    plane = transfer_done + program_latency;
+    return Finish(plane);
+  }
+
+  /* Returns when the block is erased */
+  uint64_t Erase(const Address &addr) {
+    uint64_t &plane = plane_free[codec.PlaneIndex(addr)];
+
+    plane = std::max(op_done, plane) + erase_latency;
+    return Finish(plane);
   }
 
   /*
-   * ThrowOverwriteSlotError() - This is called when a slot is overwritten
-   *                             without being erased first
+   * Report() - Prints the simulated throughput of host reads and writes
+   *            (PAGE_SIZE bytes each) and their latency percentiles
    */
-  void ThrowOverwriteSlotError(size_t slot_id) const {
-    throw FlashSimException(std::string{"Slot "} + std::to_string(slot_id) +
-                            " could not be overwritten (write error)");
+  void Report(FILE *log) const {
+    uint64_t ops = latencies[HOST_READ].Count() + latencies[HOST_WRITE].Count();
+    double seconds = end_time / 1e6;
+
+    fprintf(log, "SIMULATED TIME = %.6f s\n", seconds);
+    if (seconds > 0) {
+      fprintf(log, "HOST IOPS = %.0f\n", ops / seconds);
+      fprintf(log, "HOST BANDWIDTH = %.2f MB/s\n",
+              ops * PAGE_SIZE / seconds / (1024 * 1024));
+    }
+
+    const char *const names[] = {"READ", "WRITE"};
+    for (int kind : {HOST_READ, HOST_WRITE}) {
+      const LatencyHistogram &hist = latencies[kind];
+      if (hist.Count() == 0) {
+        continue;
+      }
+      fprintf(log, "HOST %s LATENCY p50/p99/p99.9 = %" PRIu64 "/%" PRIu64
+              "/%" PRIu64 " us\n",
+              names[kind], hist.Percentile(0.5), hist.Percentile(0.99),
+              hist.Percentile(0.999));
+    }
+  }
+
+ private:
+  /* Typical latencies of MLC NAND flash, used unless configured */
+  static constexpr uint64_t DEFAULT_READ_LATENCY = 50;
+  static constexpr uint64_t DEFAULT_PROGRAM_LATENCY = 500;
+  static constexpr uint64_t DEFAULT_ERASE_LATENCY = 3000;
+  static constexpr uint64_t DEFAULT_BUS_LATENCY = 10;
+
+  static uint64_t Latency(size_t configured, uint64_t fallback) {
+    return configured != 0 ? configured : fallback;
+  }
+
+  uint64_t Finish(uint64_t done) {
+    op_done = std::max(op_done, done);
+    return done;
   }
 
+  AddressCodec codec;
+
+  uint64_t read_latency;
+  uint64_t program_latency;
+  uint64_t erase_latency;
+  uint64_t bus_latency;
+
+  /* Completion times of the last host operations, one per queue slot */
+  std::vector<uint64_t> in_flight;
+  size_t next_slot;
+
+  /* When each plane and each die bus becomes free */
+  std::vector<uint64_t> plane_free;
+  std::vector<uint64_t> die_free;
+  size_t planes_per_die;
+
+  /* Issue time of the host operation in progress, and when its flash
+   * operations issued so far are all done */
+  uint64_t op_issue;
+  uint64_t op_done;
+
+  /* When the last host operation completed */
+  uint64_t end_time;
+
+  /* Host read and write latencies */
+  LatencyHistogram latencies[2];
+};
+
+/************************** class TimingModel ends ****************************/
+
+/************************** class PageBuffer starts ***************************/
+
+/*
+ * class PageBuffer - FIFO of pages held by the controller
+ *
+ * Pages live in a ring of preallocated slots and are filled and consumed in
+ * place: the data store reads straight into the slot at the back, and
+ * writes straight out of the slot at the front, so a page is never copied
+ * through temporaries on its way. The ring only grows (doubling) if more
+ * pages than ever before are buffered at once.
+ */
+template <typename PageType>
+class PageBuffer {
+ public:
+  struct Slot {
+    PageType page;
+
+    /* Logical LBA associated with the page */
+    size_t lba;
+
+    /* When the page data is there, in simulated time */
+    uint64_t ready;
+  };
+
+  PageBuffer() : slots(INITIAL_SLOTS), head(0), count(0) {}
+
   /*
-   * ThrowErasingInvalidRangeError() - This is called if the the range in
-   *                                   EraseRange() is invalid
+   * Push() - Appends a slot at the back and returns it for the caller to
+   *          fill in. The page holds stale data until then
    */
-  void ThrowErasingInvalidRangeError(size_t start_slot_id, size_t end_slot_id) {
-    throw FlashSimException(
-        std::string{"The range ["} + std::to_string(start_slot_id) + ',' +
-        std::to_string(end_slot_id) + "] is either invalid or out of bound");
+  Slot &Push() {
+    if (count == slots.size()) {
+      Grow();
+    }
+    Slot &slot = slots[(head + count) & (slots.size() - 1)];
+    count++;
+    return slot;
+  }
+
+  Slot &Front() {
+    assert(count > 0);
+    return slots[head];
+  }
+
+  void Pop() {
+    assert(count > 0);
+    head = (head + 1) & (slots.size() - 1);
+    count--;
+  }
+
+  size_t Size() const { return count; }
+
+  bool Empty() const { return count == 0; }
+
+ private:
+  /* Must be a power of two */
+  static constexpr size_t INITIAL_SLOTS = 4;
+
+  /* Doubles the ring, moving the buffered pages to its start */
+  void Grow() {
+    std::vector<Slot> grown(slots.size() * 2);
+    for (size_t i = 0; i < count; i++) {
+      grown[i] = slots[(head + i) & (slots.size() - 1)];
+    }
+    slots.swap(grown);
+    head = 0;
   }
+
+  std::vector<Slot> slots;
+  size_t head;
+  size_t count;
 };
 
-/***************************** class DataStore ends ***************************/
+template <typename PageType>
+constexpr size_t PageBuffer<PageType>::INITIAL_SLOTS;
+
+/*************************** class PageBuffer ends ****************************/
+
+/*************************** class FTLMeter starts ****************************/
+
+#if (CONFIG_TWOPROC == 0)
+
+/*
+ * class FTLMeter - Measures the memory of an FTL running in this process
+ *
+ * In one process mode there is no child whose memory memcheck can track.
+ * With MEMMETER_ENABLED the FTL is metered instead: it runs on a stack of
+ * its own whose depth is tracked with canaries, and what it allocates
+ * (with new or malloc) while running is charged to it. The heap is the
+ * size malloc would grow the heap of a process holding only the FTL to,
+ * as memcheck sees a child's. Usage is totalled as get_child_total_mem()
+ * totals a child's, i.e. heap + data + stack, each at its most
+ */
+class FTLMeter {
+ public:
+  /*
+   * Run() - Runs fn(), a call into the FTL, on the FTL stack and with its
+   *         allocations charged to the FTL. Exceptions thrown by fn()
+   *         are rethrown on the caller's stack
+   */
+  template <typename Fn>
+  static auto Run(Fn fn) -> decltype(fn()) {
+#if MEMMETER_ENABLED
+    using Ret = decltype(fn());
+
+    struct Call {
+      Fn *fn;
+      Ret ret;
+
+      static void Body(void *arg) {
+        Call *call = static_cast<Call *>(arg);
+        call->ret = (*call->fn)();
+      }
+    } call = {&fn, Ret()};
+
+    RunOnStack(Call::Body, &call);
+    return call.ret;
+#else
+    return fn();
+#endif
+  }
+
+  /*
+   * Host() - Runs fn(), the simulator working on behalf of the FTL (e.g. a
+   *          callback), off the FTL stack and without charging the FTL.
+   *          Exceptions thrown by fn() are rethrown on the FTL stack
+   */
+  template <typename Fn>
+  static void Host(Fn fn) {
+#if MEMMETER_ENABLED
+    struct Call {
+      static void Body(void *arg) { (*static_cast<Fn *>(arg))(); }
+    };
+
+    if (in_ftl) {
+      RunOffStack(Call::Body, &fn);
+      return;
+    }
+#endif
+    fn();
+  }
+
+  /* Most bytes the heap of a process holding only the FTL had */
+  static size_t GetHeapSize(void);
+
+  /* Most bytes of heap the FTL had allocated at once */
+  static size_t GetAllocSize(void);
+
+  /*
+   * Bytes of static data - Those of the whole process, the simulator's and
+   * the test's included, not only the FTL's
+   */
+  static size_t GetDataSize(void);
+
+  /* Most bytes of the FTL stack ever used */
+  static size_t GetStackSize(void);
+
+  /* Total as get_child_total_mem() gives */
+  static size_t GetTotalMem(void) {
+    return GetHeapSize() + GetDataSize() + GetStackSize();
+  }
+
+  /* Whether the FTL is running, i.e. allocations are charged to it */
+  static bool in_ftl;
+
+ private:
+  /* Switches to the FTL stack to call body(arg) */
+  static void RunOnStack(void (*body)(void *), void *arg);
+
+  /* Switches from the FTL stack to call body(arg) */
+  static void RunOffStack(void (*body)(void *), void *arg);
+};
+
+#endif /* CONFIG_TWOPROC */
+
+/**************************** class FTLMeter ends *****************************/
 
 /*************************** class Controller starts **************************/
 
@@ -965,35 +2156,43 @@ class Controller {
    * command please make sure the page buffer is empty, otherwise
    * an exception will be thrown
    *
-   * The second component of the element is the logical LBA
-   * associated with this piece of data
+   * Each element also carries the logical LBA associated with this
+   * piece of data
    * This is used to verify that we actually read the correct page
    */
-  std::queue<std::pair<PageType, size_t>> page_buffer;
-
-  /*
-   * We intentionally make it a ordered map such that we could
-   * iterate block address in an ordered manner
-   *
-   * The key to this map is the linear block address, which is exactly
-   * the linear address of the first page of the block
-   * (so the linear address should be a multiple of page per Block).
-   * And the value is number of erasures remaining
-   */
-  std::map<size_t, size_t> block_erasure_map;
+  PageBuffer<PageType> page_buffer;
 
   /*
    * This is the map that maps physical LBA to logical LBA
    * This is used to verify that each read/write operation actually get to
    * the location where the page is
    *
-   * If there is no entry for a physical block, then the physical block
-   * is a fresh block. Otherwise the block is either most up-to-date
-   * or obsolete. We could not decide which one is the case, and this
-   * will be detected by the data component since reading obsolete
-   * pages will give back incorrect data
+   * It is a flat array indexed by physical LBA. If the entry of a physical
+   * page is CLEAN_PAGE, then the physical page is a fresh page. Otherwise
+   * the page is either most up-to-date or obsolete. We could not decide
+   * which one is the case, and this will be detected by the data component
+   * since reading obsolete pages will give back incorrect data
+   */
+  std::vector<size_t> physical_logical_map;
+
+  /* Entry of physical_logical_map for pages not written since erased */
+  static constexpr size_t CLEAN_PAGE = std::numeric_limits<size_t>::max() - 1;
+
+  /*
+   * Logical LBA recorded for pages the FTL programs with its own metadata
+   * (e.g. translation pages)
+   */
+  static constexpr size_t METADATA_LBA = std::numeric_limits<size_t>::max();
+
+  /*
+   * Content and spare area tag of an FTL metadata page - A page of the data
+   * store only holds a PageType, so these are kept by physical LBA here
    */
-  std::map<size_t, size_t> physical_logical_map;
+  struct MetadataPage {
+    uint64_t tag;
+    std::vector<char> data;
+  };
+  std::unordered_map<size_t, MetadataPage> metadata_pages;
 
   /* Number of packages inside an SSD */
   size_t ssd_size;
@@ -1015,9 +2214,12 @@ class Controller {
 
   /* As name suggests */
   size_t page_per_block;
-  size_t page_per_plane;
-  size_t page_per_die;
-  size_t page_per_package;
+
+  /* Converts addresses to physical LBAs */
+  AddressCodec codec;
+
+  /* Simulated time taken by the operations */
+  TimingModel timing;
 
   /*
    * This one is special - it is not invokved in computing the
@@ -1026,11 +2228,21 @@ class Controller {
    */
   size_t page_per_ssd;
 
+  /* Erases performed on each block, indexed by linear block index */
+  EraseCounter erase_counter;
+
   /* Counters for each operations */
   uint64_t num_writes;
   uint64_t num_reads;
   uint64_t num_erases;
 
+  /*
+   * Number of operations performed on each plane, per opcode, which
+   * tells how evenly the FTL spreads its work over the hierarchy
+   */
+  static constexpr size_t NUM_OPCODES = 3;
+  std::vector<uint64_t> plane_ops;
+
  public:
   /*
    * Constructor - Initialize member object pointers
@@ -1043,7 +2255,6 @@ class Controller {
         ds_p{p_ds_p},
         config_p{p_config_p},
         page_buffer{},
-        block_erasure_map{},
         physical_logical_map{},
         /* Get configuration and calcuate various parameters */
         ssd_size{config_p->GetSSDSize()},
@@ -1053,13 +2264,17 @@ class Controller {
         block_size{config_p->GetBlockSize()},
         block_erase_count{config_p->GetBlockEraseCount()},
         page_per_block{block_size},
-        page_per_plane{page_per_block * plane_size},
-        page_per_die{page_per_plane * die_size},
-        page_per_package{page_per_die * package_size},
-        page_per_ssd{page_per_package * ssd_size},
+        codec{config_p},
+        timing{config_p, codec},
+        page_per_ssd{codec.NumPages()},
+        erase_counter{page_per_ssd / page_per_block, block_erase_count},
         num_writes(0),
         num_reads(0),
-        num_erases(0) {}
+        num_erases(0),
+        plane_ops(codec.NumPlanes() * NUM_OPCODES, 0) {
+    /* Every physical page starts clean */
+    physical_logical_map.assign(page_per_ssd, CLEAN_PAGE);
+  }
 
   /*
    * Destructor - Free member objects
@@ -1072,31 +2287,39 @@ class Controller {
    * AddressToLBA() - Convers a hierarchical Address object to LBA
    */
   size_t AddressToLBA(const Address &addr) {
-    return addr.page + addr.block * page_per_block +
-           addr.plane * page_per_plane + addr.die * page_per_die +
-           addr.package * page_per_package;
+    return codec.PageIndex(addr);
   }
 
   /*
    * ExecuteCommand() - Given a list of commands, execute them one by one
    *
-   * Commands could be READ, WRITE and ERASE, and as their names suggest
-   * they represent the physical operation on the physical page
-   * specified by the Address object.
+   * Commands could be READ, WRITE, WRITE_METADATA and ERASE, and as their
+   * names suggest they represent the physical operation on the physical
+   * page specified by the Address object.
    *
    * Several restrictions are present on how commands could be executed:
    *
    *   (1) ERASE must be executed when the buffer is empty
+   *   (2) WRITE must be executed when the buffer is not empty
+   *   (3) WRITE_METADATA programs an FTL metadata page, which carries no
+   *       host data. READ of such a page does not fill the buffer, its
+   *       content is read with ReadMetadata() instead
    *
    * These restrictions are used to prevent caching pages inside the
    * controller DRAM, in case of power failure causing data to be lost.
    */
 
   void ExecuteCommand(OpCode operation, Address addr) {
+    /* ERASE ignores the page, see below */
+    if (operation == OpCode::ERASE) {
+      addr.page = 0;
+    }
+    if (!codec.Contains(addr)) {
+      ThrowInvalidAddressError(addr);
+    }
+
     switch (operation) {
       case OpCode::READ: {
-        PageType page{};
-
         size_t logical_lba;
 
         /*
@@ -1109,8 +2332,8 @@ class Controller {
          * We also need to find the logical LBA associated
          * with this physical LBA
          */
-        auto it = physical_logical_map.find(physical_lba);
-        if (it == physical_logical_map.end()) {
+        logical_lba = physical_logical_map[physical_lba];
+        if (logical_lba == CLEAN_PAGE) {
           /*
            * If the mapping for the physical does not
            * yet exist then the physical page is clean.
@@ -1118,27 +2341,27 @@ class Controller {
            * data
            */
           ThrowInvalidReadError(physical_lba);
-        } else {
-          /*
-           * If the read operation is correct then get
-           * its logical LBA
-           */
-          logical_lba = it->second;
         }
 
-        /*
-         * Read the actual content of the page into
-         * local page object
-         */
-        ds_p->ReadSlot(&page, physical_lba);
+        uint64_t ready = timing.Read(addr);
+
+        /* FTL metadata pages only cost the read */
+        if (logical_lba == METADATA_LBA) {
+          num_reads++;
+          break;
+        }
 
         /*
-         * And then push the page object back into the queue
+         * Read the actual content of the page straight into
+         * a new slot at the back of the page buffer
          * We need both the page data and logical LBA
          * to let the following write operation know what is
          * the logical LBA associated with a page
          */
-        page_buffer.push(std::make_pair(page, logical_lba));
+        auto &slot = page_buffer.Push();
+        ds_p->ReadSlot(&slot.page, physical_lba);
+        slot.lba = logical_lba;
+        slot.ready = ready;
 
         num_reads++;
         break;
@@ -1147,33 +2370,36 @@ class Controller {
       case OpCode::WRITE: {
         size_t physical_lba = AddressToLBA(addr);
 
+        /* There must be a page to write */
+        if (page_buffer.Empty()) {
+          ThrowWriteEmptyBufferError(physical_lba);
+        }
+
         /* Keep a reference to the front of the page buffer */
-        const PageType &page = page_buffer.front().first;
+        const auto &slot = page_buffer.Front();
 
         /*
          * This is the LBA that the physical LBA will
          * be associated to
          */
-        size_t logical_lba = page_buffer.front().second;
+        size_t logical_lba = slot.lba;
 
         /*
          * If there is already an entry for the physical address
          * then we could not associate it with another logical
          * LBA, and this is an error
          */
-        auto insert_ret = physical_logical_map.insert(
-            std::make_pair(physical_lba, logical_lba));
-
-        /* This indicates that the physical LBA already exist */
-        if (insert_ret.second == false) {
+        if (physical_logical_map[physical_lba] != CLEAN_PAGE) {
           ThrowWriteDirtyPageError(physical_lba);
         }
+        physical_logical_map[physical_lba] = logical_lba;
 
         /* And then write front element into the data store*/
-        ds_p->WriteSlot(page, physical_lba);
+        ds_p->WriteSlot(slot.page, physical_lba);
+        timing.Program(addr, slot.ready);
 
         /* Remove the front object from the page buffer */
-        page_buffer.pop();
+        page_buffer.Pop();
 
 #if ENABLE_TRANS_TRACING
         fprintf(trans_trace_fp, "W 1 %zu <%d,%d,%d>\n", logical_lba, addr.plane,
@@ -1184,6 +2410,24 @@ class Controller {
         break;
       }
 
+      case OpCode::WRITE_METADATA: {
+        size_t physical_lba = AddressToLBA(addr);
+
+        /*
+         * Mark the physical page as used, it counts as a write. Its content
+         * is empty until ProgramMetadata() fills it in
+         */
+        if (physical_logical_map[physical_lba] != CLEAN_PAGE) {
+          ThrowWriteDirtyPageError(physical_lba);
+        }
+        physical_logical_map[physical_lba] = METADATA_LBA;
+        metadata_pages[physical_lba] = MetadataPage{SPARE_ERASED, {}};
+
+        timing.Program(addr, timing.IssueTime());
+        num_writes++;
+        break;
+      }
+
       case OpCode::ERASE: {
         /*
          * First check whether the page buffer is empty
@@ -1217,15 +2461,15 @@ class Controller {
          * The last step is to remove physical-logical
          * LBA mapping within range [start_lba, end_lba]
          */
-        for (size_t physical_lba = start_lba; physical_lba <= end_lba;
-             physical_lba++) {
-          /*
-           * STL happily accepts it even if physical
-           * lba_ does not yet exist
-           */
-          physical_logical_map.erase(physical_lba);
+        for (size_t lba = start_lba; lba <= end_lba; lba++) {
+          if (physical_logical_map[lba] == METADATA_LBA) {
+            metadata_pages.erase(lba);
+          }
         }
+        std::fill(physical_logical_map.begin() + start_lba,
+                  physical_logical_map.begin() + end_lba + 1, CLEAN_PAGE);
 
+        timing.Erase(addr);
         num_erases++;
 #if ENABLE_TRANS_TRACING
         fprintf(trans_trace_fp, "E <%d,%d>\n", addr.plane, addr.block);
@@ -1240,9 +2484,122 @@ class Controller {
 
     } /*switch op code */
 
+    /* Metadata programs count as writes of the plane */
+    if (operation == OpCode::WRITE_METADATA) {
+      operation = OpCode::WRITE;
+    }
+    plane_ops[codec.PlaneIndex(addr) * NUM_OPCODES + size_t(operation)]++;
     return;
   }
 
+  /*
+   * ExecuteCommands() - Executes a list of commands in order
+   *
+   * Each command goes through ExecuteCommand(), so the page buffer and
+   * erase rules are the same as for commands issued one at a time
+   */
+  void ExecuteCommands(const Command *commands, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      ExecuteCommand(commands[i].operation, commands[i].addr);
+    }
+  }
+
+  /*
+   * ProgramMetadata() - Executes a WRITE_METADATA, then stores the content
+   *                     of the page and the tag of its spare area
+   */
+  void ProgramMetadata(Address addr, uint64_t tag, const void *data,
+                       size_t size) {
+    ExecuteCommand(OpCode::WRITE_METADATA, addr);
+
+    MetadataPage &page = metadata_pages[AddressToLBA(addr)];
+    page.tag = tag;
+    page.data.assign(static_cast<const char *>(data),
+                     static_cast<const char *>(data) + size);
+  }
+
+  /*
+   * ReadMetadata() - Executes a READ of an FTL metadata page, and copies
+   *                  its content out (zero filled up to size)
+   */
+  void ReadMetadata(Address addr, void *data, size_t size) {
+    /* Reading a data page here would leave it in the buffer */
+    if (codec.Contains(addr) &&
+        physical_logical_map[AddressToLBA(addr)] != METADATA_LBA &&
+        physical_logical_map[AddressToLBA(addr)] != CLEAN_PAGE) {
+      ThrowNotMetadataError(AddressToLBA(addr));
+    }
+    ExecuteCommand(OpCode::READ, addr);
+
+    const MetadataPage &page = metadata_pages[AddressToLBA(addr)];
+    size_t copied = std::min(size, page.data.size());
+    memcpy(data, page.data.data(), copied);
+    memset(static_cast<char *>(data) + copied, 0, size - copied);
+  }
+
+  /*
+   * ReadSpare() - Returns the spare area of a page: The logical LBA of a
+   *               data page, the tag of a metadata page, or SPARE_ERASED
+   *
+   * It is read along with the page, so it is not counted as an operation
+   */
+  uint64_t ReadSpare(const Address &addr) {
+    if (!codec.Contains(addr)) {
+      ThrowInvalidAddressError(addr);
+    }
+    size_t physical_lba = AddressToLBA(addr);
+    size_t logical_lba = physical_logical_map[physical_lba];
+
+    if (logical_lba == CLEAN_PAGE) {
+      return SPARE_ERASED;
+    }
+    if (logical_lba == METADATA_LBA) {
+      return metadata_pages[physical_lba].tag;
+    }
+    return logical_lba;
+  }
+
+  /*
+   * ReportSpread() - Prints how each kind of operation spread over the
+   * dies and planes: the min, mean and max number of operations per unit
+   * and their coefficient of variation (0 when perfectly even)
+   */
+  void ReportSpread(FILE *log) {
+    static const char *const op_names[NUM_OPCODES] = {"READS", "WRITES",
+                                                      "ERASES"};
+    size_t num_planes = codec.NumPlanes();
+
+    for (size_t planes_per_unit : {die_size, size_t(1)}) {
+      const char *unit_name = planes_per_unit == 1 ? "PLANE" : "DIE";
+      std::vector<uint64_t> unit_ops(num_planes / planes_per_unit);
+
+      for (size_t op = 0; op < NUM_OPCODES; op++) {
+        std::fill(unit_ops.begin(), unit_ops.end(), 0);
+        for (size_t plane = 0; plane < num_planes; plane++) {
+          unit_ops[plane / planes_per_unit] +=
+              plane_ops[plane * NUM_OPCODES + op];
+        }
+
+        double mean = 0, var = 0;
+        for (uint64_t ops : unit_ops) {
+          mean += ops;
+        }
+        mean /= unit_ops.size();
+        for (uint64_t ops : unit_ops) {
+          var += (ops - mean) * (ops - mean);
+        }
+        var /= unit_ops.size();
+
+        fprintf(log, "%s %s min/mean/max = %" PRIu64 "/%.1f/%" PRIu64
+                " (cv %.3f)\n",
+                unit_name, op_names[op],
+                *std::min_element(unit_ops.begin(), unit_ops.end()), mean,
+                *std::max_element(unit_ops.begin(), unit_ops.end()),
+                mean > 0 ? std::sqrt(var) / mean : 0.0);
+      }
+    }
+  }
+
   /*
    * ReadLBA() - Reads a linear page address
    *
@@ -1259,14 +2616,19 @@ class Controller {
    * either SUCCESS or FAILURE.
    */
   ExecState ReadLBA(PageType *page_p, size_t lba) {
+    timing.BeginHostOp();
+
     /*
      * Call FTL to translate single LBA read into a series of
      * commands
      */
 #if (CONFIG_TWOPROC == 1)
+    PublishIssueTime();
     auto ret = ftl_p->ReadTranslate(lba, ExecCallBack<PageType>());
 #else
-    auto ret = ftl_p->ReadTranslate(lba, FlashSimExecCallBack<PageType>(this));
+    auto ret = FTLMeter::Run([&] {
+      return ftl_p->ReadTranslate(lba, FlashSimExecCallBack<PageType>(this));
+    });
 #endif
 
     /* Make sure nothing is left in page buffer after translation */
@@ -1274,6 +2636,7 @@ class Controller {
 
     /* If the return value is FAILURE then simply return */
     if (ret.first == ExecState::FAILURE) {
+      timing.EndHostOp(TimingModel::HOST_READ, false);
       return ExecState::FAILURE;
     }
 
@@ -1284,9 +2647,10 @@ class Controller {
      * Copy the PageType object back to the argument
      * and remove the object from the page buffer
      */
-    *page_p = page_buffer.front().first;
-    page_buffer.pop();
+    *page_p = page_buffer.Front().page;
+    page_buffer.Pop();
 
+    timing.EndHostOp(TimingModel::HOST_READ, true);
     return ExecState::SUCCESS;
   }
 
@@ -1300,21 +2664,26 @@ class Controller {
    *
    */
   ExecState WriteLBA(const PageType &page, size_t lba) {
+    timing.BeginHostOp();
+
     /*
      * Call FTL to translate single LBA read into a
      * series of commands
      */
 #if (CONFIG_TWOPROC == 1)
+    PublishIssueTime();
     auto ret = ftl_p->WriteTranslate(lba, ExecCallBack<PageType>());
 #else
-    auto ret =
-        ftl_p->WriteTranslate(lba, FlashSimExecCallBack<PageType>(this));
+    auto ret = FTLMeter::Run([&] {
+      return ftl_p->WriteTranslate(lba, FlashSimExecCallBack<PageType>(this));
+    });
 #endif
     /* Make sure nothing is left in page buffer after translation */
     EnsureStateIsClean();
 
     /* If the return value is FAILURE then simply return */
     if (ret.first == ExecState::FAILURE) {
+      timing.EndHostOp(TimingModel::HOST_WRITE, false);
       return ExecState::FAILURE;
     }
 
@@ -1323,7 +2692,10 @@ class Controller {
      * Note that the logical LBA is also required in order to
      * associate a physical page with a logical LBA
      */
-    page_buffer.push(std::make_pair(page, lba));
+    auto &slot = page_buffer.Push();
+    slot.page = page;
+    slot.lba = lba;
+    slot.ready = timing.IssueTime();
 
     /*
      * And then write the page data using the address returned from
@@ -1331,6 +2703,7 @@ class Controller {
      */
     ExecuteCommand(OpCode::WRITE, ret.second);
 
+    timing.EndHostOp(TimingModel::HOST_WRITE, true);
     return ExecState::SUCCESS;
   }
 
@@ -1343,17 +2716,27 @@ class Controller {
    *
    */
   ExecState Trim(size_t lba) {
+    timing.BeginHostOp();
+
     /* Call FTL to trim LBA */
 #if (CONFIG_TWOPROC == 1)
+    PublishIssueTime();
     auto ret = ftl_p->Trim(lba, ExecCallBack<PageType>());
 #else
-    auto ret = ftl_p->Trim(lba, FlashSimExecCallBack<PageType>(this));
+    auto ret = FTLMeter::Run([&] {
+      return ftl_p->Trim(lba, FlashSimExecCallBack<PageType>(this));
+    });
 #endif
     /* Make sure nothing is left in page buffer after translation */
     EnsureStateIsClean();
+
+    timing.EndHostOp(TimingModel::HOST_OTHER, ret == ExecState::SUCCESS);
     return ret;
   }
 
+  /* Prints the simulated throughput and latencies of host operations */
+  void ReportTiming(FILE *log) const { timing.Report(log); }
+
   /* Returns the stack size used by FTL */
   size_t GetFTLStackSize(void) { return ftl_p->GetFTLStackSize(); }
 
@@ -1364,7 +2747,8 @@ class Controller {
     switch (code) {
       case OpCode::READ:
         return num_reads;
-      case OpCode::WRITE:
+      case OpCode::WRITE: /* Fall through */
+      case OpCode::WRITE_METADATA:
         return num_writes;
       case OpCode::ERASE:
         return num_erases;
@@ -1379,58 +2763,44 @@ class Controller {
    * Returns true if at least one block has no erases remaining. This
    * checks that an FTL didn't finish a stress test before it should.
    */
-  bool AtLeastOneBlockWornOut() {
-    for (auto it = block_erasure_map.begin(); it != block_erasure_map.end();
-         ++it) {
-      if (it->second == 0) {
-        return true;
-      }
-    }
-    return false;
+  bool AtLeastOneBlockWornOut() const { return erase_counter.NumWornOut() > 0; }
+
+  /* Returns the erase counts of the blocks */
+  const EraseCounter &EraseCounts() const { return erase_counter; }
+
+  /*
+   * ReportErasures() - Prints how erases spread over the blocks and how
+   * many blocks are worn out
+   */
+  void ReportErasures(FILE *log) const {
+    fprintf(log,
+            "BLOCK ERASES min/mean/max = %zu/%.1f/%zu (stddev %.2f)\n"
+            "BLOCKS WORN OUT = %zu\n",
+            erase_counter.Min(), erase_counter.Mean(), erase_counter.Max(),
+            erase_counter.StdDev(), erase_counter.NumWornOut());
   }
 
  private:
   /* Functions used internally in class */
 
   /*
-   * UpdateBlockErasure() - Decrease block erasure for a certain block
-   * by 1
+   * UpdateBlockErasure() - Count one more erase of a certain block
    *
    * The argument should be a valid block level page address,
    * i.e. pointing to the first page of a block.
    * If this address is malformed assertion would fail
    *
-   * We maintain this map in a lazy manner
-   * i.e. If an item is missing just create it and initialize it with
-   * max erasure; Then we find the item and decrease the count by 1
+   * Erasing a block that is already worn out throws an exception
    */
   void UpdateBlockErasure(size_t block_lba) {
     /* It should be a multiple of page_per_block */
     assert((block_lba % page_per_block) == 0);
 
-    /*
-     * We tentatively insert this into the map, and if it fails
-     * then simply decrease the count by 1
-     */
-    const auto &value = std::make_pair(block_lba, block_erase_count);
-
-    /*
-     * If the key already exists this will not insert new value
-     * but always returns the iterator to the key-value pair
-     */
-    const auto &ret = block_erasure_map.insert(value);
-
-    /* If the block is already 0 then we are finished */
-    if (ret.first->second == 0) {
+    size_t block = codec.BlockOfPage(block_lba);
+    if (erase_counter.IsWornOut(block)) {
       ThrowBlockDeadError(block_lba);
-    } else {
-      /*
-       * Decrease the count anyway (we do not care whether
-       * the insert succeeded or not since we always need to
-       * decrease counter)
-       */
-      ret.first->second--;
     }
+    erase_counter.Record(block);
 
     return;
   }
@@ -1447,13 +2817,23 @@ class Controller {
      * If the size of page buffer > 0 then we are caching
      * pages in the buffer
      */
-    if (page_buffer.size() != 0) {
-      ThrowStateNotCleanedError(page_buffer.size());
+    if (!page_buffer.Empty()) {
+      ThrowStateNotCleanedError(page_buffer.Size());
     }
 
     return;
   }
 
+#if (CONFIG_TWOPROC == 1)
+  /*
+   * PublishIssueTime() - Tells FTL when the host operation in progress was
+   *                      issued, see ExecCallBack::Now()
+   */
+  void PublishIssueTime() {
+    Common.host_op_time->store(timing.IssueTime(), std::memory_order_relaxed);
+  }
+#endif
+
   /*
    * ThrowUnknownOpCodeError() - Throws error because we have seen an
    * 			       unknown opcode
@@ -1489,6 +2869,16 @@ class Controller {
                             std::to_string(physical_lba));
   }
 
+  /*
+   * ThrowWriteEmptyBufferError() - Write with no page in the buffer to be
+   *                                written
+   */
+  void ThrowWriteEmptyBufferError(size_t physical_lba) {
+    throw FlashSimException("Write operation on physical page " +
+                            std::to_string(physical_lba) +
+                            " with an empty buffer");
+  }
+
   /*
    * ThrowInvalidReadError() - Write on a page that has already been
    *                              written and not erased
@@ -1497,8 +2887,36 @@ class Controller {
     throw FlashSimException("Read operation on invalid physical page " +
                             std::to_string(physical_lba));
   }
+
+  /*
+   * ThrowNotMetadataError() - Metadata read of a page the FTL did not
+   *                           program with metadata
+   */
+  void ThrowNotMetadataError(size_t physical_lba) {
+    throw FlashSimException("Metadata read of data page " +
+                            std::to_string(physical_lba));
+  }
+
+  /*
+   * ThrowInvalidAddressError() - Operation on an address outside of the
+   *                              SSD geometry
+   */
+  void ThrowInvalidAddressError(const Address &addr) {
+    throw FlashSimException(
+        "Operation on invalid address <" + std::to_string(addr.package) +
+        "," + std::to_string(addr.die) + "," + std::to_string(addr.plane) +
+        "," + std::to_string(addr.block) + "," + std::to_string(addr.page) +
+        ">");
+  }
 };
 
+template <typename PageType>
+constexpr size_t Controller<PageType>::METADATA_LBA;
+template <typename PageType>
+constexpr size_t Controller<PageType>::CLEAN_PAGE;
+template <typename PageType>
+constexpr size_t Controller<PageType>::NUM_OPCODES;
+
 /**************************** class Controller ends ***************************/
 
 /********************** class FlashSimExecCallBack starts *********************/
@@ -1536,8 +2954,66 @@ class FlashSimExecCallBack : public ExecCallBack<PageType> {
    *              ExecuteCommand() of class Controller
    */
   void operator()(OpCode operation, Address addr) const {
+#if (CONFIG_TWOPROC == 0)
+    FTLMeter::Host([&] { controller_p->ExecuteCommand(operation, addr); });
+#else
     controller_p->ExecuteCommand(operation, addr);
+#endif
   };
+
+  /*
+   * Submit() - Hands a list of commands to ExecuteCommands() of class
+   *            Controller
+   */
+  void Submit(const Command *commands, size_t count) const {
+#if (CONFIG_TWOPROC == 0)
+    FTLMeter::Host([&] { controller_p->ExecuteCommands(commands, count); });
+#else
+    controller_p->ExecuteCommands(commands, count);
+#endif
+  }
+
+  /*
+   * Now() - Returns when the host operation in progress was issued
+   */
+  uint64_t Now() const { return controller_p->timing.IssueTime(); }
+
+  /*
+   * ProgramMetadata() - Calls ProgramMetadata() of class Controller
+   */
+  void ProgramMetadata(Address addr, uint64_t tag, const void *data,
+                       size_t size) const {
+#if (CONFIG_TWOPROC == 0)
+    FTLMeter::Host(
+        [&] { controller_p->ProgramMetadata(addr, tag, data, size); });
+#else
+    controller_p->ProgramMetadata(addr, tag, data, size);
+#endif
+  }
+
+  /*
+   * ReadMetadata() - Calls ReadMetadata() of class Controller
+   */
+  void ReadMetadata(Address addr, void *data, size_t size) const {
+#if (CONFIG_TWOPROC == 0)
+    FTLMeter::Host([&] { controller_p->ReadMetadata(addr, data, size); });
+#else
+    controller_p->ReadMetadata(addr, data, size);
+#endif
+  }
+
+  /*
+   * ReadSpare() - Calls ReadSpare() of class Controller
+   */
+  uint64_t ReadSpare(Address addr) const {
+#if (CONFIG_TWOPROC == 0)
+    uint64_t spare;
+    FTLMeter::Host([&] { spare = controller_p->ReadSpare(addr); });
+    return spare;
+#else
+    return controller_p->ReadSpare(addr);
+#endif
+  }
 };
 
 /*********************** class FlashSimExecCallBack ends **********************/
@@ -1572,17 +3048,21 @@ class FlashSimTest {
    */
   FlashSimTest(const std::string &fpath)
       : conf(fpath),
-        store(MAX_NUM_PAGES),
+        store(MAX(MAX_NUM_PAGES, conf.Values().pages_per_ssd),
+              conf.GetDataStoreBackend()),
 #if (CONFIG_TWOPROC == 1)
         ftl(CreateFlashSimFTL(this)),
 #else
-        ftl(CreateMyFTL(&conf)),
+        ftl(FTLMeter::Run([&] { return CreateMyFTL(&conf); })),
 #endif
         ctrl(ftl, &store, &conf),
         writes_requested{0},
         writes_done{0},
         trims_requested{0},
-        trims_done{0} {
+        trims_done{0},
+        submitted{},
+        completed{},
+        next_seq{0} {
 #if ENABLE_TRANS_TRACING
     trans_trace_fp = fopen(TRANS_TRACE_FILE, "w");
     if (trans_trace_fp == NULL) {
@@ -1621,28 +3101,15 @@ class FlashSimTest {
   int Write(FILE *log, size_t addr, const TEST_PAGE_TYPE &buf) {
     if (log) fprintf(log, "----------------\nWriting LBA %zu\n", addr);
 
-    ExecState status;
-
-    try {
-      writes_requested++;
-      status = ctrl.WriteLBA(buf, addr);
-
-    } catch (FlashSimException &err) {
-      std::cout << "!!! Error writing LBA " << addr << " !!!" << std::endl
-                << err.what() << std::endl;
-      ;
-      return -1;
-    }
+    int r = RunNow(OP_WRITE, addr, buf).result;
 
-    if (status != ExecState::SUCCESS) {
+    if (r == 0) {
       if (log) fprintf(log, "LBA %zu not writable\n", addr);
-      return 0;
-    } else {
-      writes_done++;
+    } else if (r == 1) {
       if (log) fprintf(log, "LBA %zu written\n", addr);
-
-      return 1;
     }
+
+    return r;
   }
 
   /*
@@ -1653,30 +3120,16 @@ class FlashSimTest {
   int Read(FILE *log, size_t addr, TEST_PAGE_TYPE *buf) {
     if (log) fprintf(log, "----------------\nReading LBA %zu\n", addr);
 
-    ExecState status;
-
-    try {
-      /*
-       * TODO: Check that addr remains same
-       * This works as a check that user is doing everything
-       * correctly
-       */
-      status = ctrl.ReadLBA(buf, addr);
-
-    } catch (FlashSimException &err) {
-      std::cout << "!!! Error reading LBA " << addr << " !!!" << std::endl
-                << err.what();
-      return -1;
-    }
+    Completion done = RunNow(OP_READ, addr, TEST_PAGE_TYPE());
 
-    if (status != ExecState::SUCCESS) {
+    if (done.result == 0) {
       if (log) fprintf(log, "LBA %zu not readable\n", addr);
-      return 0;
-    } else {
+    } else if (done.result == 1) {
+      *buf = done.page;
       if (log) fprintf(log, "LBA %zu read\n", addr);
-
-      return 1;
     }
+
+    return done.result;
   }
 
   /*
@@ -1685,38 +3138,79 @@ class FlashSimTest {
   int Trim(FILE *log, size_t addr) {
     if (log) fprintf(log, "----------------\nTrimming LBA %zu\n", addr);
 
-    ExecState status;
-
-    try {
-      trims_requested++;
-      status = ctrl.Trim(addr);
+    int r = RunNow(OP_TRIM, addr, TEST_PAGE_TYPE()).result;
 
-    } catch (FlashSimException &err) {
-      std::cout << "!!! Error trimming LBA " << addr << " !!!" << std::endl
-                << err.what();
-      return -1;
+    if (r == 0) {
+      if (log) fprintf(log, "LBA %zu not trimmed\n", addr);
+    } else if (r == 1) {
+      if (log) fprintf(log, "LBA %zu trimmed\n", addr);
     }
 
-    if (status != ExecState::SUCCESS) {
-      if (log) fprintf(log, "LBA %zu not trimmed\n", addr);
+    return r;
+  }
 
-      return 0;
+  /*
+   * Queue API - SubmitWrite(), SubmitRead() and SubmitTrim() queue a host
+   * operation and return its sequence id. Complete() returns the results
+   * in submission order, so a test sees exactly what the calls above would
+   * have returned one by one.
+   *
+   * Up to HOST_OP_WINDOW submitted operations are handed to the FTL ahead
+   * of time. When it runs in another process, it works on them while the
+   * test keeps submitting.
+   */
+  uint64_t SubmitWrite(size_t addr, const TEST_PAGE_TYPE &buf) {
+    return Submit(OP_WRITE, addr, buf);
+  }
 
-    } else {
-      trims_done++;
-      if (log) fprintf(log, "LBA %zu trimmed\n", addr);
-      return 1;
+  uint64_t SubmitRead(size_t addr) {
+    return Submit(OP_READ, addr, TEST_PAGE_TYPE());
+  }
+
+  uint64_t SubmitTrim(size_t addr) {
+    return Submit(OP_TRIM, addr, TEST_PAGE_TYPE());
+  }
+
+  /* Result of a submitted host operation */
+  struct Completion {
+    uint64_t seq;
+    size_t addr;
+    /* As returned by Write(), Read() or Trim() */
+    int result;
+    /* Data read, if a read returned 1 */
+    TEST_PAGE_TYPE page;
+  };
+
+  /* Returns the oldest result not returned yet, waiting for it if needed */
+  Completion Complete() {
+    if (completed.empty()) {
+      if (submitted.empty()) {
+        ThrowNothingSubmittedError();
+      }
+      Retire();
     }
+
+    Completion done = completed.front();
+    completed.pop_front();
+    return done;
   }
 
+  /* Number of submitted operations whose results weren't returned yet */
+  size_t Outstanding() const { return submitted.size() + completed.size(); }
+
   int Report(FILE *log) {
     double write_amp = double(TotalWritesPerformed()) / writes_done;
     fprintf(log, "-----------------------------------------------------\n");
-    fprintf(log, "WRITES REQUESTED = %lu\n", writes_requested);
-    fprintf(log, "WRITES DONE BY YOUR FTL = %lu\n", writes_done);
+    fprintf(log, "WRITES REQUESTED = %" PRIu64 "\n", writes_requested);
+    fprintf(log, "WRITES DONE BY YOUR FTL = %" PRIu64 "\n", writes_done);
     fprintf(log, "INTERNAL WRITE_AMPLIFICATION = %f\n", write_amp);
-    fprintf(log, "TRIMS REQUESTED = %lu\n", trims_requested);
-    fprintf(log, "TRIMS DONE BY YOUR FTL = %lu\n", trims_done);
+    fprintf(log, "TRIMS REQUESTED = %" PRIu64 "\n", trims_requested);
+    fprintf(log, "TRIMS DONE BY YOUR FTL = %" PRIu64 "\n", trims_done);
+    fprintf(log, "-----------------------------------------------------\n");
+    ctrl.ReportSpread(log);
+    ctrl.ReportErasures(log);
+    fprintf(log, "-----------------------------------------------------\n");
+    ctrl.ReportTiming(log);
     fprintf(log, "-----------------------------------------------------\n");
 
 #if MEMCHECK_ENABLED
@@ -1728,6 +3222,16 @@ class FlashSimTest {
      */
     size_t mem_usage = get_child_total_mem(ctrl.GetFTLStackSize());
     printf("Memory usage: %zu bytes\n", mem_usage);
+    memcheck_report(log);
+
+#elif (CONFIG_TWOPROC == 0) && MEMMETER_ENABLED
+    size_t mem_usage = FTLMeter::GetTotalMem();
+    printf("Memory usage: %zu bytes\n", mem_usage);
+    fprintf(log,
+            "MEMORY METERED: heap %zu (%zu allocated), data %zu, stack %zu "
+            "bytes\n",
+            FTLMeter::GetHeapSize(), FTLMeter::GetAllocSize(),
+            FTLMeter::GetDataSize(), FTLMeter::GetStackSize());
 
 #else
     /* Simplify. If assign zero, then can't divide */
@@ -1799,6 +3303,114 @@ class FlashSimTest {
    * checks that an FTL didn't finish a stress test before it should.
    */
   bool AtLeastOneBlockWornOut() { return ctrl.AtLeastOneBlockWornOut(); }
+
+  /* Returns the erase counts of the blocks, e.g. to check wear leveling */
+  const EraseCounter &EraseCounts() const { return ctrl.EraseCounts(); }
+
+ private:
+  enum HostOpKind { OP_READ, OP_WRITE, OP_TRIM };
+
+  /* A submitted host operation which the controller hasn't executed yet */
+  struct PendingOp {
+    uint64_t seq;
+    HostOpKind kind;
+    size_t addr;
+    /* Data to write */
+    TEST_PAGE_TYPE page;
+  };
+
+  uint64_t Submit(HostOpKind kind, size_t addr, const TEST_PAGE_TYPE &page) {
+    if (submitted.size() == conf.GetHostOpWindow()) {
+      Retire();
+    }
+
+    PendingOp op = {next_seq++, kind, addr, page};
+    submitted.push_back(op);
+    PostHostOp(op);
+
+    return op.seq;
+  }
+
+  /*
+   * PostHostOp() - Lets FTL start translating a submitted operation. This
+   * does nothing unless FTL runs in another process, see the definition
+   * below class FlashSimFTL
+   */
+  void PostHostOp(const PendingOp &op);
+
+  /* Executes an operation right away, outside of the queue API */
+  Completion RunNow(HostOpKind kind, size_t addr, const TEST_PAGE_TYPE &page) {
+    if (Outstanding() != 0) {
+      ThrowQueueNotEmptyError();
+    }
+
+    Submit(kind, addr, page);
+    return Complete();
+  }
+
+  /*
+   * Retire() - Executes the oldest submitted operation on the controller
+   * and queues its result
+   */
+  void Retire() {
+    PendingOp op = submitted.front();
+    submitted.pop_front();
+
+    Completion done = {op.seq, op.addr, 0, TEST_PAGE_TYPE()};
+    ExecState status;
+
+    try {
+      switch (op.kind) {
+        case OP_WRITE:
+          writes_requested++;
+          status = ctrl.WriteLBA(op.page, op.addr);
+          if (status == ExecState::SUCCESS) writes_done++;
+          break;
+
+        case OP_READ:
+          status = ctrl.ReadLBA(&done.page, op.addr);
+          break;
+
+        case OP_TRIM:
+          trims_requested++;
+          status = ctrl.Trim(op.addr);
+          if (status == ExecState::SUCCESS) trims_done++;
+          break;
+      }
+
+      done.result = (status == ExecState::SUCCESS) ? 1 : 0;
+
+    } catch (FlashSimException &err) {
+      static const char *const op_names[] = {"reading", "writing",
+                                             "trimming"};
+      std::cout << "!!! Error " << op_names[op.kind] << " LBA " << op.addr
+                << " !!!" << std::endl
+                << err.what() << std::endl;
+      done.result = -1;
+    }
+
+    completed.push_back(done);
+  }
+
+  /* Exceptions */
+
+  void ThrowNothingSubmittedError() const {
+    throw FlashSimException("FlashSimTest: Complete() with nothing submitted");
+  }
+
+  void ThrowQueueNotEmptyError() const {
+    throw FlashSimException(
+        "FlashSimTest: Write(), Read() or Trim() while submitted operations "
+        "are not completed");
+  }
+
+  /* Submitted operations, oldest first */
+  std::deque<PendingOp> submitted;
+
+  /* Results not returned by Complete() yet, oldest first */
+  std::deque<Completion> completed;
+
+  uint64_t next_seq;
 };
 
 /************************** class FlashSimTest ends ***************************/
@@ -1821,13 +3433,41 @@ class FlashSimFTL : public FTLBase<PageType> {
  private:
   FlashSimTest *fs_test;
 
+  /* Receives the commands of a MSG_SIM_REQ_BATCH */
+  Command commands[EXEC_BATCH_MAX];
+
+  /* Content of the metadata page being programmed or read */
+  std::vector<char> metadata;
+
+  /*
+   * First failure of a (unanswered) request for simulation services since
+   * the last host operation completed. Rethrown with that operation's
+   * response, requests arriving meanwhile are dropped
+   */
+  std::exception_ptr sim_error;
+
+  /* Host operations sent by Post() whose responses aren't consumed yet */
+  std::deque<IPC_Format> posted;
+
+  /* Sequence id of the next host operation */
+  uint32_t next_seq;
+
+  /* Whether a host operation was answered, i.e. the FTL is constructed */
+  bool ftl_answered;
+
   /*
    * Make all interface classes public so that class Controller
    * has access to them
    */
 
  public:
-  FlashSimFTL(FlashSimTest *fs_test) : fs_test(fs_test){};
+  FlashSimFTL(FlashSimTest *fs_test)
+      : fs_test(fs_test),
+        commands(),
+        sim_error(),
+        posted(),
+        next_seq(0),
+        ftl_answered(false){};
 
   /*
    * The destructor must be made virtual to make deleting the object
@@ -1848,7 +3488,8 @@ class FlashSimFTL : public FTLBase<PageType> {
     /* Send the IPC message to FTL and get response */
     SendReqToFtl(&tx_msg, &rx_msg);
 
-    return std::make_pair(rx_msg.ftl_resp_execstate_, rx_msg.ftl_resp_addr_);
+    return std::make_pair(rx_msg.ftl_resp_execstate_,
+                          AddressCodec::Unpack(rx_msg.ftl_resp_addr_));
   }
 
   std::pair<ExecState, Address> WriteTranslate(size_t lba,
@@ -1862,7 +3503,8 @@ class FlashSimFTL : public FTLBase<PageType> {
     /* Send the IPC message to FTL and get response */
     SendReqToFtl(&tx_msg, &rx_msg);
 
-    return std::make_pair(rx_msg.ftl_resp_execstate_, rx_msg.ftl_resp_addr_);
+    return std::make_pair(rx_msg.ftl_resp_execstate_,
+                          AddressCodec::Unpack(rx_msg.ftl_resp_addr_));
   }
 
   ExecState Trim(size_t lba, const ExecCallBack<PageType> &) {
@@ -1878,6 +3520,24 @@ class FlashSimFTL : public FTLBase<PageType> {
     return rx_msg.ftl_resp_execstate_;
   }
 
+  /*
+   * Post() - Sends a host operation (MSG_FTL_INSTR_*) to FTL without waiting
+   *          for it. Its response is consumed by the ReadTranslate(),
+   *          WriteTranslate() or Trim() call for it, which must come in the
+   *          order operations were posted
+   */
+  void Post(enum message_type_t type, size_t lba) {
+    IPC_Format tx_msg;
+
+    tx_msg.owner_ = OWNER_FLASHSIM;
+    tx_msg.type_ = type;
+    tx_msg.lba_ = lba;
+    tx_msg.seq_ = next_seq++;
+
+    SendMsgToFtl(&tx_msg);
+    posted.push_back(tx_msg);
+  }
+
   /* Returns the FTLs stack size used till now */
   size_t GetFTLStackSize(void) {
     IPC_Format tx_msg, rx_msg;
@@ -1893,7 +3553,7 @@ class FlashSimFTL : public FTLBase<PageType> {
 
  private:
   /*
-   * SendChildBytes - Sends the child process bytes over pipe (IPC)
+   * SendChildBytes - Sends the child process bytes over ring (IPC)
    *
    * If failure here, probably can't continue, so terminate
    *
@@ -1901,33 +3561,24 @@ class FlashSimFTL : public FTLBase<PageType> {
    * size - Size of data in buffer in bytes
    */
   void SendChildBytes(void *buf, size_t size) {
-    ssize_t ret = write(Common.pipefd[PIPE_TX_END], buf, size);
-    if (ret < 0) {
-      perror("FATAL: Couldn't send child data");
-      assert(0 && "Failure in writing to child's rx pipe");
-    }
+    Common.tx_ring->Write(buf, size, Common.pipefd[PIPE_RX_END]);
   }
 
   /*
-   * RecvChildBytes - Recevives from child process bytes over pipe (IPC)
+   * RecvChildBytes - Recevives from child process bytes over ring (IPC)
    *
    * If failure here, probably can't continue, so terminate
    *
    * buf - Buffer which hold's data to send
    * size_t - Size of data that buffer can hold
    *
-   * Returns the actual bytes reveived
+   * Returns the actual bytes reveived - Blocks until buffer is full
    */
   size_t RecvChildBytes(void *buf, size_t size) {
-    ssize_t ret = read(Common.pipefd[PIPE_RX_END], buf, size);
-    if (ret < 0) {
-      perror("FATAL: Couldn't recv child data");
-      assert(0 && "Failure in reading from child's tx pipe");
-    }
+    /* Ring terminates us if the child dies meanwhile */
+    Common.rx_ring->Read(buf, size, Common.pipefd[PIPE_RX_END]);
 
-    if (ret == 0) assert(0 && "Did child died?");
-
-    return ret;
+    return size;
   }
 
   /*
@@ -1936,24 +3587,7 @@ class FlashSimFTL : public FTLBase<PageType> {
    * Returns 1 if pending else 0
    */
   int IsRecvMsgPending(void) {
-    IPC_Format msg;
-    struct pollfd pollfd;
-    int ret;
-
-    pollfd.fd = Common.pipefd[PIPE_RX_END];
-    pollfd.events = POLLIN;
-
-    do {
-      ret = poll(&pollfd, 1, 0);
-
-    } while (ret < 0 && errno == EINTR);
-
-    if (ret < 0) {
-      perror("FATAL: Poll failed");
-      assert(0 && "Poll failed on pipe read");
-    }
-
-    if (ret == 0) /* empty */
+    if (Common.rx_ring->Readable() == 0) /* empty */
       return 0;
     else
       return 1;
@@ -1964,48 +3598,36 @@ class FlashSimFTL : public FTLBase<PageType> {
    *
    * should_block - Block or nonblock
    * rx_msg - Pointer to where to store the received message.
-   * Returns empty message if no mesaage is in pipe
+   * Returns empty message if no mesaage is in ring
    */
   void RecvMsgFromFtl(IPC_Format *rx_msg, int should_block) {
-    int ret;
     size_t size;
-    int timeout;
-    struct pollfd pollfd;
-
-    pollfd.fd = Common.pipefd[PIPE_RX_END];
-    pollfd.events = POLLIN;
-
-    if (should_block) /* Infinite timeout */
-      timeout = -1;
-    else
-      /* Non blocking */
-      timeout = 0;
-
-    do {
-      ret = poll(&pollfd, 1, timeout);
-
-    } while (ret < 0 && errno == EINTR);
-
-    if (ret < 0) {
-      perror("FATAL: Poll failed");
-      assert(0 && "Poll failed on pipe read");
-    }
 
-    if (ret == 0) {
+    if (!should_block && !IsRecvMsgPending()) {
       /* No data to read - Return empty message */
-      assert(should_block == 0 && "No data even on blocking poll");
       rx_msg->type_ = MSG_EMPTY;
       return;
+    }
 
-    } else {
-      /* Copy data */
-      size = RecvChildBytes((void *)rx_msg, sizeof(*rx_msg));
-      if (size != sizeof(*rx_msg)) assert(0 && "Unknown message size");
+    /* Copy data */
+    size = RecvChildBytes((void *)rx_msg, sizeof(*rx_msg));
+    if (size != sizeof(*rx_msg)) assert(0 && "Unknown message size");
 
-      /* Message should be from child */
-      assert(rx_msg->owner_ == OWNER_FTL && "Unknown owner_");
-      return;
-    }
+    /* Message should be from child, speaking our wire format */
+    assert(rx_msg->version_ == IPC_WIRE_VERSION && "Unknown wire format");
+    assert(rx_msg->owner_ == OWNER_FTL && "Unknown owner_");
+  }
+
+  /*
+   * RecvCommands - Receives the commands following a MSG_SIM_REQ_BATCH
+   *                into commands
+   *
+   * count - Number of commands in the batch
+   */
+  void RecvCommands(size_t count) {
+    if (count > EXEC_BATCH_MAX) assert(0 && "Batch too large");
+
+    RecvChildBytes((void *)commands, count * sizeof(Command));
   }
 
   /*
@@ -2021,20 +3643,21 @@ class FlashSimFTL : public FTLBase<PageType> {
   }
 
   /*
-   * ProcessRequest - Process and replies to the request pending in pipe
+   * ProcessRequest - Process and replies to the request pending in ring
    * 		     from FTL
    *
    * recv_msg - 	Return last received non-request msg
    * 		(empty msg or resonse)
-   * should_block - Should read block if no messages in read pipe?
+   * should_block - Should read block if no messages in read ring?
    *
-   * This function ends when either pipe is empty, or pipe now contains a
+   * This function ends when either ring is empty, or ring now contains a
    * response from FTL
    */
   void ProcessRequests(IPC_Format *recv_msg, int should_block) {
     IPC_Format send_msg;
     OpCode sim_req_opcode;
     Address sim_req_addr;
+    MetadataXfer xfer;
 
     send_msg.owner_ = OWNER_FLASHSIM;
 
@@ -2091,17 +3714,122 @@ class FlashSimFTL : public FTLBase<PageType> {
           send_msg.conf_resp_ = fs_test->conf.GetGCPolicy();
           break;
 
-        /* FTL asks for simulation services */
+        case MSG_CONF_REQ_GC_LOW_WATERMARK:
+          send_msg.type_ = MSG_CONF_RES_GC_LOW_WATERMARK;
+          send_msg.conf_resp_ = fs_test->conf.GetGCLowWatermark();
+          break;
+
+        case MSG_CONF_REQ_GC_HIGH_WATERMARK:
+          send_msg.type_ = MSG_CONF_RES_GC_HIGH_WATERMARK;
+          send_msg.conf_resp_ = fs_test->conf.GetGCHighWatermark();
+          break;
+
+        case MSG_CONF_REQ_GC_MAX_PAGES_PER_WRITE:
+          send_msg.type_ = MSG_CONF_RES_GC_MAX_PAGES_PER_WRITE;
+          send_msg.conf_resp_ = fs_test->conf.GetGCMaxPagesPerWrite();
+          break;
+
+        case MSG_CONF_REQ_WEAR_LEVELING_THRESHOLD:
+          send_msg.type_ = MSG_CONF_RES_WEAR_LEVELING_THRESHOLD;
+          send_msg.conf_resp_ = fs_test->conf.GetWearLevelingThreshold();
+          break;
+
+        case MSG_CONF_REQ_MAPPING_CACHE_SIZE:
+          send_msg.type_ = MSG_CONF_RES_MAPPING_CACHE_SIZE;
+          send_msg.conf_resp_ = fs_test->conf.GetMappingCacheSize();
+          break;
+
+        case MSG_CONF_REQ_TRANSLATION_PAGE_ENTRIES:
+          send_msg.type_ = MSG_CONF_RES_TRANSLATION_PAGE_ENTRIES;
+          send_msg.conf_resp_ = fs_test->conf.GetTranslationPageEntries();
+          break;
+
+        case MSG_CONF_REQ_ALLOCATION_STRIPING:
+          send_msg.type_ = MSG_CONF_RES_ALLOCATION_STRIPING;
+          send_msg.conf_resp_ = fs_test->conf.GetAllocationStriping();
+          break;
+
+        /* FTL asks for simulation services - Not answered */
         case MSG_SIM_REQ_READ:  /* Fall through */
         case MSG_SIM_REQ_WRITE: /* Fall through */
         case MSG_SIM_REQ_ERASE: /* Fall through */
 
           sim_req_opcode = recv_msg->sim_req_opcode_;
-          sim_req_addr = recv_msg->sim_req_addr_;
+          sim_req_addr = AddressCodec::Unpack(recv_msg->sim_req_addr_);
+
+          if (sim_error) continue;
+          try {
+            fs_test->ctrl.ExecuteCommand(sim_req_opcode, sim_req_addr);
+          } catch (FlashSimException &) {
+            sim_error = std::current_exception();
+          }
+          continue;
+
+        case MSG_SIM_REQ_BATCH:
+          RecvCommands(recv_msg->sim_req_count_);
+
+          if (sim_error) continue;
+          try {
+            fs_test->ctrl.ExecuteCommands(commands,
+                                          recv_msg->sim_req_count_);
+          } catch (FlashSimException &) {
+            sim_error = std::current_exception();
+          }
+          continue;
+
+        case MSG_SIM_REQ_WRITE_METADATA:
+          RecvChildBytes((void *)&xfer, sizeof(xfer));
+          metadata.resize(xfer.size);
+          RecvChildBytes((void *)metadata.data(), xfer.size);
+
+          if (sim_error) continue;
+          try {
+            fs_test->ctrl.ProgramMetadata(AddressCodec::Unpack(xfer.addr),
+                                          xfer.tag, metadata.data(),
+                                          xfer.size);
+          } catch (FlashSimException &) {
+            sim_error = std::current_exception();
+          }
+          continue;
 
-          fs_test->ctrl.ExecuteCommand(sim_req_opcode, sim_req_addr);
+        /*
+         * The reads are answered even if they fail, with zeros, so the
+         * FTL doesn't wait forever. It gets the error later like for the
+         * other requests
+         */
+        case MSG_SIM_REQ_READ_METADATA:
+          RecvChildBytes((void *)&xfer, sizeof(xfer));
+          metadata.assign(xfer.size, 0);
+
+          if (!sim_error) {
+            try {
+              fs_test->ctrl.ReadMetadata(AddressCodec::Unpack(xfer.addr),
+                                         metadata.data(), xfer.size);
+            } catch (FlashSimException &) {
+              sim_error = std::current_exception();
+            }
+          }
+
+          /* The content follows the response */
+          send_msg.type_ = MSG_SIM_RES_READ_METADATA;
+          Common.reply_ring->Write((void *)&send_msg, sizeof(send_msg),
+                                   Common.pipefd[PIPE_RX_END]);
+          Common.reply_ring->Write((void *)metadata.data(), xfer.size,
+                                   Common.pipefd[PIPE_RX_END]);
+          continue;
 
-          send_msg.type_ = MSG_EMPTY;
+        case MSG_SIM_REQ_READ_SPARE:
+          send_msg.type_ = MSG_SIM_RES_READ_SPARE;
+          send_msg.sim_resp_spare_ = SPARE_ERASED;
+
+          if (!sim_error) {
+            try {
+              send_msg.sim_resp_spare_ = fs_test->ctrl.ReadSpare(
+                  AddressCodec::Unpack(recv_msg->sim_req_addr_));
+            } catch (FlashSimException &) {
+              sim_error = std::current_exception();
+            }
+          }
           break;
 
         /* Various responses */
@@ -2121,8 +3849,10 @@ class FlashSimFTL : public FTLBase<PageType> {
           assert(0 && "Unknown message from FTL");
       } /* Switch */
 
-      /* Send the response now */
-      SendMsgToFtl(&send_msg);
+      /* Send the response now, on the ring for replies */
+      assert((send_msg.owner_ == OWNER_FLASHSIM) && "Unknown owner_");
+      Common.reply_ring->Write((void *)&send_msg, sizeof(send_msg),
+                               Common.pipefd[PIPE_RX_END]);
     } /* Switch */
   }
 
@@ -2159,8 +3889,21 @@ class FlashSimFTL : public FTLBase<PageType> {
         assert(0 && "Unknown msg typ");
     }
 
-    /* Send the child request */
-    SendMsgToFtl(tx_msg);
+    if (exp_rx_typ == MSG_FTL_STACK_SIZE_RESP) {
+      assert(posted.empty() && "Host operations still in flight");
+      SendMsgToFtl(tx_msg);
+
+    } else {
+      /* Send the child request, unless posted earlier */
+      if (posted.empty()) Post(tx_msg->type_, tx_msg->lba_);
+
+      const IPC_Format &oldest = posted.front();
+      if (oldest.type_ != tx_msg->type_ || oldest.lba_ != tx_msg->lba_)
+        assert(0 && "Host operation not the oldest one posted");
+
+      tx_msg->seq_ = oldest.seq_;
+      posted.pop_front();
+    }
 
     while (1) {
       /* Now process request */
@@ -2174,6 +3917,38 @@ class FlashSimFTL : public FTLBase<PageType> {
         assert(0 && "Unknown response received");
     }
 
-    /* Received message is the response */
+    /* FTL answers host operations in order */
+    if (rx_msg->seq_ != tx_msg->seq_) assert(0 && "Response out of order");
+
+#if MEMCHECK_ENABLED
+    /* The child may have grown handling it - Have its memory sampled */
+    if (exp_rx_typ != MSG_FTL_STACK_SIZE_RESP) {
+      if (!ftl_answered)
+        memcheck_end_init();
+      else
+        memcheck_sample_now();
+      ftl_answered = true;
+    }
+#endif
+
+    /* Received message is the response, unless the controller failed */
+    if (sim_error) {
+      std::exception_ptr err = sim_error;
+      sim_error = nullptr;
+      std::rethrow_exception(err);
+    }
   }
 };
+
+/************************** class FlashSimFTL ends ****************************/
+
+inline void FlashSimTest::PostHostOp(const PendingOp &op) {
+#if (CONFIG_TWOPROC == 1)
+  static const enum message_type_t types[] = {
+      MSG_FTL_INSTR_READ, MSG_FTL_INSTR_WRITE, MSG_FTL_INSTR_TRIM};
+
+  static_cast<FlashSimFTL<PageType> *>(ftl)->Post(types[op.kind], op.addr);
+#else
+  (void)op;
+#endif
+}
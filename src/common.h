@@ -18,13 +18,22 @@
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -45,6 +54,8 @@
 /* Parent passed pipe fd in argv to child. These define the offset in argv */
 #define CHILD_PIPE_RX_FD_ARGV_OFF 1 /* 0th is reserved for child's exe name */
 #define CHILD_PIPE_TX_FD_ARGV_OFF 2
+/* Fd of the shared memory holding the IPC rings, see ShmRings */
+#define CHILD_SHM_FD_ARGV_OFF 3
 
 /* Max length of string when pipefd when converted to string */
 #define MAX_PIPEFD_STR_LEN 10
@@ -66,6 +77,33 @@
 #define CONF_S_OVERPROVISIONING "OVERPROVISIONING"
 #define CONF_S_GCPOLICY "SELECTED_GC_POLICY"
 
+/* Values of SELECTED_GC_POLICY */
+enum GCPolicyId {
+  GC_POLICY_FIFO = 0,
+  GC_POLICY_LRU = 1,
+  GC_POLICY_GREEDY = 2,
+  GC_POLICY_COST_BENEFIT = 3
+};
+
+/*
+ * Optional FTL tuning knobs - Getters return 0 when the key is absent from
+ * the configuration file, and the FTL falls back to its own default
+ */
+#define CONF_S_GC_LOW_WATERMARK "GC_LOW_WATERMARK"
+#define CONF_S_GC_HIGH_WATERMARK "GC_HIGH_WATERMARK"
+#define CONF_S_GC_MAX_PAGES_PER_WRITE "GC_MAX_PAGES_PER_WRITE"
+#define CONF_S_WEAR_LEVELING_THRESHOLD "WEAR_LEVELING_THRESHOLD"
+#define CONF_S_MAPPING_CACHE_SIZE "MAPPING_CACHE_SIZE"
+#define CONF_S_TRANSLATION_PAGE_ENTRIES "TRANSLATION_PAGE_ENTRIES"
+#define CONF_S_ALLOCATION_STRIPING "ALLOCATION_STRIPING"
+
+/* Values of ALLOCATION_STRIPING */
+enum AllocationStriping {
+  STRIPE_NONE = 0,
+  STRIPE_DIE = 1,
+  STRIPE_PLANE = 2
+};
+
 // Configs for checkpoint 3 grading.
 #define CONF_S_MEMORY_BASELINE "MEMORY_BASELINE"
 #define CONF_S_WRITES_BASELINE "WRITES_BASELINE"
@@ -80,13 +118,67 @@
   "WEIGHT_WRITE_AMPLIFICATION_FINITE"
 #define CONF_S_WEIGHT_MEMORY_FINITE "WEIGHT_MEMORY_FINITE"
 
+/*
+ * Optional simulated timing - Latencies are in microseconds, and the
+ * simulator falls back to typical values when they are absent.
+ * HOST_QUEUE_DEPTH is the queue depth of the simulated host, i.e. how many
+ * host operations the timing model keeps in flight. It only changes the
+ * simulated times, see class TimingModel
+ */
+#define CONF_S_READ_LATENCY "READ_LATENCY"
+#define CONF_S_PROGRAM_LATENCY "PROGRAM_LATENCY"
+#define CONF_S_ERASE_LATENCY "ERASE_LATENCY"
+#define CONF_S_BUS_LATENCY "BUS_LATENCY"
+#define CONF_S_HOST_QUEUE_DEPTH "HOST_QUEUE_DEPTH"
+
+/*
+ * Optional number of host operations submitted through the queue API of
+ * FlashSimTest that are handed to the FTL before the oldest one completes.
+ * Unlike HOST_QUEUE_DEPTH it has nothing to do with simulated time: it is
+ * how far an FTL in another process may work ahead of the simulator, and
+ * doesn't change what the operations return
+ */
+#define CONF_S_HOST_OP_WINDOW "HOST_OP_WINDOW"
+
+/* Posted operations must always fit the ring to FTL, see ShmRing */
+#define DEFAULT_HOST_OP_WINDOW 32
+#define MAX_HOST_OP_WINDOW 1024
+
+/* Where the simulator keeps page data, see class DataStoreBackend */
+#define CONF_S_DATASTORE_BACKEND "DATASTORE_BACKEND"
+
+/* Values of DATASTORE_BACKEND */
+enum DataStoreBackendId {
+  DS_BACKEND_FILE = 0,
+  DS_BACKEND_MMAP = 1,
+  DS_BACKEND_MEMORY = 2
+};
+
+class ShmRing;
+
 /* Common global data (Between FTL and FlashSim - Not shared, each has copy) */
 struct Common_t {
   /* Forked child's pid */
   pid_t child_pid;
 
-  /* Pipes - For IPC between child and process */
+  /*
+   * Pipes - Carry no data, only tell a process that its peer has died
+   * (rx end reports POLLHUP once the other process has exited)
+   */
   int pipefd[2];
+
+  /* Shared memory rings - For IPC between child and process */
+  ShmRing *rx_ring;
+  ShmRing *tx_ring;
+
+  /*
+   * Answers to the configuration requests of FTL - Kept apart from rx_ring
+   * of FTL, which may already hold host operations posted ahead of time
+   */
+  ShmRing *reply_ring;
+
+  /* Simulated issue time of the current host operation, see ShmRings */
+  std::atomic<uint64_t> *host_op_time;
 };
 
 /* Common global data */
@@ -168,6 +260,48 @@ class ConfBase {
     return size_t(-1);
   }
 
+  /* Returns the free block count at which incremental GC starts (optional) */
+  virtual size_t GetGCLowWatermark(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns the free block count at which incremental GC stops (optional) */
+  virtual size_t GetGCHighWatermark(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns the max pages incremental GC migrates per write (optional) */
+  virtual size_t GetGCMaxPagesPerWrite(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns the erase count spread that triggers wear leveling (optional) */
+  virtual size_t GetWearLevelingThreshold(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns the RAM (bytes) for cached mappings, 0 = all in RAM (optional) */
+  virtual size_t GetMappingCacheSize(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns the number of mappings per translation page (optional) */
+  virtual size_t GetTranslationPageEntries(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
+  /* Returns how host writes are striped, see AllocationStriping (optional) */
+  virtual size_t GetAllocationStriping(void) const {
+    assert(0);
+    return size_t(-1);
+  }
+
   /*
    * Returns the string corresponding to string (as in conf file)
    * It is preferred not to call this function directly
@@ -268,30 +402,220 @@ class Address {
   }
 };
 
+/*
+ * class AddressDivider - Divides by a divisor fixed at construction
+ *
+ * Powers of two are divided with a shift and a mask. Other divisors use the
+ * multiply-shift of libdivide: with M = 2^64 / divisor rounded up, n / divisor
+ * is the high half of n * M, which is exact for every n below 2^32. Larger
+ * numerators fall back to a plain division.
+ */
+class AddressDivider {
+ public:
+  AddressDivider() : divisor_(1), shift_(0), magic_(0) {}
+
+  explicit AddressDivider(uint64_t divisor)
+      : divisor_(divisor), shift_(0), magic_(0) {
+    assert(divisor > 0);
+    if ((divisor & (divisor - 1)) == 0) {
+      while ((uint64_t(1) << shift_) < divisor) {
+        shift_++;
+      }
+    } else {
+      magic_ = UINT64_MAX / divisor + 1;
+    }
+  }
+
+  uint64_t Div(uint64_t n) const {
+    if (magic_ == 0) {
+      return n >> shift_;
+    }
+    if (n <= UINT32_MAX) {
+      return uint64_t((unsigned __int128)magic_ * n >> 64);
+    }
+    return n / divisor_;
+  }
+
+  uint64_t Mod(uint64_t n) const {
+    if (magic_ == 0) {
+      return n & (divisor_ - 1);
+    }
+    return n - Div(n) * divisor_;
+  }
+
+ private:
+  uint64_t divisor_;
+  /* Used when the divisor is a power of two */
+  unsigned shift_;
+  /* Used otherwise, 0 for powers of two */
+  uint64_t magic_;
+};
+
+/*
+ * class AddressCodec - Converts between Address objects and flat page
+ *                      (or block) indexes for a given SSD geometry
+ *
+ * Pages are numbered package by package, then die, plane, block and page,
+ * which is the order used by both the FTL and the controller. The strides
+ * and dividers are computed once, so no conversion divides at runtime.
+ */
+class AddressCodec {
+ public:
+  AddressCodec(size_t ssd_size, size_t package_size, size_t die_size,
+               size_t plane_size, size_t block_size)
+      : ssd_size_(ssd_size),
+        block_size_(block_size),
+        plane_size_(plane_size),
+        die_size_(die_size),
+        package_size_(package_size),
+        page_per_plane_(block_size * plane_size),
+        page_per_die_(page_per_plane_ * die_size),
+        page_per_package_(page_per_die_ * package_size),
+        num_pages_(page_per_package_ * ssd_size),
+        block_div_(block_size),
+        plane_div_(plane_size),
+        die_div_(die_size),
+        package_div_(package_size) {}
+
+  explicit AddressCodec(const ConfBase *conf)
+      : AddressCodec(conf->GetSSDSize(), conf->GetPackageSize(),
+                     conf->GetDieSize(), conf->GetPlaneSize(),
+                     conf->GetBlockSize()) {}
+
+  /* Total number of pages in the SSD */
+  size_t NumPages() const { return num_pages_; }
+
+  /* Whether every component of the address is within the geometry */
+  bool Contains(const Address &addr) const {
+    return addr.package < ssd_size_ && addr.die < package_size_ &&
+           addr.plane < die_size_ && addr.block < plane_size_ &&
+           addr.page < block_size_;
+  }
+
+  /* Total number of planes in the SSD, numbered like pages */
+  size_t NumPlanes() const { return num_pages_ / page_per_plane_; }
+
+  size_t PlaneIndex(const Address &addr) const {
+    return (addr.package * package_size_ + addr.die) * die_size_ + addr.plane;
+  }
+
+  size_t PageIndex(const Address &addr) const {
+    return addr.package * page_per_package_ + addr.die * page_per_die_ +
+           addr.plane * page_per_plane_ + addr.block * block_size_ + addr.page;
+  }
+
+  size_t BlockIndex(const Address &addr) const {
+    return PageIndex(addr) / block_size_;
+  }
+
+  /* Index of the block a page belongs to */
+  size_t BlockOfPage(size_t page_idx) const { return block_div_.Div(page_idx); }
+
+  Address PageAddress(size_t page_idx) const {
+    size_t block_idx = block_div_.Div(page_idx);
+    Address addr = BlockAddress(block_idx);
+    addr.page = page_idx - block_idx * block_size_;
+    return addr;
+  }
+
+  Address BlockAddress(size_t block_idx) const {
+    size_t plane_idx = plane_div_.Div(block_idx);
+    size_t die_idx = die_div_.Div(plane_idx);
+    size_t package_idx = package_div_.Div(die_idx);
+    return Address(package_idx, die_idx - package_idx * package_size_,
+                   plane_idx - die_idx * die_size_,
+                   block_idx - plane_idx * plane_size_, 0);
+  }
+
+  /*
+   * Pack() / Unpack() - An Address fits a single 64 bit word, which is how
+   *                     it is passed between processes
+   */
+  static uint64_t Pack(const Address &addr) {
+    return uint64_t(addr.package) << 56 | uint64_t(addr.die) << 48 |
+           uint64_t(addr.plane) << 32 | uint64_t(addr.block) << 16 |
+           addr.page;
+  }
+
+  static Address Unpack(uint64_t word) {
+    return Address(word >> 56, word >> 48, word >> 32, word >> 16, word);
+  }
+
+ private:
+  size_t ssd_size_;
+  size_t block_size_;
+  size_t plane_size_;
+  size_t die_size_;
+  size_t package_size_;
+
+  size_t page_per_plane_;
+  size_t page_per_die_;
+  size_t page_per_package_;
+  size_t num_pages_;
+
+  AddressDivider block_div_;
+  AddressDivider plane_div_;
+  AddressDivider die_div_;
+  AddressDivider package_div_;
+};
+
 /*
  * enum class OpCode - This is the opcode issued from FTL to controller
  *                     for read amplification and write amplification
  */
-enum class OpCode {
+enum class OpCode : uint8_t {
 
-  /* Read a page into the buffer */
+  /* Read a page into the buffer (FTL metadata pages are not buffered) */
   READ = 0,
 
-  /* Write a page into the buffer */
+  /* Write the page at the front of the buffer */
   WRITE,
 
   /* Erase a block (page ID is ignored) */
   ERASE,
+
+  /*
+   * Program an FTL metadata page (e.g. a translation page), which carries
+   * no host data - See ExecCallBack::ProgramMetadata() to give it content
+   */
+  WRITE_METADATA,
 };
 
 /*
  * enum class ExecState - State of execution returned from the FTL
  */
-enum class ExecState {
+enum class ExecState : uint8_t {
   SUCCESS = 0,
   FAILURE,
 };
 
+/*
+ * struct Command - One operation an FTL asks the controller to perform
+ *
+ * It is plain data, so a list of them can be passed between processes as
+ * is
+ */
+struct Command {
+  OpCode operation;
+  Address addr;
+};
+
+/* Max commands in a batch, see class CommandBatch */
+#define EXEC_BATCH_MAX 128
+
+/* What the spare area of an erased page reads as */
+#define SPARE_ERASED UINT64_MAX
+
+/*
+ * struct MetadataXfer - Header of an FTL metadata page passed between
+ *                       processes, the size bytes of its content follow
+ */
+struct MetadataXfer {
+  uint64_t addr;
+  uint64_t tag;
+  uint64_t size;
+};
+
 /*
  * class ExecCallBack() - Proxy class for controller to let FTL call
  *                        	  its function without exposing controller
@@ -322,6 +646,127 @@ class ExecCallBack {
     (void)addr;
     assert(0);
   }
+
+  /*
+   * Submit() - Executes a list of commands in order, exactly as if each of
+   *            them was passed to operator() in turn
+   *
+   * Derived classes override this to hand the whole list over at once
+   */
+  virtual void Submit(const Command *commands, size_t count) const {
+    for (size_t i = 0; i < count; i++) {
+      (*this)(commands[i].operation, commands[i].addr);
+    }
+  }
+
+  /*
+   * Now() - Returns the simulated time (us) the host operation being
+   *         translated was issued at, 0 if the simulator keeps no time
+   */
+  virtual uint64_t Now() const { return 0; }
+
+  /*
+   * ProgramMetadata() - Executes a WRITE_METADATA, storing size bytes of
+   *                     data in the page and tag in its spare area
+   *
+   * The page content lives on the simulated flash, so an FTL can keep
+   * metadata there (e.g. the translation pages of a demand paged mapping)
+   * without holding a copy in its own memory
+   */
+  virtual void ProgramMetadata(Address addr, uint64_t tag, const void *data,
+                               size_t size) const {
+    (void)addr;
+    (void)tag;
+    (void)data;
+    (void)size;
+    assert(0);
+  }
+
+  /*
+   * ReadMetadata() - Executes a READ of a page programmed by
+   *                  ProgramMetadata(), copying its content to data (size
+   *                  bytes, zero filled past what was programmed)
+   */
+  virtual void ReadMetadata(Address addr, void *data, size_t size) const {
+    (void)addr;
+    (void)data;
+    (void)size;
+    assert(0);
+  }
+
+  /*
+   * ReadSpare() - Returns what the spare area of a page holds: The LBA of
+   *               the host data in it, the tag given to ProgramMetadata(),
+   *               or SPARE_ERASED if it was not programmed since its last
+   *               erase (or by a WRITE_METADATA without content)
+   *
+   * The spare area is read along with the page, so this costs no flash
+   * operation of its own
+   */
+  virtual uint64_t ReadSpare(Address addr) const {
+    (void)addr;
+    assert(0);
+    return SPARE_ERASED;
+  }
+};
+
+/*
+ * class CommandBatch - Collects the commands an FTL issues and submits them
+ *                      to another ExecCallBack together
+ *
+ * Commands are held until Flush() is called, or until EXEC_BATCH_MAX of
+ * them are collected, so an FTL must flush before returning to the
+ * controller. Commands do not return anything to the FTL, so deferring
+ * them changes nothing but the number of calls (and, with two processes,
+ * of round trips) it takes to execute them. Metadata and spare area
+ * accesses go to the target right away, after flushing to keep the order.
+ */
+template <typename PageType>
+class CommandBatch : public ExecCallBack<PageType> {
+ public:
+  explicit CommandBatch(const ExecCallBack<PageType> &target)
+      : target_(target), count_(0) {}
+
+  void operator()(OpCode operation, Address addr) const {
+    commands_[count_].operation = operation;
+    commands_[count_].addr = addr;
+    if (++count_ == EXEC_BATCH_MAX) {
+      Flush();
+    }
+  }
+
+  uint64_t Now() const { return target_.Now(); }
+
+  void ProgramMetadata(Address addr, uint64_t tag, const void *data,
+                       size_t size) const {
+    Flush();
+    target_.ProgramMetadata(addr, tag, data, size);
+  }
+
+  void ReadMetadata(Address addr, void *data, size_t size) const {
+    Flush();
+    target_.ReadMetadata(addr, data, size);
+  }
+
+  uint64_t ReadSpare(Address addr) const {
+    Flush();
+    return target_.ReadSpare(addr);
+  }
+
+  /* Submits the commands collected so far */
+  void Flush() const {
+    if (count_ > 0) {
+      target_.Submit(commands_, count_);
+      count_ = 0;
+    }
+  }
+
+ private:
+  const ExecCallBack<PageType> &target_;
+
+  /* Commands are collected through the const call operator */
+  mutable Command commands_[EXEC_BATCH_MAX];
+  mutable size_t count_;
 };
 /*
  * class FTLBase - The base class for FTL
@@ -395,12 +840,12 @@ class FTLBase {
 };
 
 /* Enum to specify the type of message in IPC and owner (child and parent) */
-enum message_owner_t {
+enum message_owner_t : uint8_t {
   OWNER_FTL = 0,
   OWNER_FLASHSIM,
 };
 
-enum message_type_t {
+enum message_type_t : uint8_t {
 
   /* Placing value to all enum helps in debugging */
 
@@ -448,11 +893,68 @@ enum message_type_t {
   /* Used to gather information from child about stack */
   MSG_FTL_STACK_SIZE_REQ = 27,
   MSG_FTL_STACK_SIZE_RESP = 28,
+
+  /* Child collects optional configuration */
+  MSG_CONF_REQ_GC_LOW_WATERMARK = 29,
+  MSG_CONF_REQ_GC_HIGH_WATERMARK = 30,
+  MSG_CONF_REQ_GC_MAX_PAGES_PER_WRITE = 31,
+
+  /* Parent responds to optional configuration queries */
+  MSG_CONF_RES_GC_LOW_WATERMARK = 32,
+  MSG_CONF_RES_GC_HIGH_WATERMARK = 33,
+  MSG_CONF_RES_GC_MAX_PAGES_PER_WRITE = 34,
+
+  MSG_CONF_REQ_WEAR_LEVELING_THRESHOLD = 35,
+  MSG_CONF_RES_WEAR_LEVELING_THRESHOLD = 36,
+
+  MSG_CONF_REQ_MAPPING_CACHE_SIZE = 37,
+  MSG_CONF_REQ_TRANSLATION_PAGE_ENTRIES = 38,
+  MSG_CONF_RES_MAPPING_CACHE_SIZE = 39,
+  MSG_CONF_RES_TRANSLATION_PAGE_ENTRIES = 40,
+
+  MSG_CONF_REQ_ALLOCATION_STRIPING = 41,
+  MSG_CONF_RES_ALLOCATION_STRIPING = 42,
+
+  /*
+   * Child request parent to execute a list of commands, which follows the
+   * message as sim_req_count_ Command structs
+   */
+  MSG_SIM_REQ_BATCH = 43,
+
+  /*
+   * Child programs an FTL metadata page, a MetadataXfer and the content
+   * follow the message
+   */
+  MSG_SIM_REQ_WRITE_METADATA = 44,
+
+  /*
+   * Child reads an FTL metadata page, a MetadataXfer follows the message.
+   * The response is followed by the content
+   */
+  MSG_SIM_REQ_READ_METADATA = 45,
+  MSG_SIM_RES_READ_METADATA = 46,
+
+  /* Child reads the spare area of the page at sim_req_addr_ */
+  MSG_SIM_REQ_READ_SPARE = 47,
+  MSG_SIM_RES_READ_SPARE = 48,
 };
 
-/* Structure to specify format of communication between parent and child */
+/* Version of the IPC wire format, bump on any change to IPC_Format */
+#define IPC_WIRE_VERSION 4
+
+/*
+ * Structure to specify format of communication between parent and child
+ *
+ * A message is a 16 byte tagged union: the header says which of the union
+ * members are filled. Requests to flashsim (MSG_SIM_REQ_*) are not answered,
+ * FTL keeps going while flashsim executes them, except for the reads of
+ * metadata pages and spare areas. If one of them fails, the error is
+ * reported with the response to the host operation that issued it.
+ */
 class IPC_Format {
  public:
+  /* Must be IPC_WIRE_VERSION - Catches a stale myFTL binary */
+  uint8_t version_;
   /*
    * Owner of the message - Not essential, but used for assertions
    * Inidicated the message originator
@@ -462,47 +964,310 @@ class IPC_Format {
   enum message_type_t type_;
 
   /* The actual data - Which members are filled depends on msg type_*/
-  /* TODO: Can make this union to save space */
+  union {
+    /*
+     * Response fields from FTL
+     * E.g.
+     * std::pair<ExecState, Address>
+     * ReadTranslate(size_t, const FlashSimExecCallBack<PageType> &)
+     */
+    ExecState ftl_resp_execstate_;
+
+    /* Opcode used for sending request to flashsim */
+    OpCode sim_req_opcode_;
+  };
 
   /*
-   * Configuration request's response
-   * E.g.  size_t GetSSDSize(void)
+   * Sequence id of a host operation (MSG_FTL_INSTR_*), echoed in its
+   * response. Several of them can be in flight
    */
-  size_t conf_resp_;
+  uint32_t seq_;
 
-  /*
-   * Used for sending requests to ftl
-   * E.g. WriteTranslate(size_t lba_,
-   * 			const ExecCallBack<PageType> &)
-   */
-  size_t lba_;
+  union {
+    /*
+     * Configuration request's response
+     * E.g.  size_t GetSSDSize(void)
+     */
+    size_t conf_resp_;
 
-  /* Stack size of child */
-  size_t child_stack_size_;
+    /*
+     * Used for sending requests to ftl
+     * E.g. WriteTranslate(size_t lba_,
+     * 			const ExecCallBack<PageType> &)
+     */
+    size_t lba_;
 
-  /*
-   * Response fields from FTL
-   * E.g.
-   * std::pair<ExecState, Address>
-   * ReadTranslate(size_t, const FlashSimExecCallBack<PageType> &)
-   */
-  ExecState ftl_resp_execstate_;
-  Address ftl_resp_addr_;
+    /* Stack size of child */
+    size_t child_stack_size_;
+
+    /* Address returned by FTL, packed with AddressCodec::Pack() */
+    uint64_t ftl_resp_addr_;
+
+    /* Address sent to flashsim along with request, packed */
+    uint64_t sim_req_addr_;
 
-  /* Opcode used for sending request to flashsim */
-  OpCode sim_req_opcode_;
+    /* Number of commands following a MSG_SIM_REQ_BATCH */
+    size_t sim_req_count_;
 
-  /* Address sent to flashsim along with request */
-  Address sim_req_addr_;
+    /* Spare area read by MSG_SIM_REQ_READ_SPARE */
+    uint64_t sim_resp_spare_;
+  };
 
   IPC_Format()
-      : owner_(OWNER_FTL),
+      : version_(IPC_WIRE_VERSION),
+        owner_(OWNER_FTL),
         type_(MSG_EMPTY),
-        conf_resp_(0),
-        lba_(0),
-        child_stack_size_(0),
         ftl_resp_execstate_(ExecState::SUCCESS),
-        sim_req_opcode_(OpCode::READ) {}
+        seq_(0),
+        conf_resp_(0) {}
 
   ~IPC_Format() = default;
-};
\ No newline at end of file
+};
+
+static_assert(sizeof(IPC_Format) == 16, "IPC_Format should stay compact");
+/*
+ * Size in bytes of each direction of the shared memory transport. Must be a
+ * power of two, and comfortably holds a full MSG_SIM_REQ_BATCH
+ */
+#define SHM_RING_BYTES (64 * 1024)
+
+/* Backoff of a side waiting on a ring: pause rounds, then sched_yield()s */
+#define SHM_RING_SPIN_ROUNDS 10
+#define SHM_RING_YIELDS 64
+
+/* How often a process sleeping on a ring checks whether its peer died */
+#define SHM_RING_PEER_CHECK_MS 100
+
+/*
+ * ShmRing - Single producer, single consumer byte ring in memory shared by
+ * FlashSim and FTL. Each stream of messages has its own ring, see ShmRings.
+ *
+ * head_ and tail_ are free running byte counts, advanced only by the producer
+ * and the consumer respectively. A side that can't make progress spins with
+ * exponential backoff, then yields, and finally sleeps on a futex on event_.
+ * The other side only issues the wake up syscall when waiters_ says someone
+ * sleeps, so an exchange between two busy processes never enters the kernel.
+ *
+ * Only messages go through the ring, the address spaces stay separate: the
+ * mapping is neither heap, data nor stack, so memcheck doesn't charge it to
+ * the child.
+ */
+class ShmRing {
+ public:
+  void Init(void) {
+    head_.store(0);
+    tail_.store(0);
+    event_.store(0);
+    waiters_.store(0);
+  }
+
+  /* Number of bytes ready to be read */
+  size_t Readable(void) const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Write - Copies size bytes into the ring, waiting for space as needed
+   *
+   * peer_fd - Reports POLLHUP once the consumer has died
+   */
+  void Write(const void *buf, size_t size, int peer_fd) {
+    const char *src = (const char *)buf;
+
+    while (size > 0) {
+      uint32_t head = head_.load(std::memory_order_relaxed);
+      WaitUntil([&] { return Writable(head) > 0; }, peer_fd);
+
+      size_t n = Chunk(head, std::min(size, Writable(head)));
+      memcpy(&data_[head & (SHM_RING_BYTES - 1)], src, n);
+      head_.store(head + n, std::memory_order_release);
+      Notify();
+
+      src += n;
+      size -= n;
+    }
+  }
+
+  /*
+   * Read - Copies exactly size bytes out of the ring, waiting for the
+   *        producer as needed
+   *
+   * peer_fd - Reports POLLHUP once the producer has died
+   */
+  void Read(void *buf, size_t size, int peer_fd) {
+    char *dst = (char *)buf;
+
+    while (size > 0) {
+      uint32_t tail = tail_.load(std::memory_order_relaxed);
+      WaitUntil([&] { return Readable() > 0; }, peer_fd);
+
+      size_t n = Chunk(tail, std::min(size, Readable()));
+      memcpy(dst, &data_[tail & (SHM_RING_BYTES - 1)], n);
+      tail_.store(tail + n, std::memory_order_release);
+      Notify();
+
+      dst += n;
+      size -= n;
+    }
+  }
+
+  /* Waits until at least one byte can be read */
+  void WaitReadable(int peer_fd) {
+    WaitUntil([&] { return Readable() > 0; }, peer_fd);
+  }
+
+ private:
+  size_t Writable(uint32_t head) const {
+    return SHM_RING_BYTES - (head - tail_.load(std::memory_order_acquire));
+  }
+
+  /* Clamps a copy starting at byte count pos so that it doesn't wrap */
+  static size_t Chunk(uint32_t pos, size_t size) {
+    size_t offset = pos & (SHM_RING_BYTES - 1);
+    return std::min(size, (size_t)SHM_RING_BYTES - offset);
+  }
+
+  /*
+   * Notify - Wakes the other side if it sleeps. Pairs with WaitUntil(): either
+   * the waiter sees the new head_/tail_, or we see it in waiters_
+   */
+  void Notify(void) {
+    event_.fetch_add(1);
+    if (waiters_.load() != 0) Futex(FUTEX_WAKE, INT32_MAX, NULL);
+  }
+
+  template <typename Ready>
+  void WaitUntil(Ready ready, int peer_fd) {
+    for (int round = 0; round < SHM_RING_SPIN_ROUNDS; round++) {
+      if (ready()) return;
+      for (int i = 0; i < (1 << round); i++) CpuRelax();
+    }
+
+    for (int i = 0; i < SHM_RING_YIELDS; i++) {
+      if (ready()) return;
+      sched_yield();
+    }
+
+    while (1) {
+      waiters_.fetch_add(1);
+      uint32_t event = event_.load();
+      if (ready()) {
+        waiters_.fetch_sub(1);
+        return;
+      }
+
+      struct timespec timeout = {0, SHM_RING_PEER_CHECK_MS * 1000 * 1000};
+      long ret = Futex(FUTEX_WAIT, event, &timeout);
+      int err = errno;
+      waiters_.fetch_sub(1);
+
+      if (ready()) return;
+      if (ret < 0 && err == ETIMEDOUT) CheckPeer(peer_fd);
+    }
+  }
+
+  long Futex(int op, uint32_t val, const struct timespec *timeout) {
+    /* Not FUTEX_PRIVATE_FLAG - the word is shared by two processes */
+    return syscall(SYS_futex, (uint32_t *)&event_, op, val, timeout, NULL, 0);
+  }
+
+  /* Terminates if the process on the other end of the ring is gone */
+  static void CheckPeer(int peer_fd) {
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = peer_fd;
+    pfd.events = POLLIN;
+
+    do {
+      ret = poll(&pfd, 1, 0);
+
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      perror("FATAL: Poll failed");
+      assert(0 && "Poll failed on peer pipe");
+    }
+
+    if (pfd.revents & (POLLHUP | POLLERR))
+      assert(0 && "Process on the other end of the ring died");
+  }
+
+  static void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  /* Producer and consumer indices on their own cache lines */
+  alignas(64) std::atomic<uint32_t> head_;
+  alignas(64) std::atomic<uint32_t> tail_;
+  alignas(64) std::atomic<uint32_t> event_;
+  std::atomic<uint32_t> waiters_;
+  alignas(64) char data_[SHM_RING_BYTES];
+
+  static_assert((SHM_RING_BYTES & (SHM_RING_BYTES - 1)) == 0,
+                "SHM_RING_BYTES must be a power of two");
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "Futex word must be a plain 32 bit word");
+};
+
+/*
+ * ShmRings - The shared memory FlashSim creates before forking FTL. FTL
+ * finds it through the fd passed at CHILD_SHM_FD_ARGV_OFF
+ */
+struct ShmRings {
+  /* FlashSim produces, FTL consumes */
+  ShmRing to_ftl;
+  /* FTL produces, FlashSim consumes */
+  ShmRing to_flashsim;
+  /* FlashSim answers requests of FTL, see Common_t */
+  ShmRing replies_to_ftl;
+
+  /*
+   * Simulated time (us) the host operation FlashSim is executing was issued
+   * at, for ExecCallBack::Now() of FTL. Operations posted ahead of time may
+   * be translated while it is still that of an earlier one
+   */
+  std::atomic<uint64_t> host_op_time;
+
+  /*
+   * Create - Creates and maps the (initialized) shared memory
+   *
+   * fd_p - Filled with the fd backing it, which is inherited across execve
+   */
+  static ShmRings *Create(int *fd_p) {
+    int fd = memfd_create("746FlashSim-ipc", 0);
+    if (fd < 0) {
+      perror("FATAL: Couldn't create shared memory");
+      assert(0 && "Failure in creating shared memory");
+    }
+
+    if (ftruncate(fd, sizeof(ShmRings)) < 0) {
+      perror("FATAL: Couldn't size shared memory");
+      assert(0 && "Failure in sizing shared memory");
+    }
+
+    ShmRings *rings = Map(fd);
+    rings->to_ftl.Init();
+    rings->to_flashsim.Init();
+    rings->replies_to_ftl.Init();
+    rings->host_op_time.store(0);
+
+    *fd_p = fd;
+    return rings;
+  }
+
+  /* Map - Maps the shared memory created by Create() */
+  static ShmRings *Map(int fd) {
+    void *addr = mmap(NULL, sizeof(ShmRings), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      perror("FATAL: Couldn't map shared memory");
+      assert(0 && "Failure in mapping shared memory");
+    }
+
+    return (ShmRings *)addr;
+  }
+};
@@ -17,15 +17,18 @@
 /* Should we track child's memory? */
 #define MEMCHECK_ENABLED 1
 
+/*
+ * Should we meter the FTL's memory when it runs in the same process as the
+ * simulator (CONFIG_TWOPROC=0)? Gives the memory usage that tracking a child
+ * gives, without the child
+ */
+#define MEMMETER_ENABLED 1
+
 /*
  * Do you want trace of malloc - Useful for only debugging
- * Helps in gathering malloc trace and gives a visual chart of
- * how memory is being used along on heap using malloc
- *
- * FIXME: Currently when this option is enabled, you might see lots of warnings
- * given out by gcc. This is because we are trapping malloc using
- * deprecated functions. A better way exists and should be implemented,
- * but logically there shouldn't be any issue with current implementation
+ * Profiles the heap of the FTL by call stack, to find what uses the memory.
+ * The profile is written when the FTL exits, which needs MEMCHECK_ENABLED,
+ * and output/malloc_tracer.sh summarizes it
  */
 #define MALLOC_TRACE_ENABLED 0
 
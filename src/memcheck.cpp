@@ -1,7 +1,7 @@
 /*
  * @file memcheck.cpp
  * @brief This file keeps track of memory usage by the child by periodically
- * checking the proc maps
+ * checking the proc maps, from a sampler thread in the parent
  *
  * @author Saksham Jain (sakshamj)
  * @author (Tweaked) Ankush Jain (ankushj)
@@ -10,22 +10,34 @@
 #include "memcheck.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "config.h"
 
-/*
- * Used to temporarily disable memusage update
- * Synchronization method as dealing with signal handlers
+/**
+ * @brief Usage of the child over one phase of its life, see
+ * memcheck_end_init()
  */
-int disable_update;
+struct memcheck_phase_t {
+  /* Number of samples taken */
+  int samples;
+
+  /* Highest usage sampled */
+  size_t peak;
+
+  /* Usage integrated over time, and the time, for the average */
+  double byte_seconds;
+  double seconds;
+};
 
 /**
  * @brief Global data structure to keep data about all memory usage of child
@@ -58,6 +70,30 @@ struct memcheck_glb_t {
 
   /* Number of times updated */
   int update_count;
+
+  /* Usage (heap, data and stack) seen by the last update, and when */
+  size_t last_usage;
+  double last_time;
+
+  /* Phase the child is in, and the usage over each phase */
+  int phase;
+  struct memcheck_phase_t phases[MEMCHECK_NUM_PHASES];
+
+  /* Serializes the sampler thread with the calls from the test */
+  pthread_mutex_t lock;
+
+  /* Thread doing the periodic and requested updates */
+  pthread_t sampler;
+
+  /*
+   * Set to ask the sampler for an update soon, or to stop. The sampler
+   * sleeps on wakeup (under wakeup_lock, not to hold up the calls from the
+   * test while it updates) until one is set or the period is over
+   */
+  std::atomic<int> sample_requested;
+  std::atomic<int> stop_sampler;
+  pthread_mutex_t wakeup_lock;
+  pthread_cond_t wakeup;
 };
 
 /* All values initialized to zero */
@@ -113,19 +149,68 @@ void print_memusage(size_t stack_size) {
  * mentioned by the procmap - Might be larger than expected
  */
 size_t get_child_total_mem(size_t child_stack_size) {
-  /* Can't call from here as race condition with the alarm signal */
-  /* update_memusage(); */
+  size_t total;
 
+  /* Not updating here - The last update is at most a period old */
+
+  pthread_mutex_lock(&memcheck_glb.lock);
 #if PRINT_STATS_ENABLE
-  print_memusage(child_stack_size_);
+  print_memusage(child_stack_size);
 #endif
   if (child_stack_size == 0) {
-    return memcheck_glb.max_heap_size + memcheck_glb.max_data_size +
-           memcheck_glb.max_stack_size;
+    total = memcheck_glb.max_heap_size + memcheck_glb.max_data_size +
+            memcheck_glb.max_stack_size;
   } else {
-    return memcheck_glb.max_heap_size + memcheck_glb.max_data_size +
-           child_stack_size;
+    total = memcheck_glb.max_heap_size + memcheck_glb.max_data_size +
+            child_stack_size;
   }
+  pthread_mutex_unlock(&memcheck_glb.lock);
+
+  return total;
+}
+
+/**
+ * @brief Returns the time of a monotonic clock in seconds
+ */
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Accounts the usage found by an update to the current phase
+ *
+ * The usage is taken to be the last one sampled until now, so the average
+ * is weighted by how long each usage lasted
+ */
+static void account_sample(void) {
+  struct memcheck_phase_t *phase = &memcheck_glb.phases[memcheck_glb.phase];
+  double now = now_seconds();
+  size_t usage = memcheck_glb.cur_heap_size + memcheck_glb.cur_data_size +
+                 memcheck_glb.cur_stack_size;
+
+  if (memcheck_glb.update_count > 0) {
+    phase->byte_seconds +=
+        memcheck_glb.last_usage * (now - memcheck_glb.last_time);
+    phase->seconds += now - memcheck_glb.last_time;
+  }
+
+  phase->samples++;
+  phase->peak = MAX(phase->peak, usage);
+
+  memcheck_glb.last_usage = usage;
+  memcheck_glb.last_time = now;
+}
+
+/**
+ * @brief Updates usage, excluding other threads doing so
+ */
+static void locked_update(void) {
+  pthread_mutex_lock(&memcheck_glb.lock);
+  assert(update_memusage() == 0);
+  pthread_mutex_unlock(&memcheck_glb.lock);
 }
 
 void get_line(char **buf_p, char *line) {
@@ -163,7 +248,11 @@ int update_memusage(void) {
   memcheck_glb.cur_data_size = 0;
   memcheck_glb.cur_misc_size = 0;
 
-  sprintf(filename, "/proc/%d/smaps", memcheck_glb.pid);
+  /*
+   * Only the size of each mapping is used, so the maps file is enough. It
+   * is a line per mapping, where smaps adds a dozen more
+   */
+  sprintf(filename, "/proc/%d/maps", memcheck_glb.pid);
   fd = open(filename, O_RDONLY);
   if (fd < 0) {
     perror(filename);
@@ -174,7 +263,7 @@ int update_memusage(void) {
     ret = read(fd, &buf[read_size], sizeof(buf));
     read_size += ret;
     if (ret < 0 || read_size == sizeof(buf)) {
-      perror("Possible issue with reading proc smaps");
+      perror("Possible issue with reading proc maps");
       assert(0);
     } else if (ret == 0) {
       break;
@@ -327,23 +416,116 @@ int update_memusage(void) {
               memcheck_glb.cur_annony_size + memcheck_glb.cur_data_size +
               memcheck_glb.cur_misc_size);
 
+  account_sample();
   memcheck_glb.update_count++;
 
   return 0;
 }
 
 /**
- * @brief signal handler which updates memory usage stats
- * @param signal Signal which was received
+ * @brief Waits on the wakeup of the sampler until the given time at most
+ */
+static void sampler_wait(double until) {
+  struct timespec ts;
+
+  ts.tv_sec = (time_t)until;
+  ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+  pthread_cond_timedwait(&memcheck_glb.wakeup, &memcheck_glb.wakeup_lock, &ts);
+}
+
+/**
+ * @brief Body of the sampler thread
+ *
+ * Updates every PERIOD_US_MEMCHECK, and also when woken up by
+ * memcheck_sample_now(), though not more than once per
+ * PERIOD_US_MEMCHECK_MIN. Being a thread instead of a timer signal, it never
+ * interrupts the test's own system calls
+ */
+static void *sampler_main(void *arg) {
+  sigset_t set;
+  double last_update = now_seconds();
+
+  (void)arg;
+
+  /* Signals are for the main thread */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  pthread_mutex_lock(&memcheck_glb.wakeup_lock);
+  while (!memcheck_glb.stop_sampler.load()) {
+    double next_update = last_update + PERIOD_US_MEMCHECK / 1e6;
+
+    if (memcheck_glb.sample_requested.load())
+      next_update = last_update + PERIOD_US_MEMCHECK_MIN / 1e6;
+
+    if (now_seconds() < next_update) {
+      sampler_wait(next_update);
+      continue;
+    }
+
+    memcheck_glb.sample_requested.store(0);
+    pthread_mutex_unlock(&memcheck_glb.wakeup_lock);
+    locked_update();
+    last_update = now_seconds();
+    pthread_mutex_lock(&memcheck_glb.wakeup_lock);
+  }
+  pthread_mutex_unlock(&memcheck_glb.wakeup_lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Wakes up the sampler
  */
-void timer_handler(int signal) {
-  /* Save and restore errno */
-  int old_errno = errno;
+static void sampler_wakeup(void) {
+  pthread_mutex_lock(&memcheck_glb.wakeup_lock);
+  pthread_cond_signal(&memcheck_glb.wakeup);
+  pthread_mutex_unlock(&memcheck_glb.wakeup_lock);
+}
 
-  assert(signal == SIGALRM);
-  if (!disable_update) assert(update_memusage() == 0);
+/**
+ * @brief Asks for an update soon, e.g. after the child handled a request.
+ * Cheap enough to be called for every request, as the sampler is only woken
+ * up by the first request since its last update
+ */
+void memcheck_sample_now(void) {
+  if (memcheck_glb.sample_requested.exchange(1) == 0) sampler_wakeup();
+}
 
-  errno = old_errno;
+/**
+ * @brief Marks the end of the initialization of the child (i.e. its FTL is
+ * constructed). Usage from now on is reported as steady state
+ */
+void memcheck_end_init(void) {
+  pthread_mutex_lock(&memcheck_glb.lock);
+  if (memcheck_glb.phase == MEMCHECK_PHASE_INIT) {
+    assert(update_memusage() == 0);
+    memcheck_glb.phase = MEMCHECK_PHASE_STEADY;
+  }
+  pthread_mutex_unlock(&memcheck_glb.lock);
+}
+
+/**
+ * @brief Prints the peak and average usage of each phase
+ * @param log File to print to
+ */
+void memcheck_report(FILE *log) {
+  static const char *const phase_names[MEMCHECK_NUM_PHASES] = {"INIT",
+                                                               "STEADY"};
+
+  pthread_mutex_lock(&memcheck_glb.lock);
+  for (int i = 0; i < MEMCHECK_NUM_PHASES; i++) {
+    const struct memcheck_phase_t *phase = &memcheck_glb.phases[i];
+    double average = phase->seconds > 0 ? phase->byte_seconds / phase->seconds
+                                        : (double)phase->peak;
+
+    fprintf(log,
+            "MEMORY %s: peak %zu bytes, average %.0f bytes over %.3f s "
+            "(%d samples)\n",
+            phase_names[i], phase->peak, average, phase->seconds,
+            phase->samples);
+  }
+  pthread_mutex_unlock(&memcheck_glb.lock);
 }
 /**
  * @brief Initializes the memcheck functionality on parent side
@@ -351,46 +533,35 @@ void timer_handler(int signal) {
  * @return 0 on success, < 0 on error
  */
 int init_memcheck_parent(pid_t pid) {
+  pthread_condattr_t cond_attr;
   int ret;
-  struct itimerval time_period;
-  sighandler_t old_sighandler;
-  sigset_t set;
-
-  time_period.it_interval.tv_sec = 0;
-  time_period.it_interval.tv_usec = PERIOD_US_MEMCHECK;
-  time_period.it_value.tv_sec = 0;
-  time_period.it_value.tv_usec = PERIOD_US_MEMCHECK;
 
   memcheck_glb.pid = pid;
-
-  /* Protect from simuntaneous update from signal handler */
-  disable_update = 1;
+  memcheck_glb.phase = MEMCHECK_PHASE_INIT;
+
+  ret = pthread_mutex_init(&memcheck_glb.lock, NULL);
+  if (ret != 0) return -1;
+
+  /* The sampler's timeouts are on the clock now_seconds() reads */
+  ret = pthread_mutex_init(&memcheck_glb.wakeup_lock, NULL);
+  if (ret != 0) return -1;
+  ret = pthread_condattr_init(&cond_attr);
+  if (ret != 0) return -1;
+  ret = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  if (ret != 0) return -1;
+  ret = pthread_cond_init(&memcheck_glb.wakeup, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  if (ret != 0) return -1;
 
   /* Do an update - To early detect any error */
   ret = update_memusage();
   if (ret < 0) return ret;
 
-  disable_update = 0;
-
   memcheck_glb.init_usage = memcheck_glb.max_usage;
 
-  /* Install timer handler */
-  old_sighandler = signal(SIGALRM, timer_handler);
-  if (old_sighandler == SIG_ERR) return -1;
-
-  /* Install timer to periodically update */
-  ret = setitimer(ITIMER_REAL, &time_period, NULL);
-  if (ret < 0) return ret;
-
-  /* Unblock signal */
-  ret = sigemptyset(&set);
-  if (ret < 0) return ret;
-
-  ret = sigaddset(&set, SIGALRM);
-  if (ret < 0) return ret;
-
-  ret = sigprocmask(SIG_UNBLOCK, &set, NULL);
-  if (ret < 0) return ret;
+  /* Start the thread to periodically update */
+  ret = pthread_create(&memcheck_glb.sampler, NULL, sampler_main, NULL);
+  if (ret != 0) return -1;
 
   return 0;
 }
@@ -430,20 +601,14 @@ size_t get_max_miscsize(void) { return memcheck_glb.max_misc_size; }
  * @return 0 on success, < 0 on error
  */
 int deinit_memcheck_parent(void) {
-  sigset_t set;
-
   /* Do an update - Before leaving */
   int ret;
 
-  /* Stop timer interrupt */
-  ret = sigemptyset(&set);
-  if (ret < 0) return ret;
-
-  ret = sigaddset(&set, SIGALRM);
-  if (ret < 0) return ret;
-
-  ret = sigprocmask(SIG_BLOCK, &set, NULL);
-  if (ret < 0) return ret;
+  /* Stop the sampler */
+  memcheck_glb.stop_sampler.store(1);
+  sampler_wakeup();
+  ret = pthread_join(memcheck_glb.sampler, NULL);
+  if (ret != 0) return -1;
 
   ret = update_memusage();
   if (ret < 0) return ret;
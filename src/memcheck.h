@@ -9,6 +9,7 @@
  * @bug No known bugs
  */
 
+#include <stdio.h>
 #include <sys/types.h>
 
 /* Various field's keyword in proc maps */
@@ -17,10 +18,24 @@
 /* This is the annonynomous mappings in the procmap */
 #define PROCMAPS_ANNONY_S ""
 
+/*
+ * Shortest period in useconds between updates, taken when asked for with
+ * memcheck_sample_now(). PERIOD_US_MEMCHECK is the longest
+ */
+#define PERIOD_US_MEMCHECK_MIN (1000)
+
+/* Phases of the child's life usage is reported for */
+#define MEMCHECK_PHASE_INIT 0
+#define MEMCHECK_PHASE_STEADY 1
+#define MEMCHECK_NUM_PHASES 2
+
 /* Threshold over which malloc does mmap */
 #define MMAP_THRESHOLD_MAX (16 * 1024 * 1024)
 
-/* Max characters expected in a line in smaps file and max file size*/
+/* Bytes malloc pads the heap with when growing it (at least a page) */
+#define MALLOC_TOP_PAD 1
+
+/* Max characters expected in a line in maps file and max file size*/
 #define MAX_LINE 300
 #define MAX_FILE 10 * 4096
 
@@ -52,4 +67,7 @@ size_t get_max_stacksize(void);
 size_t get_max_datasize(void);
 size_t get_max_miscsize(void);
 void print_memusage(void);
-size_t get_child_total_mem(size_t child_stack_size);
\ No newline at end of file
+size_t get_child_total_mem(size_t child_stack_size);
+void memcheck_sample_now(void);
+void memcheck_end_init(void);
+void memcheck_report(FILE *log);
\ No newline at end of file
@@ -1,34 +1,589 @@
 #include "myFTL.h"
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
-#include <list>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include "common.h"
 
 namespace {
 
 /*
-Given the following maximum values of the SSD parameters, we can define the
-following data types to optimize for memory usage.
-- Maximum number of packages in the SSD (SSD SIZE) is 4
-- Maximum number of dies per package (PACKAGE SIZE) is 8
-- Maximum number of planes per die (DIE SIZE) is 2
-- Maximum number of blocks per plane (PLANE SIZE) is 10
-- Maximum number of pages per block (BLOCK SIZE) is 64
-- Maximum number of erases per block (BLOCK ERASES) is 64
+The page and block index types are template parameters of MyFTL, and
+CreateMyFTL picks the narrowest unsigned type that can index every page (and
+block) of the configured SSD, keeping one value free as the invalid marker.
+Small devices keep 16 bit maps, larger ones grow to 32 or 64 bits.
+
+The remaining types only depend on per-block limits. They are 16 bits wide,
+and the MyFTL constructor rejects configurations beyond
+- MAX_BLOCK_SIZE pages per block (BLOCK SIZE), so live page counts and
+  greedy GC scores (up to 1.5 times the block size) stay below INVALID_LIST
+- MAX_BLOCK_ERASES erases per block (BLOCK ERASES), so the free and the
+  programmed wear list of every erase count stay below INVALID_LIST
 */
-using pg_size_t = uint16_t;
-using blk_size_t = uint16_t;
-using erase_size_t = uint8_t;
-using pgcnt_size_t = uint8_t;
+using erase_size_t = uint16_t;
+using pgcnt_size_t = uint16_t;
+using list_size_t = uint16_t;
+using ts_size_t = uint32_t;
+
+constexpr list_size_t INVALID_LIST = std::numeric_limits<list_size_t>::max();
+constexpr size_t MAX_BLOCK_SIZE = size_t(1) << 15;
+constexpr size_t MAX_BLOCK_ERASES = (INVALID_LIST - 2) / 2;
+static_assert(MAX_BLOCK_SIZE + 2 * (MAX_BLOCK_SIZE / 4) < INVALID_LIST,
+              "greedy GC scores must fit a list index");
+static_assert(2 * MAX_BLOCK_ERASES + 1 < INVALID_LIST,
+              "wear lists must fit a list index");
+
+// an open log block and the offset of its next free page
+template <typename pg_size_t, typename blk_size_t>
+struct LogFrontier {
+  blk_size_t block;
+  pg_size_t offset;
+};
+
+/*
+ * BlockLists - A fixed number of intrusive doubly linked lists of blocks
+ *
+ * Every block is on at most one list at a time. The links are kept in flat
+ * arrays indexed by block, so pushing and removing a block are O(1) and
+ * never allocate after construction.
+ */
+template <typename blk_size_t>
+class BlockLists {
+ public:
+  static constexpr blk_size_t INVALID_BLOCK =
+      std::numeric_limits<blk_size_t>::max();
+
+  BlockLists(size_t num_blocks, size_t num_lists)
+      : next_(num_blocks, INVALID_BLOCK),
+        prev_(num_blocks, INVALID_BLOCK),
+        list_of_(num_blocks, INVALID_LIST),
+        head_(num_lists, INVALID_BLOCK),
+        tail_(num_lists, INVALID_BLOCK),
+        size_(num_lists, 0) {}
+
+  bool Empty(list_size_t list) const { return head_[list] == INVALID_BLOCK; }
+  size_t Size(list_size_t list) const { return size_[list]; }
+  blk_size_t Front(list_size_t list) const { return head_[list]; }
+  blk_size_t Next(blk_size_t blk) const { return next_[blk]; }
+
+  // list the block is currently on, or INVALID_LIST if it is on none
+  list_size_t ListOf(blk_size_t blk) const { return list_of_[blk]; }
+
+  void PushBack(list_size_t list, blk_size_t blk) {
+    prev_[blk] = tail_[list];
+    next_[blk] = INVALID_BLOCK;
+    if (tail_[list] == INVALID_BLOCK) {
+      head_[list] = blk;
+    } else {
+      next_[tail_[list]] = blk;
+    }
+    tail_[list] = blk;
+    list_of_[blk] = list;
+    ++size_[list];
+  }
+
+  void Remove(blk_size_t blk) {
+    list_size_t list = list_of_[blk];
+    if (prev_[blk] == INVALID_BLOCK) {
+      head_[list] = next_[blk];
+    } else {
+      next_[prev_[blk]] = next_[blk];
+    }
+    if (next_[blk] == INVALID_BLOCK) {
+      tail_[list] = prev_[blk];
+    } else {
+      prev_[next_[blk]] = prev_[blk];
+    }
+    list_of_[blk] = INVALID_LIST;
+    --size_[list];
+  }
+
+  blk_size_t PopFront(list_size_t list) {
+    blk_size_t blk = head_[list];
+    Remove(blk);
+    return blk;
+  }
+
+ private:
+  std::vector<blk_size_t> next_;
+  std::vector<blk_size_t> prev_;
+  std::vector<list_size_t> list_of_;
+  std::vector<blk_size_t> head_;
+  std::vector<blk_size_t> tail_;
+  std::vector<blk_size_t> size_;
+};
+
+template <typename blk_size_t>
+constexpr blk_size_t BlockLists<blk_size_t>::INVALID_BLOCK;
+
+/*
+ * GCPolicy - Chooses which fully programmed block GC cleans next
+ *
+ * MyFTL hands every block to the policy once it is fully programmed, tells it
+ * whenever one of its pages is invalidated, and takes the block back when it
+ * is picked as the victim. The policy reads (but never changes) the FTL's
+ * per-block live page and erase counts.
+ *
+ * When host writes are striped, the FTL also tells which blocks share the
+ * die (or plane) the next host write goes to. Policies then prefer victims
+ * elsewhere, so that cleaning can overlap with that write.
+ */
+template <typename blk_size_t>
+class GCPolicy {
+ public:
+  static constexpr blk_size_t INVALID_BLOCK =
+      BlockLists<blk_size_t>::INVALID_BLOCK;
+
+  GCPolicy(const std::vector<pgcnt_size_t> &livepages,
+           const std::vector<erase_size_t> &erases, size_t block_size,
+           size_t block_erase_count, size_t num_lists)
+      : blocks_(livepages.size(), num_lists),
+        livepages_(livepages),
+        erases_(erases),
+        block_size_(block_size),
+        block_erase_count_(block_erase_count),
+        busy_begin_(0),
+        busy_end_(0) {}
+
+  virtual ~GCPolicy() {}
+
+  // blocks [begin, end) are busy with the next host write
+  void SetBusy(size_t begin, size_t end) {
+    busy_begin_ = begin;
+    busy_end_ = end;
+  }
+
+  // true if the block is a GC candidate (fully programmed, not the victim)
+  bool Indexed(blk_size_t blk) const {
+    return blocks_.ListOf(blk) != INVALID_LIST;
+  }
+
+  // a block has been fully programmed and becomes a GC candidate
+  virtual void IndexBlock(blk_size_t blk) = 0;
+  // a page of an indexed block has been invalidated
+  virtual void PageInvalidated(blk_size_t blk) = 0;
+  // returns the best candidate without removing it, INVALID_BLOCK if none
+  virtual blk_size_t SelectBlockToClean() = 0;
+
+  // the block has been picked as the victim and is no longer a candidate
+  virtual void Remove(blk_size_t blk) { blocks_.Remove(blk); }
+
+ protected:
+  // candidates looked at for one on an idle unit before settling for the
+  // first, which keeps victim selection from scanning a whole list
+  static constexpr size_t IDLE_PROBES = 8;
+
+  // cleaning the block would free some space and it may still be erased
+  bool Cleanable(blk_size_t blk) const {
+    return livepages_[blk] < block_size_ && erases_[blk] < block_erase_count_;
+  }
+
+  bool Idle(blk_size_t blk) const {
+    return blk < busy_begin_ || blk >= busy_end_;
+  }
+
+  // first cleanable block of a list in list order, or the first one on an
+  // idle unit if it is among the next few cleanable ones
+  blk_size_t FirstCleanable(list_size_t list) const {
+    blk_size_t first = INVALID_BLOCK;
+    size_t probes = 0;
+    for (blk_size_t blk = blocks_.Front(list); blk != INVALID_BLOCK;
+         blk = blocks_.Next(blk)) {
+      if (!Cleanable(blk)) {
+        continue;
+      }
+      if (Idle(blk)) {
+        return blk;
+      }
+      if (first == INVALID_BLOCK) {
+        first = blk;
+      }
+      if (++probes == IDLE_PROBES) {
+        break;
+      }
+    }
+    return first;
+  }
+
+  BlockLists<blk_size_t> blocks_;
+  const std::vector<pgcnt_size_t> &livepages_;
+  const std::vector<erase_size_t> &erases_;
+  size_t block_size_;
+  size_t block_erase_count_;
+  size_t busy_begin_;
+  size_t busy_end_;
+};
+
+template <typename blk_size_t>
+constexpr blk_size_t GCPolicy<blk_size_t>::INVALID_BLOCK;
+template <typename blk_size_t>
+constexpr size_t GCPolicy<blk_size_t>::IDLE_PROBES;
+
+// cleans blocks in the order they were filled
+template <typename blk_size_t>
+class FifoPolicy : public GCPolicy<blk_size_t> {
+ public:
+  FifoPolicy(const std::vector<pgcnt_size_t> &livepages,
+             const std::vector<erase_size_t> &erases, size_t block_size,
+             size_t block_erase_count)
+      : GCPolicy<blk_size_t>(livepages, erases, block_size, block_erase_count,
+                             1) {}
+
+  void IndexBlock(blk_size_t blk) { this->blocks_.PushBack(0, blk); }
+  void PageInvalidated(blk_size_t) {}
+  blk_size_t SelectBlockToClean() { return this->FirstCleanable(0); }
+};
+
+// cleans the block whose pages were least recently overwritten
+template <typename blk_size_t>
+class LruPolicy : public GCPolicy<blk_size_t> {
+ public:
+  LruPolicy(const std::vector<pgcnt_size_t> &livepages,
+            const std::vector<erase_size_t> &erases, size_t block_size,
+            size_t block_erase_count)
+      : GCPolicy<blk_size_t>(livepages, erases, block_size, block_erase_count,
+                             1) {}
+
+  void IndexBlock(blk_size_t blk) { this->blocks_.PushBack(0, blk); }
+  void PageInvalidated(blk_size_t blk) {
+    this->blocks_.Remove(blk);
+    this->blocks_.PushBack(0, blk);
+  }
+  blk_size_t SelectBlockToClean() { return this->FirstCleanable(0); }
+};
+
+/*
+ * GreedyPolicy - Cleans the block with the fewest live pages
+ *
+ * Blocks close to their erase limit are penalised so wear stays level. Blocks
+ * are bucketed by this score, so the victim is found in O(1). Within the
+ * best bucket, a block on an idle unit is preferred if one is among the
+ * first few.
+ */
+template <typename blk_size_t>
+class GreedyPolicy : public GCPolicy<blk_size_t> {
+ public:
+  GreedyPolicy(const std::vector<pgcnt_size_t> &livepages,
+               const std::vector<erase_size_t> &erases, size_t block_size,
+               size_t block_erase_count)
+      : GCPolicy<blk_size_t>(livepages, erases, block_size, block_erase_count,
+                             MaxScore(block_size) + 1),
+        max_score_(MaxScore(block_size)),
+        min_score_(0) {}
+
+  // adds a fully programmed block to the bucket matching its score
+  void IndexBlock(blk_size_t blk) {
+    list_size_t score = CalcBlockScore(blk);
+    this->blocks_.PushBack(score, blk);
+    if (score < min_score_) {
+      min_score_ = score;
+    }
+  }
+
+  // keep indexed blocks in the bucket matching their new score
+  void PageInvalidated(blk_size_t blk) {
+    this->blocks_.Remove(blk);
+    IndexBlock(blk);
+  }
+
+  // select block with min score to GC
+  // scores only drop while a block is indexed, so min_score_ is a lower bound
+  // and the scan below is bounded by the number of buckets, not blocks
+  blk_size_t SelectBlockToClean() {
+    while (min_score_ <= max_score_ && this->blocks_.Empty(min_score_)) {
+      ++min_score_;
+    }
+    if (min_score_ > max_score_) {
+      return this->INVALID_BLOCK;
+    }
+    blk_size_t blk = this->blocks_.Front(min_score_);
+    for (size_t probes = 0;
+         probes < this->IDLE_PROBES && blk != this->INVALID_BLOCK;
+         ++probes, blk = this->blocks_.Next(blk)) {
+      if (this->Idle(blk)) {
+        return blk;
+      }
+    }
+    return this->blocks_.Front(min_score_);
+  }
+
+ private:
+  // highest score a block can have
+  static size_t MaxScore(size_t block_size) {
+    return block_size + 2 * (block_size / 4);
+  }
+
+  // We assign each block some score that'll determine whether it should be the
+  // GC candidate. Lower score == more likely to be GC candidate.
+  size_t CalcBlockScore(blk_size_t blk) {
+    // increment score for each live page the block has
+    // this makes blocks with more live pages less desirable and controls the
+    // write amplification
+    size_t score = this->livepages_[blk];
 
-constexpr pg_size_t INVALID_PAGE = std::numeric_limits<pg_size_t>::max();
+    // increment score as a block gets closer to dying to ensure write leveling
+    size_t erases_left = this->block_erase_count_ - this->erases_[blk];
+    if (erases_left < (this->block_erase_count_ / 2)) {
+      score += (this->block_size_ / 4);
+    }
+    if (erases_left < (this->block_erase_count_ / 4)) {
+      score += (this->block_size_ / 4);
+    }
+
+    return score;
+  }
+
+  list_size_t max_score_;
+  // no bucket below this one holds a block
+  list_size_t min_score_;
+};
+
+/*
+ * CostBenefitPolicy - Cleans the block with the best benefit to cost ratio
+ *
+ * The ratio is (1 - u) * age / (1 + u), where u is the fraction of live pages
+ * in the block and age is the time since the block was last modified,
+ * counted in page invalidations. Old, mostly dead blocks are preferred since
+ * their remaining live pages are likely cold.
+ *
+ * Blocks are bucketed by live pages, each bucket in the order its blocks were
+ * last modified. The oldest block of a bucket has the best ratio in it, so
+ * finding the victim only compares the fronts of the buckets, which is
+ * bounded by the pages per block. Blocks on a busy unit are passed over for
+ * a block of the same bucket a little further down.
+ */
+template <typename blk_size_t>
+class CostBenefitPolicy : public GCPolicy<blk_size_t> {
+ public:
+  CostBenefitPolicy(const std::vector<pgcnt_size_t> &livepages,
+                    const std::vector<erase_size_t> &erases, size_t block_size,
+                    size_t block_erase_count)
+      : GCPolicy<blk_size_t>(livepages, erases, block_size, block_erase_count,
+                             block_size + 1),
+        curr_ts_(0),
+        block_ts_map_(this->livepages_.size(), 0) {}
+
+  void IndexBlock(blk_size_t blk) {
+    block_ts_map_[blk] = curr_ts_;
+    this->blocks_.PushBack(this->livepages_[blk], blk);
+  }
+
+  // the block moves to the back of the bucket of its new live page count
+  void PageInvalidated(blk_size_t blk) {
+    block_ts_map_[blk] = ++curr_ts_;
+    this->blocks_.Remove(blk);
+    this->blocks_.PushBack(this->livepages_[blk], blk);
+  }
+
+  blk_size_t SelectBlockToClean() {
+    blk_size_t best = this->INVALID_BLOCK;
+    double best_ratio = -1;
+    bool best_idle = false;
+    // fully live blocks are never cleanable
+    for (list_size_t live = 0; live < this->block_size_; ++live) {
+      blk_size_t blk = this->FirstCleanable(live);
+      if (blk == this->INVALID_BLOCK) {
+        continue;
+      }
+      bool idle = this->Idle(blk);
+      if (best_idle && !idle) {
+        continue;
+      }
+      double ratio = CalcRatio(blk);
+      if (ratio > best_ratio || (idle && !best_idle)) {
+        best = blk;
+        best_ratio = ratio;
+        best_idle = idle;
+      }
+    }
+    return best;
+  }
+
+ private:
+  double CalcRatio(blk_size_t blk) {
+    // unsigned difference stays correct across a timestamp wrap-around
+    double age = ts_size_t(curr_ts_ - block_ts_map_[blk]);
+    double utilization = double(this->livepages_[blk]) / this->block_size_;
+    return (1 - utilization) / (1 + utilization) * age;
+  }
+
+  // incremented on every page invalidation
+  ts_size_t curr_ts_;
+  // when each block was last modified
+  std::vector<ts_size_t> block_ts_map_;
+};
+
+/*
+ * MappingCache - Fixed size cache of lba to page mappings (the CMT of DFTL)
+ *
+ * Entries live in flat arrays sized once at construction, and are found
+ * through an open addressing hash table (linear probing, deletion by
+ * backward shift). Eviction follows the clock algorithm, which approximates
+ * LRU with a single reference bit per entry.
+ */
+template <typename pg_size_t>
+class MappingCache {
+ public:
+  static constexpr size_t NONE = std::numeric_limits<uint32_t>::max();
+  static constexpr pg_size_t EMPTY = std::numeric_limits<pg_size_t>::max();
+
+  // RAM taken per cached mapping, including its share of the hash table
+  static constexpr size_t ENTRY_BYTES =
+      2 * sizeof(pg_size_t) + sizeof(uint8_t) + 2 * sizeof(uint32_t);
+
+  explicit MappingCache(size_t capacity)
+      : lba_(capacity, EMPTY),
+        page_(capacity, EMPTY),
+        flags_(capacity, 0),
+        buckets_(),
+        hand_(0) {
+    size_t num_buckets = 1;
+    while (num_buckets < 2 * capacity) {
+      num_buckets *= 2;
+    }
+    buckets_.assign(num_buckets, 0);
+  }
+
+  size_t Capacity() const { return lba_.size(); }
+
+  // slot caching the mapping of lba, or NONE
+  size_t Find(pg_size_t lba) const {
+    for (size_t b = Bucket(lba); buckets_[b] != 0; b = NextBucket(b)) {
+      if (lba_[buckets_[b] - 1] == lba) {
+        return buckets_[b] - 1;
+      }
+    }
+    return NONE;
+  }
+
+  // Advances the clock hand to the next slot to reuse: an empty one, or the
+  // first one not referenced since the hand last passed
+  size_t Victim() {
+    for (;;) {
+      size_t slot = hand_;
+      hand_ = (hand_ + 1) % lba_.size();
+      if (lba_[slot] == EMPTY || !(flags_[slot] & REFERENCED)) {
+        return slot;
+      }
+      flags_[slot] &= ~REFERENCED;
+    }
+  }
+
+  // caches a clean mapping in an empty slot
+  void Fill(size_t slot, pg_size_t lba, pg_size_t page) {
+    size_t b = Bucket(lba);
+    while (buckets_[b] != 0) {
+      b = NextBucket(b);
+    }
+    buckets_[b] = slot + 1;
+    lba_[slot] = lba;
+    page_[slot] = page;
+    flags_[slot] = 0;
+  }
+
+  // drops the mapping cached in a slot
+  void Erase(size_t slot) {
+    size_t b = Bucket(lba_[slot]);
+    while (buckets_[b] != slot + 1) {
+      b = NextBucket(b);
+    }
+    // shift later entries of the probe sequence back into the hole
+    for (size_t next = NextBucket(b); buckets_[next] != 0;
+         next = NextBucket(next)) {
+      size_t home = Bucket(lba_[buckets_[next] - 1]);
+      if (((next - home) & (buckets_.size() - 1)) >=
+          ((next - b) & (buckets_.size() - 1))) {
+        buckets_[b] = buckets_[next];
+        b = next;
+      }
+    }
+    buckets_[b] = 0;
+    lba_[slot] = EMPTY;
+  }
+
+  bool Empty(size_t slot) const { return lba_[slot] == EMPTY; }
+  pg_size_t Lba(size_t slot) const { return lba_[slot]; }
+  pg_size_t Page(size_t slot) const { return page_[slot]; }
+  bool Dirty(size_t slot) const { return flags_[slot] & DIRTY; }
+
+  void Touch(size_t slot) { flags_[slot] |= REFERENCED; }
+  void SetPage(size_t slot, pg_size_t page) {
+    page_[slot] = page;
+    flags_[slot] |= DIRTY;
+  }
+  void Clean(size_t slot) { flags_[slot] &= ~DIRTY; }
+
+ private:
+  static constexpr uint8_t REFERENCED = 1;
+  static constexpr uint8_t DIRTY = 2;
+
+  size_t Bucket(pg_size_t lba) const {
+    return (uint64_t(lba) * 0x9E3779B97F4A7C15ull) & (buckets_.size() - 1);
+  }
+  size_t NextBucket(size_t b) const { return (b + 1) & (buckets_.size() - 1); }
+
+  std::vector<pg_size_t> lba_;
+  std::vector<pg_size_t> page_;
+  std::vector<uint8_t> flags_;
+  // slot + 1 of the mapping hashed here, 0 if none
+  std::vector<uint32_t> buckets_;
+  size_t hand_;
+};
+
+template <typename pg_size_t>
+constexpr size_t MappingCache<pg_size_t>::NONE;
+template <typename pg_size_t>
+constexpr pg_size_t MappingCache<pg_size_t>::EMPTY;
+template <typename pg_size_t>
+constexpr uint8_t MappingCache<pg_size_t>::REFERENCED;
+template <typename pg_size_t>
+constexpr uint8_t MappingCache<pg_size_t>::DIRTY;
+
+template <typename blk_size_t>
+std::unique_ptr<GCPolicy<blk_size_t>> SelectGCPolicy(
+    size_t policy_idx, const std::vector<pgcnt_size_t> &livepages,
+    const std::vector<erase_size_t> &erases, size_t block_size,
+    size_t block_erase_count) {
+  switch (policy_idx) {
+    case GC_POLICY_FIFO:
+      return std::unique_ptr<GCPolicy<blk_size_t>>(new FifoPolicy<blk_size_t>(
+          livepages, erases, block_size, block_erase_count));
+    case GC_POLICY_LRU:
+      return std::unique_ptr<GCPolicy<blk_size_t>>(new LruPolicy<blk_size_t>(
+          livepages, erases, block_size, block_erase_count));
+    case GC_POLICY_GREEDY:
+      return std::unique_ptr<GCPolicy<blk_size_t>>(new GreedyPolicy<blk_size_t>(
+          livepages, erases, block_size, block_erase_count));
+    case GC_POLICY_COST_BENEFIT:
+      return std::unique_ptr<GCPolicy<blk_size_t>>(
+          new CostBenefitPolicy<blk_size_t>(livepages, erases, block_size,
+                                            block_erase_count));
+    default:
+      throw std::runtime_error{"invalid GC policy_idx"};
+  }
+}
 
 }  // namespace
 
-template <typename PageType>
+template <typename PageType, typename PageIdxType, typename BlockIdxType>
 class MyFTL : public FTLBase<PageType> {
+  using pg_size_t = PageIdxType;
+  using blk_size_t = BlockIdxType;
+  using LogFrontier = ::LogFrontier<pg_size_t, blk_size_t>;
+  using BlockLists = ::BlockLists<blk_size_t>;
+  using GCPolicy = ::GCPolicy<blk_size_t>;
+  using MappingCache = ::MappingCache<pg_size_t>;
+  using ExtentMap = ::ExtentMap<pg_size_t>;
+
  public:
+  static constexpr pg_size_t INVALID_PAGE =
+      std::numeric_limits<pg_size_t>::max();
+  static constexpr blk_size_t INVALID_BLOCK = BlockLists::INVALID_BLOCK;
+
   /*
    * Constructor
    */
@@ -39,21 +594,66 @@ class MyFTL : public FTLBase<PageType> {
         plane_size_(conf->GetPlaneSize()),
         block_size_(conf->GetBlockSize()),
         block_erase_count_(conf->GetBlockEraseCount()),
+        codec_(conf),
         largest_lba_(0),
         lba_page_map_(),
         page_lba_map_(),
         block_erase_map_(),
-        free_log_blocks_(),
-        used_log_blocks_(),
-        log_block_(0),
-        log_page_offset_(0) {
+        unit_blocks_(0),
+        num_units_(1),
+        unit_div_(),
+        wear_lists_(0, 0),
+        unit_free_(0, 0),
+        num_free_(0),
+        gc_policy_(),
+        host_logs_(),
+        next_log_(0),
+        gc_log_(),
+        gc_low_watermark_(conf->GetGCLowWatermark()),
+        gc_high_watermark_(conf->GetGCHighWatermark()),
+        gc_max_pages_(conf->GetGCMaxPagesPerWrite()),
+        gc_running_(false),
+        gc_victim_(INVALID_BLOCK),
+        gc_victim_livepages_(0),
+        gc_cursor_(0),
+        last_write_time_(0),
+        write_gap_(0),
+        mean_write_gap_(0),
+        wl_threshold_(conf->GetWearLevelingThreshold()),
+        min_erases_(0),
+        max_erases_(0),
+        wl_pending_(false),
+        gc_threshold_(GC_THRESHOLD),
+        tpage_entries_(conf->GetTranslationPageEntries()),
+        cmt_(),
+        gtd_(),
+        tpage_buf_(),
+        trans_log_(),
+        last_lba_(INVALID_PAGE) {
     /* Overprovioned blocks as a percentage of total number of blocks */
     size_t op = conf->GetOverprovisioning();
 
     printf("SSD Configuration: %zu, %zu, %zu, %zu, %zu\n", ssd_size_,
            package_size_, die_size_, plane_size_, block_size_);
-    printf("Max Erase Count: %zu, Overprovisioning: %zu%%\n",
-           block_erase_count_, op);
+    printf("Max Erase Count: %zu, Overprovisioning: %zu%%, GC: %zu\n",
+           block_erase_count_, op, conf->GetGCPolicy());
+
+    // incremental GC is off unless a low watermark is configured. Blocks it
+    // keeps free are spare space lost to GC, which raises write
+    // amplification, so by default it only tops the pool up by one block
+    if (gc_high_watermark_ <= gc_low_watermark_) {
+      gc_high_watermark_ = gc_low_watermark_ + 1;
+    }
+    if (gc_max_pages_ == 0) {
+      gc_max_pages_ = block_size_;
+    }
+    if (gc_low_watermark_ > 0) {
+      printf("Incremental GC: watermarks %zu-%zu, max %zu pages/write\n",
+             gc_low_watermark_, gc_high_watermark_, gc_max_pages_);
+    }
+    if (wl_threshold_ == 0) {
+      wl_threshold_ = std::max<size_t>(2, block_erase_count_ / 10);
+    }
 
     size_t num_blocks = ssd_size_ * package_size_ * die_size_ * plane_size_;
     size_t num_op_blocks =
@@ -62,20 +662,43 @@ class MyFTL : public FTLBase<PageType> {
 
     // initialize data structures and variables based on config
     largest_lba_ = (num_blocks - num_op_blocks) * block_size_ - 1;
-    lba_page_map_.assign(largest_lba_ + 1, INVALID_PAGE);
-    page_lba_map_.assign(num_pages, INVALID_PAGE);
     block_erase_map_.assign(num_blocks, 0);
+    if (block_size_ > MAX_BLOCK_SIZE) {
+      throw std::runtime_error{"too many pages per block"};
+    }
+    if (block_erase_count_ > MAX_BLOCK_ERASES) {
+      throw std::runtime_error{"too many erases per block"};
+    }
+    wear_lists_ =
+        BlockLists(num_blocks, WearList(block_erase_count_, false) + 1);
 
+    InitStriping(conf->GetAllocationStriping(), num_blocks, num_op_blocks);
     for (blk_size_t i = 0; i < num_blocks; ++i) {
-      free_log_blocks_.push_back(i);
+      PushFreeBlock(i);
     }
-    used_log_blocks_.clear();
 
     block_livepages_map_.assign(num_blocks, 0);
 
-    log_block_ = free_log_blocks_.front();
-    free_log_blocks_.pop_front();
-    log_page_offset_ = 0;
+    // the policy indexes used blocks, sized after the per-block maps
+    gc_policy_ =
+        SelectGCPolicy<blk_size_t>(conf->GetGCPolicy(), block_livepages_map_,
+                                   block_erase_map_, block_size_,
+                                   block_erase_count_);
+
+    size_t cache_size = conf->GetMappingCacheSize();
+    if (cache_size == 0) {
+      // the whole mapping stays in RAM
+      lba_page_map_ = ExtentMap(largest_lba_ + 1);
+      page_lba_map_ = ExtentMap(num_pages);
+    } else {
+      InitDemandMapping(cache_size);
+    }
+
+    // logs are opened on their first write
+    gc_log_.block = INVALID_BLOCK;
+    gc_log_.offset = block_size_;
+    trans_log_.block = INVALID_BLOCK;
+    trans_log_.offset = block_size_;
   }
 
   /*
@@ -95,13 +718,67 @@ class MyFTL : public FTLBase<PageType> {
    */
   std::pair<ExecState, Address> ReadTranslate(
       size_t lba, const ExecCallBack<PageType> &func) {
-    (void)func;
+    // translation page traffic reaches the controller in batches
+    CommandBatch<PageType> batch(func);
+    std::pair<ExecState, Address> ret = TranslateRead(lba, batch);
+    batch.Flush();
+    return ret;
+  }
+
+  /*
+   * WriteTranslate() - Translates write address
+   *
+   * Please refer to ReadTranslate()
+   */
+  std::pair<ExecState, Address> WriteTranslate(
+      size_t lba, const ExecCallBack<PageType> &func) {
+    // cleaning issues a burst of operations, which are batched too
+    CommandBatch<PageType> batch(func);
+    std::pair<ExecState, Address> ret = TranslateWrite(lba, batch);
+    batch.Flush();
+    return ret;
+  }
 
+  /*
+   * Optionally mark a LBA as a garbage.
+   */
+  ExecState Trim(size_t lba, const ExecCallBack<PageType> &func) {
+    CommandBatch<PageType> batch(func);
+    ExecState ret = TrimLba(lba, batch);
+    batch.Flush();
+    return ret;
+  }
+
+ private:
+  // if the number of free log blocks fall below this level, we'll do
+  // some GC synchronously (urgent mode)
+  // one free block is held back so the GC log can always be reopened
+  // (and one more for the translation log when mappings are demand paged)
+  static constexpr size_t GC_THRESHOLD = 2;
+
+  // translation pages hold this many mappings unless configured otherwise
+  static constexpr size_t DEFAULT_TPAGE_ENTRIES = 512;
+  // mappings cached ahead of a sequential access
+  static constexpr size_t PREFETCH_ENTRIES = 16;
+
+  // host writes the write rate is averaged over, and how far it may scale
+  // the GC budget either way
+  static constexpr double WRITE_RATE_WINDOW = 16;
+  static constexpr double MAX_RATE_SCALE = 2;
+
+  // unit a log may take its block from when it isn't striped
+  static constexpr size_t ANY_UNIT = std::numeric_limits<size_t>::max();
+  // open host logs may take up to 1 / STRIPE_OP_SHARE of the spare blocks
+  static constexpr size_t STRIPE_OP_SHARE = 4;
+
+  // The public entry points run these with their commands batched
+  std::pair<ExecState, Address> TranslateRead(
+      size_t lba, const ExecCallBack<PageType> &func) {
     if (!IsValidLba(lba)) {
       return std::make_pair(ExecState::FAILURE, Address(0, 0, 0, 0, 0));
     }
 
-    pg_size_t page_idx = lba_page_map_[lba];
+    pg_size_t page_idx = LookupMapping(lba, func);
     if (page_idx == INVALID_PAGE) {
       return std::make_pair(ExecState::FAILURE, Address(0, 0, 0, 0, 0));
     }
@@ -109,179 +786,649 @@ class MyFTL : public FTLBase<PageType> {
     return std::make_pair(ExecState::SUCCESS, GetAddrFromPageIdx(page_idx));
   }
 
-  /*
-   * WriteTranslate() - Translates write address
-   *
-   * Please refer to ReadTranslate()
-   */
-  std::pair<ExecState, Address> WriteTranslate(
+  std::pair<ExecState, Address> TranslateWrite(
       size_t lba, const ExecCallBack<PageType> &func) {
-    (void)func;
-
     if (!IsValidLba(lba)) {
       return std::make_pair(ExecState::FAILURE, Address(0, 0, 0, 0, 0));
     }
 
-    if (log_page_offset_ >= block_size_) {
-      // current log block is full
-      if (free_log_blocks_.empty()) {
+    // host writes take turns on the logs they are striped over
+    LogFrontier &host_log = host_logs_[next_log_];
+    if (host_log.offset >= block_size_) {
+      // current host log block is full
+      if (!OpenLogBlock(host_log, NextUnit(host_log))) {
         return std::make_pair(ExecState::FAILURE, Address(0, 0, 0, 0, 0));
       }
+    }
+    if (num_units_ > 1) {
+      size_t unit = unit_div_.Div(host_log.block);
+      gc_policy_->SetBusy(unit * unit_blocks_, (unit + 1) * unit_blocks_);
+    }
+
+    TrackWriteRate(func.Now());
 
-      // allocate new log block
-      used_log_blocks_.push_back(log_block_);
-      log_block_ = free_log_blocks_.front();
-      free_log_blocks_.pop_front();
-      log_page_offset_ = 0;
+    // urgent: clean synchronously if we are running out of free blocks
+    while (num_free_ < gc_threshold_ && Clean(func, true)) {
+    }
 
-      // do some cleaning if we are running out of free blocks
-      if (free_log_blocks_.size() < GC_THRESHOLD) {
-        Clean(func);
+    // otherwise piggyback a bounded amount of cleaning on this write
+    if (gc_low_watermark_ > 0) {
+      if (num_free_ < gc_low_watermark_) {
+        gc_running_ = true;
+      }
+      if (gc_running_) {
+        bool progress = Clean(func, false);
+        if (!progress || (gc_victim_ == INVALID_BLOCK &&
+                          num_free_ >= gc_high_watermark_)) {
+          gc_running_ = false;
+        }
       }
-      return WriteTranslate(lba, func);
     }
 
-    pg_size_t page_idx = LogLba(lba);
+    // relocate cold data once wear has drifted apart
+    if (wl_pending_) {
+      wl_pending_ = false;
+      LevelWear(func);
+    }
+
+    pg_size_t page_idx = LogLba(lba, host_log, func);
+    if (page_idx == INVALID_PAGE) {
+      return std::make_pair(ExecState::FAILURE, Address(0, 0, 0, 0, 0));
+    }
+    next_log_ = (next_log_ + 1) % host_logs_.size();
     return std::make_pair(ExecState::SUCCESS, GetAddrFromPageIdx(page_idx));
   }
 
-  /*
-   * Optionally mark a LBA as a garbage.
-   */
-  ExecState Trim(size_t lba, const ExecCallBack<PageType> &func) {
-    (void)func;
-
+  ExecState TrimLba(size_t lba, const ExecCallBack<PageType> &func) {
     if (!IsValidLba(lba)) {
       return ExecState::FAILURE;
     }
 
-    pg_size_t page_idx = lba_page_map_[lba];
+    pg_size_t page_idx;
+    if (!GetMapping(lba, func, &page_idx)) {
+      return ExecState::FAILURE;
+    }
     if (page_idx == INVALID_PAGE) {
       return ExecState::SUCCESS;
     }
 
     UpdatePageLba(page_idx, INVALID_PAGE);
-    lba_page_map_[lba] = INVALID_PAGE;
+    SetMapping(lba, INVALID_PAGE, func);
 
     return ExecState::SUCCESS;
   }
 
- private:
-  // if the number of free log blocks fall below this level, we'll do
-  // some GC
-  static constexpr size_t GC_THRESHOLD = 1;
-
-  void Clean(const ExecCallBack<PageType> &func) {
-    blk_size_t blk = SelectBlockToClean();
-
-    if (block_erase_map_[blk] >= block_erase_count_) {
-      // erase limit reached
-      return;
+  // Cleans the current victim, picking a new one if none is in progress.
+  // Urgent cleaning finishes the victim, otherwise at most GCBudget() live
+  // pages are migrated and the victim is resumed on a later write.
+  // Returns false if no progress could be made
+  bool Clean(const ExecCallBack<PageType> &func, bool urgent) {
+    if (gc_victim_ == INVALID_BLOCK && !SelectVictim()) {
+      return false;
     }
 
-    // migrate live pages
-    // invariant: there's enough slots in log page to hold all the live pages
-    for (pg_size_t page = blk * block_size_; page < ((blk + 1) * block_size_);
-         ++page) {
-      pg_size_t lba = page_lba_map_[page];
+    // migrate live pages to the GC log, away from the hot host writes
+    // invariant: the GC log needs to be reopened at most once per victim
+    size_t budget = urgent ? block_size_ : GCBudget();
+    size_t moved = 0;
+    for (; gc_cursor_ < block_size_ && block_livepages_map_[gc_victim_] > 0;
+         ++gc_cursor_) {
+      pg_size_t page = gc_victim_ * block_size_ + gc_cursor_;
+      pg_size_t lba;
+      if (!GetPageLba(page, func, &lba)) {
+        return moved > 0;
+      }
       if (lba == INVALID_PAGE) {
         continue;
       }
 
       // this is a live page
-      func(OpCode::READ, GetAddrFromPageIdx(page));
-      pg_size_t new_page = LogLba(lba);
-      func(OpCode::WRITE, GetAddrFromPageIdx(new_page));
+      if (moved == budget) {
+        return true;
+      }
+      if (!MovePage(page, lba, gc_log_, func)) {
+        return moved > 0;
+      }
+      ++moved;
     }
 
+    EraseBlock(gc_victim_, func);
+    gc_victim_ = INVALID_BLOCK;
+    return true;
+  }
+
+  // erases a block whose live pages have all been migrated and frees it
+  void EraseBlock(blk_size_t blk, const ExecCallBack<PageType> &func) {
     func(OpCode::ERASE, GetAddrFromBlockIdx(blk));
-    ++block_erase_map_[blk];
 
-    used_log_blocks_.remove(blk);
-    free_log_blocks_.push_back(blk);
+    wear_lists_.Remove(blk);
+    erase_size_t erases = ++block_erase_map_[blk];
+    if (erases > max_erases_) {
+      max_erases_ = erases;
+    }
+    wl_pending_ = true;
+
+    PushFreeBlock(blk);
   }
 
-  blk_size_t SelectBlockToClean() {
-    // select block with min score to GC
-    blk_size_t blk_min_score = std::numeric_limits<blk_size_t>::max();
-    size_t min_score = std::numeric_limits<size_t>::max();
-    for (const auto &blk : used_log_blocks_) {
-      size_t score = CalcBlockScore(blk);
-      if (score < min_score) {
-        blk_min_score = blk;
-        min_score = score;
+  // takes the next victim out of the index, returns false if there is no
+  // block worth (or able to be) cleaned
+  bool SelectVictim() {
+    blk_size_t blk = gc_policy_->SelectBlockToClean();
+
+    if (blk == INVALID_BLOCK || block_erase_map_[blk] >= block_erase_count_) {
+      // nothing to clean, or erase limit reached
+      return false;
+    }
+
+    size_t livepages = block_livepages_map_[blk];
+    if (livepages == block_size_) {
+      // cleaning a fully live block frees nothing
+      return false;
+    }
+    if (livepages > block_size_ - gc_log_.offset && num_free_ == 0) {
+      // no room to migrate the live pages to
+      return false;
+    }
+    gc_policy_->Remove(blk);
+
+    gc_victim_ = blk;
+    gc_victim_livepages_ = livepages;
+    gc_cursor_ = 0;
+    return true;
+  }
+
+  // Live pages to migrate per host write. Cleaning a victim with L live pages
+  // yields (block size - L) pages for host writes, so migrating
+  // L / (block size - L) pages per write keeps the free pool steady. This
+  // rate is scaled up as the pool drains from the high watermark towards the
+  // hard floor, so the work stays spread out instead of piling up there.
+  // It is also scaled by the simulated time since the previous host write
+  // over its recent average, so the work is spread over time rather than
+  // over writes: a write after a pause takes on more of it, and a burst of
+  // writes less.
+  size_t GCBudget() {
+    size_t headroom = num_free_ > gc_threshold_ ? num_free_ - gc_threshold_ : 1;
+    size_t span = gc_high_watermark_ > gc_threshold_
+                      ? gc_high_watermark_ - gc_threshold_
+                      : 1;
+
+    double work = double(gc_victim_livepages_) * span;
+    double pace = double(block_size_ - gc_victim_livepages_) * headroom;
+    if (mean_write_gap_ > 0) {
+      double scale = write_gap_ / mean_write_gap_;
+      work *= std::min(MAX_RATE_SCALE, std::max(1 / MAX_RATE_SCALE, scale));
+    }
+    size_t budget = size_t(std::ceil(work / pace));
+
+    if (budget < 1) {
+      budget = 1;
+    }
+    if (budget > gc_max_pages_) {
+      budget = gc_max_pages_;
+    }
+    return budget;
+  }
+
+  // Keeps the simulated time since the previous host write, and its moving
+  // average over about WRITE_RATE_WINDOW writes. Without a clock (now is
+  // always 0) the average stays 0 and the budget is paced per write only
+  void TrackWriteRate(uint64_t now) {
+    write_gap_ = double(now - last_write_time_);
+    last_write_time_ = now;
+    if (mean_write_gap_ == 0) {
+      mean_write_gap_ = write_gap_;
+    } else {
+      mean_write_gap_ += (write_gap_ - mean_write_gap_) / WRITE_RATE_WINDOW;
+    }
+  }
+
+  // Static wear leveling: blocks holding cold data are never picked by GC,
+  // so their erases go unused while the hot blocks wear out. Once a free
+  // block is more than the threshold ahead of the least worn used block, the
+  // data of the latter is moved into it. The worn block then holds data that
+  // is rarely rewritten, and the young block rejoins the free pool to absorb
+  // hot writes.
+  void LevelWear(const ExecCallBack<PageType> &func) {
+    while (wear_lists_.Empty(WearList(min_erases_, true)) &&
+           wear_lists_.Empty(WearList(min_erases_, false))) {
+      ++min_erases_;
+    }
+    // the worn block is taken from the pool only until the cold one is erased
+    if (size_t(max_erases_ - min_erases_) <= wl_threshold_ ||
+        num_free_ == 0) {
+      return;
+    }
+
+    blk_size_t worn = PickFreeBlock(ANY_UNIT, true);
+    if (size_t(block_erase_map_[worn] - min_erases_) <= wl_threshold_) {
+      return;
+    }
+
+    // the least worn block may be free or open, so look at used ones only.
+    // Programmed blocks are used but for the few open logs and the victim
+    blk_size_t cold = INVALID_BLOCK;
+    for (size_t erases = min_erases_;
+         cold == INVALID_BLOCK &&
+         erases + wl_threshold_ < block_erase_map_[worn];
+         ++erases) {
+      for (blk_size_t blk = wear_lists_.Front(WearList(erases, false));
+           blk != INVALID_BLOCK; blk = wear_lists_.Next(blk)) {
+        if (gc_policy_->Indexed(blk)) {
+          cold = blk;
+          break;
+        }
+      }
+    }
+    if (cold == INVALID_BLOCK) {
+      return;
+    }
+    gc_policy_->Remove(cold);
+    TakeFreeBlock(worn);
+
+    // pages left unwritten at the end of the worn block (as many as the cold
+    // block had dead pages) are reclaimed when it gets cleaned
+    LogFrontier log = {worn, 0};
+    for (pg_size_t page = cold * block_size_; page < (cold + 1) * block_size_;
+         ++page) {
+      pg_size_t lba;
+      if (!GetPageLba(page, func, &lba) ||
+          (lba != INVALID_PAGE && !MovePage(page, lba, log, func))) {
+        // out of space for translation pages, try again after the next erase
+        RetireBlock(worn);
+        gc_policy_->IndexBlock(cold);
+        return;
       }
     }
-    return blk_min_score;
+    RetireBlock(worn);
+    EraseBlock(cold, func);
   }
 
-  // We assign each block some score that'll determine whether it should be the
-  // GC candidate. Lower score == more likely to be GC candidate.
-  size_t CalcBlockScore(blk_size_t blk) {
-    // increment score for each live page the block has
-    // this makes blocks with more live pages less desirable and controls the
-    // write amplification
-    size_t score = block_livepages_map_[blk];
+  // Copies a live page (lba is what GetPageLba() returned for it) to a log.
+  // Translation pages always go to the translation log.
+  bool MovePage(pg_size_t page, pg_size_t lba, LogFrontier &log,
+                const ExecCallBack<PageType> &func) {
+    if (lba > largest_lba_) {
+      return WriteTranslationPage(lba - largest_lba_ - 1, func);
+    }
+    if (log.offset >= block_size_ && !OpenLogBlock(log, ANY_UNIT)) {
+      return false;
+    }
+    // the mapping of lba is cached by GetPageLba(), so this can't fail
+    func(OpCode::READ, GetAddrFromPageIdx(page));
+    pg_size_t new_page = LogLba(lba, log, func);
+    func(OpCode::WRITE, GetAddrFromPageIdx(new_page));
+    return true;
+  }
 
-    // increment score as a block gets closer to dying to ensure write leveling
-    size_t erases_left = block_erase_count_ - block_erase_map_[blk];
-    if (erases_left < (block_erase_count_ / 2)) {
-      score += (block_size_ / 4);
+  // retires the full block of a log (if any) and opens a fresh one from the
+  // free pool, preferably on the given unit, returns false if the pool is
+  // empty
+  bool OpenLogBlock(LogFrontier &log, size_t unit) {
+    if (num_free_ == 0) {
+      return false;
     }
-    if (erases_left < (block_erase_count_ / 4)) {
-      score += (block_size_ / 4);
+    if (log.block != INVALID_BLOCK) {
+      RetireBlock(log.block);
     }
 
-    return score;
+    // hot host data goes to the least worn free block, data surviving GC is
+    // cold and goes to the most worn one
+    blk_size_t blk = PickFreeBlock(unit, &log == &gc_log_);
+    TakeFreeBlock(blk);
+
+    log.block = blk;
+    log.offset = 0;
+    return true;
   }
 
-  // helper function to write an LBA to the current log, and returns page index
-  // of the page written to
-  pg_size_t LogLba(pg_size_t lba) {
+  // Least (or most) worn free block of a unit, or of any unit if that one
+  // has no free block left (or unit is ANY_UNIT). The pool must not be empty.
+  // The free blocks of a unit are scanned, which is bounded by the blocks
+  // per unit, the whole pool is looked up by erase count
+  blk_size_t PickFreeBlock(size_t unit, bool most_worn) {
+    if (num_units_ > 1 && unit != ANY_UNIT && !unit_free_.Empty(unit)) {
+      erase_size_t target = most_worn ? max_erases_ : min_erases_;
+      blk_size_t best = INVALID_BLOCK;
+      for (blk_size_t blk = unit_free_.Front(unit); blk != INVALID_BLOCK;
+           blk = unit_free_.Next(blk)) {
+        if (best == INVALID_BLOCK ||
+            (most_worn ? block_erase_map_[blk] > block_erase_map_[best]
+                       : block_erase_map_[blk] < block_erase_map_[best])) {
+          best = blk;
+        }
+        if (block_erase_map_[best] == target) {
+          break;
+        }
+      }
+      return best;
+    }
+
+    // min_erases_ and max_erases_ bound the erase counts of free blocks
+    size_t erases = most_worn ? max_erases_ : min_erases_;
+    while (wear_lists_.Empty(WearList(erases, true))) {
+      erases = most_worn ? erases - 1 : erases + 1;
+    }
+    return wear_lists_.Front(WearList(erases, true));
+  }
+
+  // Sets up the units host writes are striped over, see AllocationStriping.
+  // An open host log holds back up to a block of free pages GC can't
+  // reclaim, so there are only as many logs as a share of the spare blocks
+  // allows, each taking its blocks from every so many units in turn.
+  void InitStriping(size_t striping, size_t num_blocks, size_t num_op_blocks) {
+    switch (striping) {
+      case STRIPE_NONE:
+        unit_blocks_ = num_blocks;
+        break;
+      case STRIPE_DIE:
+        unit_blocks_ = die_size_ * plane_size_;
+        break;
+      case STRIPE_PLANE:
+        unit_blocks_ = plane_size_;
+        break;
+      default:
+        throw std::runtime_error{"invalid allocation striping"};
+    }
+    num_units_ = num_blocks / unit_blocks_;
+    if (num_units_ >= INVALID_LIST) {
+      throw std::runtime_error{"too many allocation units"};
+    }
+    size_t num_logs = std::max<size_t>(
+        1, std::min(num_units_, num_op_blocks / STRIPE_OP_SHARE));
+
+    unit_div_ = AddressDivider(unit_blocks_);
+    if (num_units_ > 1) {
+      unit_free_ = BlockLists(num_blocks, num_units_);
+    }
+    host_logs_.assign(num_logs,
+                      LogFrontier{INVALID_BLOCK, pg_size_t(block_size_)});
+
+    if (num_units_ > 1) {
+      printf("Allocation: host writes striped over %zu %s, %zu open\n",
+             num_units_, striping == STRIPE_DIE ? "dies" : "planes",
+             num_logs);
+    }
+  }
+
+  // unit the next block of a host log comes from
+  size_t NextUnit(const LogFrontier &log) {
+    if (log.block == INVALID_BLOCK) {
+      return &log - &host_logs_[0];
+    }
+    return (unit_div_.Div(log.block) + host_logs_.size()) % num_units_;
+  }
+
+  // list of wear_lists_ holding the free (or programmed) blocks erased so
+  // many times
+  static list_size_t WearList(size_t erases, bool free) {
+    return 2 * erases + (free ? 0 : 1);
+  }
+
+  // blocks move to the programmed list of their erase count once taken from
+  // the pool, and back to a free list once erased
+  void PushFreeBlock(blk_size_t blk) {
+    wear_lists_.PushBack(WearList(block_erase_map_[blk], true), blk);
+    if (num_units_ > 1) {
+      unit_free_.PushBack(unit_div_.Div(blk), blk);
+    }
+    ++num_free_;
+  }
+  void TakeFreeBlock(blk_size_t blk) {
+    wear_lists_.Remove(blk);
+    wear_lists_.PushBack(WearList(block_erase_map_[blk], false), blk);
+    if (num_units_ > 1) {
+      unit_free_.Remove(blk);
+    }
+    --num_free_;
+  }
+
+  // hands a block that is done being programmed to the GC policy, unless it
+  // is out of erases, in which case it keeps its data for good
+  void RetireBlock(blk_size_t blk) {
+    if (block_erase_map_[blk] < block_erase_count_) {
+      gc_policy_->IndexBlock(blk);
+    }
+  }
+
+  // helper function to write an LBA to the given log, and returns page index
+  // of the page written to (INVALID_PAGE if its mapping can't be cached)
+  pg_size_t LogLba(pg_size_t lba, LogFrontier &log,
+                   const ExecCallBack<PageType> &func) {
     // invalidate the previous page of this lba
-    pg_size_t prev_page_idx = lba_page_map_[lba];
+    pg_size_t prev_page_idx;
+    if (!GetMapping(lba, func, &prev_page_idx)) {
+      return INVALID_PAGE;
+    }
     if (prev_page_idx != INVALID_PAGE) {
       UpdatePageLba(prev_page_idx, INVALID_PAGE);
     }
-    // write to next free page in current log block
-    pg_size_t page_idx = log_block_ * block_size_ + log_page_offset_++;
+    // write to next free page in the log block
+    pg_size_t page_idx = log.block * block_size_ + log.offset++;
     UpdatePageLba(page_idx, lba);
-    lba_page_map_[lba] = page_idx;
+    SetMapping(lba, page_idx, func);
     return page_idx;
   }
 
+  // lba is INVALID_PAGE when the page is invalidated, otherwise it is the
+  // lba (or translation page tag) being programmed into the page
   void UpdatePageLba(pg_size_t page_idx, pg_size_t lba) {
+    blk_size_t blk = codec_.BlockOfPage(page_idx);
     if (lba == INVALID_PAGE) {
-      --block_livepages_map_[page_idx / block_size_];
+      --block_livepages_map_[blk];
     } else {
-      ++block_livepages_map_[page_idx / block_size_];
+      ++block_livepages_map_[blk];
+    }
+    if (!cmt_) {
+      // (when demand paged, the spare area of the page tells its lba)
+      page_lba_map_.Set(page_idx, lba);
+    }
+
+    if (lba == INVALID_PAGE && gc_policy_->Indexed(blk)) {
+      gc_policy_->PageInvalidated(blk);
+    }
+  }
+
+  /*
+   * Demand paged mapping (DFTL)
+   *
+   * The lba to page mapping is split into translation pages of
+   * tpage_entries_ mappings each, stored on flash like data pages. The
+   * global translation directory (gtd_) tells where each translation page
+   * is, and a bounded cache of mappings (cmt_) is all lookups go through.
+   * Translation pages live on the simulated flash (see
+   * ExecCallBack::ProgramMetadata()), so only the CMT and GTD take RAM. A
+   * translation page is tagged in its spare area with largest_lba_ + 1 + its
+   * number, so GC can tell it from data pages (tagged with their lba) and
+   * migrate it.
+   */
+  void InitDemandMapping(size_t cache_size) {
+    if (tpage_entries_ == 0) {
+      tpage_entries_ = DEFAULT_TPAGE_ENTRIES;
+    }
+    size_t num_tpages = (largest_lba_ + tpage_entries_) / tpage_entries_;
+    size_t cache_entries = std::max<size_t>(
+        std::min(cache_size / MappingCache::ENTRY_BYTES, largest_lba_ + 1),
+        PREFETCH_ENTRIES + 1);
+
+    cmt_.reset(new MappingCache(cache_entries));
+    gtd_.assign(num_tpages, INVALID_PAGE);
+    tpage_buf_.assign(tpage_entries_, INVALID_PAGE);
+    gc_threshold_ = GC_THRESHOLD + 1;
+
+    printf("Demand paged mapping: %zu cached entries, %zu translation pages\n",
+           cache_entries, num_tpages);
+  }
+
+  // current page of lba, false if its mapping can't be brought into the CMT
+  bool GetMapping(pg_size_t lba, const ExecCallBack<PageType> &func,
+                  pg_size_t *page) {
+    if (!cmt_) {
+      *page = lba_page_map_.Get(lba);
+      return true;
+    }
+    size_t slot = CacheMapping(lba, func);
+    if (slot == MappingCache::NONE) {
+      return false;
+    }
+    *page = cmt_->Page(slot);
+    return true;
+  }
+
+  // Same as GetMapping(), except that a mapping which can't be cached is
+  // read from its translation page, so reads keep working when there is no
+  // room left to write dirty translation pages back
+  pg_size_t LookupMapping(pg_size_t lba, const ExecCallBack<PageType> &func) {
+    pg_size_t page;
+    if (GetMapping(lba, func, &page)) {
+      return page;
+    }
+    // dirty mappings are always cached, so the translation page is current
+    ReadTranslationPage(lba / tpage_entries_, func);
+    return tpage_buf_[lba % tpage_entries_];
+  }
+
+  // only called right after GetMapping() on the same lba, so never fails
+  void SetMapping(pg_size_t lba, pg_size_t page,
+                  const ExecCallBack<PageType> &func) {
+    if (!cmt_) {
+      lba_page_map_.Set(lba, page);
+      return;
     }
-    page_lba_map_[page_idx] = lba;
+    cmt_->SetPage(CacheMapping(lba, func), page);
+  }
+
+  // Returns the lba (or translation page tag) of a page if the page holds
+  // its latest version, INVALID_PAGE otherwise
+  bool GetPageLba(pg_size_t page, const ExecCallBack<PageType> &func,
+                  pg_size_t *lba) {
+    if (!cmt_) {
+      *lba = page_lba_map_.Get(page);
+      return true;
+    }
+
+    // the spare area tells what was programmed into the page, if anything
+    uint64_t spare = func.ReadSpare(GetAddrFromPageIdx(page));
+    pg_size_t tag = spare == SPARE_ERASED ? INVALID_PAGE : pg_size_t(spare);
+    pg_size_t current;
+    if (tag == INVALID_PAGE) {
+      current = INVALID_PAGE;
+    } else if (tag > largest_lba_) {
+      current = gtd_[tag - largest_lba_ - 1];
+    } else if (!GetMapping(tag, func, &current)) {
+      return false;
+    }
+    *lba = current == page ? tag : INVALID_PAGE;
+    return true;
+  }
+
+  // slot of the CMT holding the mapping of lba, loading it (and a few
+  // following ones on sequential access) from its translation page on a miss
+  size_t CacheMapping(pg_size_t lba, const ExecCallBack<PageType> &func) {
+    bool sequential = lba == pg_size_t(last_lba_ + 1);
+    last_lba_ = lba;
+
+    size_t slot = cmt_->Find(lba);
+    if (slot != MappingCache::NONE) {
+      cmt_->Touch(slot);
+      return slot;
+    }
+
+    slot = MakeRoom(func);
+    if (slot == MappingCache::NONE) {
+      return slot;
+    }
+    size_t tpn = lba / tpage_entries_;
+    ReadTranslationPage(tpn, func);
+    cmt_->Fill(slot, lba, tpage_buf_[lba % tpage_entries_]);
+    cmt_->Touch(slot);
+
+    if (sequential) {
+      // prefetching only reuses slots that need no write back
+      size_t end = std::min((tpn + 1) * tpage_entries_, largest_lba_ + 1);
+      end = std::min(end, lba + 1 + PREFETCH_ENTRIES);
+      for (size_t next = lba + 1; next < end; ++next) {
+        if (cmt_->Find(next) != MappingCache::NONE) {
+          continue;
+        }
+        size_t victim = cmt_->Victim();
+        if (victim == slot || (!cmt_->Empty(victim) && cmt_->Dirty(victim))) {
+          break;
+        }
+        if (!cmt_->Empty(victim)) {
+          cmt_->Erase(victim);
+        }
+        cmt_->Fill(victim, next, tpage_buf_[next % tpage_entries_]);
+      }
+    }
+    return slot;
+  }
+
+  // frees a CMT slot, writing its translation page back first if dirty
+  size_t MakeRoom(const ExecCallBack<PageType> &func) {
+    size_t slot = cmt_->Victim();
+    if (cmt_->Empty(slot)) {
+      return slot;
+    }
+    if (cmt_->Dirty(slot) &&
+        !WriteTranslationPage(cmt_->Lba(slot) / tpage_entries_, func)) {
+      return MappingCache::NONE;
+    }
+    cmt_->Erase(slot);
+    return slot;
+  }
+
+  // loads a translation page into tpage_buf_
+  void ReadTranslationPage(size_t tpn, const ExecCallBack<PageType> &func) {
+    if (gtd_[tpn] == INVALID_PAGE) {
+      // never written, nothing is mapped yet
+      std::fill(tpage_buf_.begin(), tpage_buf_.end(), INVALID_PAGE);
+      return;
+    }
+    func.ReadMetadata(GetAddrFromPageIdx(gtd_[tpn]), tpage_buf_.data(),
+                      tpage_entries_ * sizeof(pg_size_t));
+  }
+
+  // Writes a translation page to a new place in the translation log. Every
+  // dirty cached mapping of the page is merged in and cleaned, so evicting
+  // them later costs nothing (batched write back).
+  bool WriteTranslationPage(size_t tpn, const ExecCallBack<PageType> &func) {
+    if (trans_log_.offset >= block_size_ &&
+        !OpenLogBlock(trans_log_, ANY_UNIT)) {
+      return false;
+    }
+    ReadTranslationPage(tpn, func);
+
+    size_t first = tpn * tpage_entries_;
+    size_t end = std::min(first + tpage_entries_, largest_lba_ + 1);
+    for (size_t lba = first; lba < end; ++lba) {
+      size_t slot = cmt_->Find(lba);
+      if (slot != MappingCache::NONE && cmt_->Dirty(slot)) {
+        tpage_buf_[lba - first] = cmt_->Page(slot);
+        cmt_->Clean(slot);
+      }
+    }
+
+    if (gtd_[tpn] != INVALID_PAGE) {
+      UpdatePageLba(gtd_[tpn], INVALID_PAGE);
+    }
+    pg_size_t page_idx = trans_log_.block * block_size_ + trans_log_.offset++;
+    func.ProgramMetadata(GetAddrFromPageIdx(page_idx), largest_lba_ + 1 + tpn,
+                         tpage_buf_.data(), tpage_entries_ * sizeof(pg_size_t));
+    UpdatePageLba(page_idx, largest_lba_ + 1 + tpn);
+    gtd_[tpn] = page_idx;
+    return true;
   }
 
   bool IsValidLba(size_t lba) { return lba <= largest_lba_; }
 
   // We mostly use indexes to represent the 5-tuple addresses to save space.
-  // These functions convert 5-tuple addresses to indexes and vice versa.
-  pg_size_t GetPageIdxFromAddr(const Address &addr) {
-    return addr.package * package_size_ * die_size_ * plane_size_ *
-               block_size_ +
-           addr.die * die_size_ * plane_size_ * block_size_ +
-           addr.plane * plane_size_ * block_size_ + addr.block * block_size_ +
-           addr.page;
-  }
+  // These functions convert indexes to 5-tuple addresses.
   Address GetAddrFromPageIdx(pg_size_t page_idx) {
-    return Address(
-        page_idx / (package_size_ * die_size_ * plane_size_ * block_size_),
-        (page_idx / (die_size_ * plane_size_ * block_size_)) % package_size_,
-        (page_idx / (plane_size_ * block_size_)) % die_size_,
-        (page_idx / (block_size_)) % plane_size_, page_idx % block_size_);
+    return codec_.PageAddress(page_idx);
   }
   Address GetAddrFromBlockIdx(blk_size_t blk_idx) {
-    return Address(blk_idx / (package_size_ * die_size_ * plane_size_),
-                   (blk_idx / (die_size_ * plane_size_)) % package_size_,
-                   (blk_idx / plane_size_) % die_size_, blk_idx % plane_size_,
-                   0);
+    return codec_.BlockAddress(blk_idx);
   }
 
   // Number of packages in a ssd
@@ -296,36 +1443,129 @@ class MyFTL : public FTLBase<PageType> {
   size_t block_size_;
   // Maximum number a block_ can be erased
   size_t block_erase_count_;
+  // converts page and block indexes to addresses
+  AddressCodec codec_;
 
   // gives the largest valid lba
   size_t largest_lba_;
 
-  // mapping of lba to physical page index
-  std::vector<pg_size_t> lba_page_map_;
-  // mapping of physical page index to lba
-  std::vector<pg_size_t> page_lba_map_;
+  // mapping of lba to physical page index (empty when demand paged)
+  ExtentMap lba_page_map_;
+  // mapping of physical page index to lba (empty when demand paged)
+  ExtentMap page_lba_map_;
   // mapping of block index to erase count
   std::vector<erase_size_t> block_erase_map_;
-  // list of free log blocks (not programmed at all)
-  std::list<blk_size_t> free_log_blocks_;
-  // list of used log blocks (fully programmed)
-  std::list<blk_size_t> used_log_blocks_;
+  // Host writes are striped round-robin over units (dies or planes, or the
+  // whole SSD when not striped) of unit_blocks_ consecutive blocks each
+  size_t unit_blocks_;
+  size_t num_units_;
+  AddressDivider unit_div_;
+  // every block is on a list by its erase count, one for the free blocks (not
+  // programmed at all) and one for the others, see WearList()
+  BlockLists wear_lists_;
+  // free blocks again, one list per unit (empty unless striped)
+  BlockLists unit_free_;
+  size_t num_free_;
+  // indexes used (fully programmed) blocks and picks the GC victim
+  std::unique_ptr<GCPolicy> gc_policy_;
 
   // track live pages per block
   std::vector<pgcnt_size_t> block_livepages_map_;
 
-  // index of the current log block we are using and the offset of the next
-  // free page
-  blk_size_t log_block_;
-  pg_size_t log_page_offset_;
+  // open log blocks for host writes (one per unit) and for pages migrated by
+  // GC, kept apart so cold surviving data isn't mixed with (and recopied
+  // along with) hot data
+  std::vector<LogFrontier> host_logs_;
+  // log the next host write goes to
+  size_t next_log_;
+  LogFrontier gc_log_;
+
+  // incremental GC starts when the free pool drops below the low watermark
+  // and stops once it is back at the high watermark (0 low watermark = off)
+  size_t gc_low_watermark_;
+  size_t gc_high_watermark_;
+  // cap on live pages migrated per host write by incremental GC
+  size_t gc_max_pages_;
+  bool gc_running_;
+  // block being cleaned, its live pages when picked, and the next page of it
+  // to look at (kept across writes by incremental GC)
+  blk_size_t gc_victim_;
+  pgcnt_size_t gc_victim_livepages_;
+  pgcnt_size_t gc_cursor_;
+  // simulated time (us) of the last host write, time between it and the one
+  // before, and the moving average of the latter
+  uint64_t last_write_time_;
+  double write_gap_;
+  double mean_write_gap_;
+
+  // erase count spread above which static wear leveling kicks in
+  size_t wl_threshold_;
+  // the lowest (no block is erased fewer times, kept up to date lazily) and
+  // highest erase count of any block
+  erase_size_t min_erases_;
+  erase_size_t max_erases_;
+  // a block has been erased since wear leveling last looked
+  bool wl_pending_;
+
+  // free blocks below which GC runs synchronously
+  size_t gc_threshold_;
+
+  // demand paged mapping, see InitDemandMapping() (cmt_ is null when the
+  // whole mapping is kept in RAM)
+  size_t tpage_entries_;
+  std::unique_ptr<MappingCache> cmt_;
+  // page holding each translation page
+  std::vector<pg_size_t> gtd_;
+  // translation page being read or written
+  std::vector<pg_size_t> tpage_buf_;
+  // open log block for translation pages
+  LogFrontier trans_log_;
+  // last lba looked up, to detect sequential access
+  pg_size_t last_lba_;
 };
 
+template <typename PageType, typename PageIdxType, typename BlockIdxType>
+constexpr PageIdxType MyFTL<PageType, PageIdxType, BlockIdxType>::INVALID_PAGE;
+template <typename PageType, typename PageIdxType, typename BlockIdxType>
+constexpr BlockIdxType
+    MyFTL<PageType, PageIdxType, BlockIdxType>::INVALID_BLOCK;
+template <typename PageType, typename PageIdxType, typename BlockIdxType>
+constexpr double MyFTL<PageType, PageIdxType, BlockIdxType>::MAX_RATE_SCALE;
+
+namespace {
+
+// true if every index below count, plus the invalid marker, fits in T
+template <typename T>
+bool IndexFits(size_t count) {
+  return count < std::numeric_limits<T>::max();
+}
+
+template <typename PageIdxType>
+FTLBase<TEST_PAGE_TYPE> *CreateMyFTLWithPageIdx(const ConfBase *conf,
+                                                size_t num_blocks) {
+  if (IndexFits<uint16_t>(num_blocks)) {
+    return new MyFTL<TEST_PAGE_TYPE, PageIdxType, uint16_t>(conf);
+  }
+  return new MyFTL<TEST_PAGE_TYPE, PageIdxType, uint32_t>(conf);
+}
+
+}  // namespace
+
 /*
  * CreateMyFTL() - Creates class MyFTL object
  *
- * You do not need to modify this
+ * Picks the narrowest index types that fit the SSD geometry
  */
 FTLBase<TEST_PAGE_TYPE> *CreateMyFTL(const ConfBase *conf) {
-  MyFTL<TEST_PAGE_TYPE> *ftl = new MyFTL<TEST_PAGE_TYPE>(conf);
-  return static_cast<FTLBase<TEST_PAGE_TYPE> *>(ftl);
+  size_t num_blocks = conf->GetSSDSize() * conf->GetPackageSize() *
+                      conf->GetDieSize() * conf->GetPlaneSize();
+  size_t num_pages = num_blocks * conf->GetBlockSize();
+
+  if (IndexFits<uint16_t>(num_pages)) {
+    return CreateMyFTLWithPageIdx<uint16_t>(conf, num_blocks);
+  }
+  if (IndexFits<uint32_t>(num_pages)) {
+    return CreateMyFTLWithPageIdx<uint32_t>(conf, num_blocks);
+  }
+  return CreateMyFTLWithPageIdx<uint64_t>(conf, num_blocks);
 }
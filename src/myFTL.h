@@ -1,5 +1,262 @@
 #pragma once
 
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
 #include "common.h"
 
-FTLBase<TEST_PAGE_TYPE> *CreateMyFTL(const ConfBase *conf);
\ No newline at end of file
+FTLBase<TEST_PAGE_TYPE> *CreateMyFTL(const ConfBase *conf);
+
+/*
+ * ExtentMap - Mapping from a dense range of keys (lbas or pages) to pages or
+ *             lbas, compressed for sequential runs
+ *
+ * The keys are cut into chunks of CHUNK_SIZE. A chunk keeps its runs of
+ * consecutive keys mapped to consecutive (ascending or descending) values as
+ * extents sorted by offset, so sequentially written data costs a few bytes
+ * per run instead of one entry per page. A chunk fragmented into more than
+ * MAX_EXTENTS runs falls back to an array with one entry per key, so random
+ * regions are looked up as fast as with a flat map. It is compressed again
+ * once its runs merge back (e.g. after being rewritten sequentially).
+ *
+ * Counting runs of a fragmented chunk only looks at neighbouring keys, which
+ * is exact as long as no two keys map to the same value. That holds for both
+ * directions of the FTL mapping, except briefly while a page is moved.
+ */
+template <typename pg_size_t>
+class ExtentMap {
+ public:
+  static constexpr pg_size_t INVALID = std::numeric_limits<pg_size_t>::max();
+
+  static constexpr size_t CHUNK_SHIFT = 12;
+  static constexpr size_t CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
+  // bounds the binary search, and keeps extents well below an array in size
+  static constexpr size_t MAX_EXTENTS = 64;
+
+  ExtentMap() : chunks_() {}
+  explicit ExtentMap(size_t num_keys)
+      : chunks_((num_keys + CHUNK_SIZE - 1) / CHUNK_SIZE) {}
+
+  pg_size_t Get(size_t key) const {
+    const Chunk &chunk = chunks_[key >> CHUNK_SHIFT];
+    size_t offset = key & (CHUNK_SIZE - 1);
+    if (chunk.array) {
+      return chunk.array[offset];
+    }
+    size_t i = Find(chunk, offset);
+    if (i == 0 || offset >= End(chunk.extents[i - 1])) {
+      return INVALID;
+    }
+    return ValueAt(chunk.extents[i - 1], offset);
+  }
+
+  // value INVALID unmaps key
+  void Set(size_t key, pg_size_t value) {
+    Chunk &chunk = chunks_[key >> CHUNK_SHIFT];
+    size_t offset = key & (CHUNK_SIZE - 1);
+    if (chunk.array) {
+      SetArray(&chunk, offset, value);
+      if (chunk.runs <= MAX_EXTENTS / 2) {
+        Compress(&chunk);
+      }
+    } else {
+      SetExtent(&chunk, offset, value);
+      if (chunk.extents.size() > MAX_EXTENTS) {
+        Expand(&chunk);
+      }
+    }
+  }
+
+  // bytes of heap the map holds
+  size_t MemoryUsage() const {
+    size_t bytes = chunks_.capacity() * sizeof(Chunk);
+    for (const Chunk &chunk : chunks_) {
+      bytes += chunk.extents.capacity() * sizeof(Extent);
+      if (chunk.array) {
+        bytes += CHUNK_SIZE * sizeof(pg_size_t);
+      }
+    }
+    return bytes;
+  }
+
+ private:
+  // keys offset..offset+length-1 map to value, value-1... when descending
+  // (or value+1... otherwise)
+  struct Extent {
+    uint16_t offset;
+    uint16_t length : 15;
+    uint16_t descending : 1;
+    pg_size_t value;
+  };
+
+  struct Chunk {
+    // extents of a compressed chunk, empty otherwise
+    std::vector<Extent> extents;
+    // one value per key of a fragmented chunk, null otherwise
+    std::unique_ptr<pg_size_t[]> array;
+    // number of runs in array
+    size_t runs;
+
+    Chunk() : extents(), array(), runs(0) {}
+  };
+
+  static size_t End(const Extent &ext) { return ext.offset + ext.length; }
+
+  static pg_size_t ValueAt(const Extent &ext, size_t offset) {
+    size_t delta = offset - ext.offset;
+    return ext.descending ? ext.value - delta : ext.value + delta;
+  }
+
+  // Whether a run holding value from goes on with value to, which is +1 if
+  // it goes up, -1 if it goes down, 0 if it doesn't
+  static int Step(pg_size_t from, pg_size_t to) {
+    if (from == INVALID || to == INVALID) {
+      return 0;
+    }
+    if (size_t(from) + 1 == to) {
+      return 1;
+    }
+    return size_t(to) + 1 == from ? -1 : 0;
+  }
+
+  // whether ext can go on in direction step, a single key going either way
+  static bool Follows(const Extent &ext, int step) {
+    return step != 0 && (ext.length == 1 || ext.descending == (step < 0));
+  }
+
+  // index of the first extent starting after offset
+  static size_t Find(const Chunk &chunk, size_t offset) {
+    return std::upper_bound(chunk.extents.begin(), chunk.extents.end(), offset,
+                            [](size_t off, const Extent &ext) {
+                              return off < ext.offset;
+                            }) -
+           chunk.extents.begin();
+  }
+
+  static void SetExtent(Chunk *chunk, size_t offset, pg_size_t value) {
+    std::vector<Extent> &exts = chunk->extents;
+
+    // cut offset out of the extent holding it
+    size_t i = Find(*chunk, offset);
+    if (i > 0 && offset < End(exts[i - 1])) {
+      Extent &ext = exts[i - 1];
+      size_t end = End(ext);
+      if (ext.length == 1) {
+        exts.erase(exts.begin() + (i - 1));
+      } else if (offset == ext.offset) {
+        ext.value = ValueAt(ext, offset + 1);
+        ++ext.offset;
+        --ext.length;
+      } else if (offset + 1 == end) {
+        --ext.length;
+      } else {
+        Extent tail = {uint16_t(offset + 1), uint16_t(end - offset - 1),
+                       ext.descending, ValueAt(ext, offset + 1)};
+        ext.length = offset - ext.offset;
+        exts.insert(exts.begin() + i, tail);
+      }
+      i = Find(*chunk, offset);
+    }
+    if (value == INVALID) {
+      return;
+    }
+
+    // extend the neighbours whose runs value goes on with
+    int left_step = 0;
+    int right_step = 0;
+    if (i > 0 && End(exts[i - 1]) == offset) {
+      left_step = Step(ValueAt(exts[i - 1], offset - 1), value);
+      left_step = Follows(exts[i - 1], left_step) ? left_step : 0;
+    }
+    if (i < exts.size() && exts[i].offset == offset + 1) {
+      right_step = Step(value, exts[i].value);
+      right_step = Follows(exts[i], right_step) ? right_step : 0;
+    }
+    if (left_step != 0 && left_step == right_step) {
+      exts[i - 1].length += 1 + exts[i].length;
+      exts[i - 1].descending = left_step < 0;
+      exts.erase(exts.begin() + i);
+    } else if (left_step != 0) {
+      ++exts[i - 1].length;
+      exts[i - 1].descending = left_step < 0;
+    } else if (right_step != 0) {
+      --exts[i].offset;
+      ++exts[i].length;
+      exts[i].descending = right_step < 0;
+      exts[i].value = value;
+    } else {
+      exts.insert(exts.begin() + i, Extent{uint16_t(offset), 1, 0, value});
+    }
+  }
+
+  // whether a run starts at offset of a fragmented chunk
+  static bool RunStart(const Chunk &chunk, size_t offset) {
+    return chunk.array[offset] != INVALID &&
+           (offset == 0 ||
+            Step(chunk.array[offset - 1], chunk.array[offset]) == 0);
+  }
+
+  // keeps the number of runs up to date, which only depends on the starts
+  // of runs at offset and right after it
+  static void SetArray(Chunk *chunk, size_t offset, pg_size_t value) {
+    bool has_next = offset + 1 < CHUNK_SIZE;
+    chunk->runs -= RunStart(*chunk, offset);
+    if (has_next) {
+      chunk->runs -= RunStart(*chunk, offset + 1);
+    }
+    chunk->array[offset] = value;
+    chunk->runs += RunStart(*chunk, offset);
+    if (has_next) {
+      chunk->runs += RunStart(*chunk, offset + 1);
+    }
+  }
+
+  static void Expand(Chunk *chunk) {
+    chunk->array.reset(new pg_size_t[CHUNK_SIZE]);
+    std::fill_n(chunk->array.get(), CHUNK_SIZE, INVALID);
+    for (const Extent &ext : chunk->extents) {
+      for (size_t offset = ext.offset; offset < End(ext); ++offset) {
+        chunk->array[offset] = ValueAt(ext, offset);
+      }
+    }
+    // extents are merged as soon as they touch, so each is a run
+    chunk->runs = chunk->extents.size();
+    std::vector<Extent>().swap(chunk->extents);
+  }
+
+  static void Compress(Chunk *chunk) {
+    std::vector<Extent> &exts = chunk->extents;
+    exts.reserve(chunk->runs);
+    for (size_t offset = 0; offset < CHUNK_SIZE; ++offset) {
+      pg_size_t value = chunk->array[offset];
+      if (value == INVALID) {
+        continue;
+      }
+      // a page briefly mapped twice while being moved may break a run, so
+      // the extents are not trusted to be exactly the counted runs
+      if (!exts.empty() && End(exts.back()) == offset) {
+        int step = Step(ValueAt(exts.back(), offset - 1), value);
+        if (Follows(exts.back(), step)) {
+          ++exts.back().length;
+          exts.back().descending = step < 0;
+          continue;
+        }
+      }
+      exts.push_back(Extent{uint16_t(offset), 1, 0, value});
+    }
+    chunk->array.reset();
+  }
+
+  std::vector<Chunk> chunks_;
+};
+
+template <typename pg_size_t>
+constexpr pg_size_t ExtentMap<pg_size_t>::INVALID;
+template <typename pg_size_t>
+constexpr size_t ExtentMap<pg_size_t>::CHUNK_SHIFT;
+template <typename pg_size_t>
+constexpr size_t ExtentMap<pg_size_t>::CHUNK_SIZE;
+template <typename pg_size_t>
+constexpr size_t ExtentMap<pg_size_t>::MAX_EXTENTS;
@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Nothing in this geometry is a power of two above 1
+#define SSD_SIZE 3
+#define PACKAGE_SIZE 5
+#define DIE_SIZE 3
+#define PLANE_SIZE 7
+#define BLOCK_SIZE 6
+#define OVERPROVISIONING 0.10
+#define RANDOM_NUMERATORS 2000
+#include "746FlashSim.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+static uint64_t rand64() {
+    uint64_t n = 0;
+    for (int i = 0; i < 4; i++) {
+        n = n << 16 | (rand() & 0xffff);
+    }
+    return n;
+}
+
+static bool check_divider(const AddressDivider &div, uint64_t d, uint64_t n) {
+    if (div.Div(n) != n / d || div.Mod(n) != n % d) {
+        fprintf(log_file_stream,
+                "%lu / %lu gives %lu rem %lu, expected %lu rem %lu\n",
+                (unsigned long)n, (unsigned long)d,
+                (unsigned long)div.Div(n), (unsigned long)div.Mod(n),
+                (unsigned long)(n / d), (unsigned long)(n % d));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Checks every numerator a multiply-shift divider is likely to get wrong:
+ * Both sides of each multiple of d near the top of the exact range, the
+ * 2^32 boundary where it falls back to a division, and random ones
+ */
+static bool check_divisor(uint64_t d) {
+    const AddressDivider div(d);
+    const uint64_t top = UINT32_MAX;
+    const uint64_t edges[] = {top - 1, top, top + 1, top + 2,
+                              uint64_t(1) << 40, UINT64_MAX - 1, UINT64_MAX};
+
+    for (uint64_t n = 0; n < 1000; n++) {
+        if (!check_divider(div, d, n)) return false;
+    }
+    for (uint64_t k = top / d > 2 ? top / d - 2 : 1;
+         d <= top && k <= top / d + 2; k++) {
+        for (uint64_t n = k * d - 1; n <= k * d + 1; n++) {
+            if (!check_divider(div, d, n)) return false;
+        }
+    }
+    for (uint64_t n : edges) {
+        if (!check_divider(div, d, n)) return false;
+    }
+    for (int i = 0; i < RANDOM_NUMERATORS; i++) {
+        if (!check_divider(div, d, rand64() & top)) return false;
+        if (!check_divider(div, d, rand64())) return false;
+    }
+    return true;
+}
+
+/*
+ * Test 1_7 - AddressDivider is exact below 2^32 and falls back above it, and
+ *            AddressCodec round trips every page of a geometry it has to
+ *            divide for
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_1_7 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    fprintf(log_file_stream, "------------------------------------------------------------\n");
+
+    init_flashsim();
+
+    int r;
+    srand(15746);
+    const uint64_t divisors[] = {
+        105, 315, 1890, 4095, 65535, 65537, 1000003, 0x7fffffff,
+        0x80000001, 0xfffffffe, UINT32_MAX, uint64_t(1) << 32,
+        (uint64_t(1) << 32) + 1, uint64_t(3) << 40, UINT64_MAX};
+    const size_t num_raw_blocks = SSD_SIZE * PACKAGE_SIZE * DIE_SIZE * PLANE_SIZE;
+    const size_t num_raw_pages = num_raw_blocks * BLOCK_SIZE;
+    // 31.5 here, which the FTL rounds to the nearest block
+    const size_t num_nondata_blocks = OVERPROVISIONING * num_raw_blocks + 0.5;
+    const size_t num_pages = (num_raw_blocks - num_nondata_blocks) * BLOCK_SIZE;
+    const AddressCodec codec(SSD_SIZE, PACKAGE_SIZE, DIE_SIZE, PLANE_SIZE,
+                             BLOCK_SIZE);
+    TEST_PAGE_TYPE data[num_pages];
+    FlashSimTest test(argv[1]);
+
+    for (uint64_t d = 1; d <= 100; d++) {
+        if (!check_divisor(d)) goto failed;
+    }
+    for (uint64_t d : divisors) {
+        if (!check_divisor(d)) goto failed;
+    }
+
+    if (codec.NumPages() != num_raw_pages) {
+        fprintf(log_file_stream, "AddressCodec has %zu pages, expected %zu\n",
+                codec.NumPages(), num_raw_pages);
+        goto failed;
+    }
+    for (size_t page = 0; page < num_raw_pages; page++) {
+        const Address addr = codec.PageAddress(page);
+        const Address unpacked = AddressCodec::Unpack(AddressCodec::Pack(addr));
+
+        if (!codec.Contains(addr) || codec.PageIndex(addr) != page ||
+            codec.BlockIndex(addr) != page / BLOCK_SIZE ||
+            codec.BlockOfPage(page) != page / BLOCK_SIZE) {
+            fprintf(log_file_stream, "Page %zu does not round trip\n", page);
+            addr.Print(log_file_stream);
+            goto failed;
+        }
+        if (unpacked.package != addr.package || unpacked.die != addr.die ||
+            unpacked.plane != addr.plane || unpacked.block != addr.block ||
+            unpacked.page != addr.page) {
+            fprintf(log_file_stream, "Page %zu does not pack\n", page);
+            addr.Print(log_file_stream);
+            goto failed;
+        }
+    }
+
+    // And through the FTL, which divides the same way
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        data[addr] = rand() % 18746;
+        r = test.Write(log_file_stream, addr, data[addr]);
+        if (r != 1) goto failed;
+    }
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        TEST_PAGE_TYPE buffer;
+        r = test.Read(log_file_stream, addr, &buffer);
+        if (r != 1) goto failed;
+        if (buffer != data[addr]) {
+            fprintf(log_file_stream, "Reading LBA %zu does not return the latest data\n", addr);
+            goto failed;
+        }
+    }
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}
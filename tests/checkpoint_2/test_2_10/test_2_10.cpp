@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define SSD_SIZE 2
+#define PACKAGE_SIZE 4
+#define DIE_SIZE 1
+#define PLANE_SIZE 10
+#define BLOCK_SIZE 16
+#define BLOCK_ERASES 20
+#define OVERPROVISIONING 0.25
+#define CHECK_EVERY 200
+#include "746FlashSim.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+/*
+ * Recomputes everything the counter keeps incrementally from the count of
+ * each block, and compares the two
+ */
+static bool check_counts(const EraseCounter &counts, size_t num_blocks,
+                         size_t max_erases) {
+    size_t min = SIZE_MAX, max = 0, worn_out = 0;
+    double sum = 0, var = 0;
+
+    for (size_t block = 0; block < num_blocks; block++) {
+        const size_t erases = counts.Erases(block);
+        min = erases < min ? erases : min;
+        max = erases > max ? erases : max;
+        sum += erases;
+        if (counts.IsWornOut(block) != (erases == max_erases)) {
+            fprintf(log_file_stream, "Block %zu with %zu erases is%s worn out\n",
+                    block, erases, counts.IsWornOut(block) ? "" : " not");
+            return false;
+        }
+        if (erases == max_erases) worn_out++;
+    }
+    const double mean = sum / num_blocks;
+    for (size_t block = 0; block < num_blocks; block++) {
+        var += (counts.Erases(block) - mean) * (counts.Erases(block) - mean);
+    }
+    const double stddev = sqrt(var / num_blocks);
+
+    if (counts.Min() != min || counts.Max() != max ||
+        counts.NumWornOut() != worn_out ||
+        fabs(counts.Mean() - mean) > 1e-9 ||
+        fabs(counts.StdDev() - stddev) > 1e-6) {
+        fprintf(log_file_stream,
+                "Erase counts are min %zu, max %zu, mean %f, stddev %f with %zu "
+                "worn out, expected %zu, %zu, %f, %f with %zu\n",
+                counts.Min(), counts.Max(), counts.Mean(), counts.StdDev(),
+                counts.NumWornOut(), min, max, mean, stddev, worn_out);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Test 2_10 - The erase counts the controller reports match those of the
+ * individual blocks all the way until the SSD wears out
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_2_10 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    fprintf(log_file_stream, "------------------------------------------------------------\n");
+
+    init_flashsim();
+
+    int r;
+    srand(15746);
+    const size_t num_raw_blocks = SSD_SIZE * PACKAGE_SIZE * DIE_SIZE * PLANE_SIZE;
+    const size_t num_nondata_blocks = OVERPROVISIONING * num_raw_blocks;
+    const size_t num_blocks = num_raw_blocks - num_nondata_blocks;
+    const size_t num_pages = num_blocks * BLOCK_SIZE;
+    size_t writes = 0;
+    uint64_t total_erases = 0;
+    EraseCounter counter(4, 3);
+    FlashSimTest test(argv[1]);
+
+    // The counter on its own first: The minimum has to move up once the
+    // last block at it is erased, and a block at the limit is worn out
+    counter.Record(0);
+    counter.Record(0);
+    counter.Record(0);
+    counter.Record(1);
+    if (!check_counts(counter, 4, 3)) goto failed;
+    counter.Record(2);
+    counter.Record(3);
+    if (!check_counts(counter, 4, 3) || counter.Min() != 1) goto failed;
+
+    // Then random writes until the FTL runs out of blocks to write to
+    for (;;) {
+        const size_t addr = rand() % num_pages;
+        r = test.Write(nullptr, addr, rand() % 18746);
+        if (r == -1) {
+            fprintf(log_file_stream, "Error writing LBA %zu\n", addr);
+            goto failed;
+        } else if (r == 0) {
+            break;
+        }
+        if (++writes % CHECK_EVERY == 0 &&
+            !check_counts(test.EraseCounts(), num_raw_blocks, BLOCK_ERASES)) {
+            fprintf(log_file_stream, "After %zu writes\n", writes);
+            goto failed;
+        }
+    }
+
+    if (!check_counts(test.EraseCounts(), num_raw_blocks, BLOCK_ERASES)) {
+        goto failed;
+    }
+    if (test.AtLeastOneBlockWornOut() != (test.EraseCounts().NumWornOut() > 0) ||
+        !test.AtLeastOneBlockWornOut()) {
+        fprintf(log_file_stream, "FTL stopped writing with %zu blocks worn out\n",
+                test.EraseCounts().NumWornOut());
+        goto failed;
+    }
+    for (size_t block = 0; block < num_raw_blocks; block++) {
+        total_erases += test.EraseCounts().Erases(block);
+    }
+    if (total_erases != test.TotalErasesPerformed()) {
+        fprintf(log_file_stream, "Blocks were erased %lu times, but %lu erases "
+                "were performed\n", (unsigned long)total_erases,
+                (unsigned long)test.TotalErasesPerformed());
+        goto failed;
+    }
+    fprintf(log_file_stream, "%zu writes, %zu of %zu blocks worn out, erases "
+            "%zu / %.1f / %zu\n", writes, test.EraseCounts().NumWornOut(),
+            num_raw_blocks, test.EraseCounts().Min(), test.EraseCounts().Mean(),
+            test.EraseCounts().Max());
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}
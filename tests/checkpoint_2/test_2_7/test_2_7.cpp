@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_LBAS 64
+#define BURST_SIZE 24
+#define NUM_BURSTS 300
+#include "746FlashSim.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_2_7 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    fprintf(log_file_stream, "------------------------------------------------------------\n");
+
+    init_flashsim();
+
+    int r;
+    srand(15746);
+    TEST_PAGE_TYPE data[NUM_LBAS];
+    bool written[NUM_LBAS];
+    uint64_t seqs[BURST_SIZE];
+    bool is_read[BURST_SIZE];
+    TEST_PAGE_TYPE expected[BURST_SIZE];
+    size_t max_outstanding = 0;
+    FlashSimTest::Completion completion;
+    FlashSimTest test(argv[1]);
+
+    for (size_t addr = 0; addr < NUM_LBAS; addr++) {
+        written[addr] = false;
+    }
+
+    // Keep bursts of overwrites, reads and trims of the same few LBAs in
+    // flight, more than HOST_OP_WINDOW at a time. A read must see the last
+    // write submitted before it
+    for (int i = 0; i < NUM_BURSTS; i++) {
+        for (int j = 0; j < BURST_SIZE; j++) {
+            const size_t addr = rand() % NUM_LBAS;
+            const int op = rand() % 8;
+
+            is_read[j] = false;
+            if (!written[addr] || op < 4) {
+                data[addr] = rand() % 18746;
+                written[addr] = true;
+                seqs[j] = test.SubmitWrite(addr, data[addr]);
+            } else if (op < 7) {
+                is_read[j] = true;
+                expected[j] = data[addr];
+                seqs[j] = test.SubmitRead(addr);
+            } else {
+                written[addr] = false;
+                seqs[j] = test.SubmitTrim(addr);
+            }
+
+            if (test.Outstanding() > max_outstanding) {
+                max_outstanding = test.Outstanding();
+            }
+        }
+
+        // Results come back in submission order
+        for (int j = 0; j < BURST_SIZE; j++) {
+            completion = test.Complete();
+            if (completion.seq != seqs[j]) {
+                fprintf(log_file_stream, "Operation %llu completed in place of %llu\n",
+                        (long long unsigned) completion.seq, (long long unsigned) seqs[j]);
+                goto failed;
+            }
+            if (completion.result != 1) {
+                fprintf(log_file_stream, "Operation %llu on LBA %zu failed\n",
+                        (long long unsigned) completion.seq, completion.addr);
+                goto failed;
+            }
+            if (is_read[j] && completion.page != expected[j]) {
+                fprintf(log_file_stream, "Reading LBA %zu does not get the right value\n", completion.addr);
+                goto failed;
+            }
+        }
+    }
+
+    if (test.Outstanding() != 0) {
+        fprintf(log_file_stream, "%zu operations left outstanding\n", test.Outstanding());
+        goto failed;
+    }
+
+    // The queued operations left the same data as the calls one by one
+    for (size_t addr = 0; addr < NUM_LBAS; addr++) {
+        TEST_PAGE_TYPE page_value;
+        if (!written[addr]) continue;
+        r = test.Read(log_file_stream, addr, &page_value);
+        if (r != 1) goto failed;
+        if (page_value != data[addr]) {
+            fprintf(log_file_stream, "Reading LBA %zu does not get the right value\n", addr);
+            goto failed;
+        }
+    }
+
+    fprintf(log_file_stream, ">>> Most operations in flight: %zu\n", max_outstanding);
+    fprintf(log_file_stream, ">>> Total physical writes: %llu\n",
+            (long long unsigned) test.TotalWritesPerformed());
+    fprintf(log_file_stream, ">>> Total physical erases: %llu\n",
+            (long long unsigned) test.TotalErasesPerformed());
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}
@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SSD_SIZE 2
+#define PACKAGE_SIZE 4
+#define DIE_SIZE 1
+#define PLANE_SIZE 10
+#define BLOCK_SIZE 16
+#define OVERPROVISIONING 0.25
+#define HOT_LBAS 64
+#define NUM_WRITES 40000
+#define COLD_EVERY 8
+// Cost-benefit lets the cold blocks age, while the other policies (2.2 to
+// 2.5 here) keep moving their live pages along with the hot ones
+#define MAX_WRITE_AMPLIFICATION 1.9
+#include "746FlashSim.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+/*
+ * Test 2_8 - Cost-benefit GC (SELECTED_GC_POLICY 3) on a hot set of LBAs,
+ * with one write in COLD_EVERY going anywhere
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_2_8 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    fprintf(log_file_stream, "------------------------------------------------------------\n");
+
+    init_flashsim();
+
+    int r;
+    srand(15746);
+    const size_t num_raw_blocks = SSD_SIZE * PACKAGE_SIZE * DIE_SIZE * PLANE_SIZE;
+    const size_t num_nondata_blocks = OVERPROVISIONING * num_raw_blocks;
+    const size_t num_blocks = num_raw_blocks - num_nondata_blocks;
+    const size_t num_pages = num_blocks * BLOCK_SIZE;
+    const size_t logical_writes = num_pages + NUM_WRITES;
+    size_t writes_after_fill;
+    double write_amp;
+    TEST_PAGE_TYPE data[num_pages];
+    FlashSimTest test(argv[1]);
+
+    // Cold data everywhere
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        data[addr] = rand() % 18746;
+        r = test.Write(nullptr, addr, data[addr]);
+        if (r != 1) {
+            fprintf(log_file_stream, "Writing LBA %zu failed\n", addr);
+            goto failed;
+        }
+    }
+
+    writes_after_fill = test.TotalWritesPerformed();
+
+    for (int i = 0; i < NUM_WRITES; i++) {
+        const size_t addr = rand() % (i % COLD_EVERY == 0 ? num_pages : HOT_LBAS);
+        data[addr] = rand() % 18746;
+        r = test.Write(nullptr, addr, data[addr]);
+        if (r != 1) {
+            fprintf(log_file_stream, "Writing LBA %zu failed\n", addr);
+            goto failed;
+        }
+    }
+
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        TEST_PAGE_TYPE page_value;
+        r = test.Read(nullptr, addr, &page_value);
+        if (r != 1 || page_value != data[addr]) {
+            fprintf(log_file_stream, "Reading LBA %zu does not get the right value\n", addr);
+            goto failed;
+        }
+    }
+
+    write_amp = double(test.TotalWritesPerformed()) / logical_writes;
+    fprintf(log_file_stream, ">>> Physical writes after the cold fill: %zu\n", writes_after_fill);
+    fprintf(log_file_stream, ">>> Total physical writes: %llu\n",
+            (long long unsigned) test.TotalWritesPerformed());
+    fprintf(log_file_stream, ">>> Write amplification: %.3f\n", write_amp);
+    if (write_amp > MAX_WRITE_AMPLIFICATION) {
+        fprintf(log_file_stream, "Write amplification above %.2f, is the GC policy cost-benefit?\n",
+                MAX_WRITE_AMPLIFICATION);
+        goto failed;
+    }
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}
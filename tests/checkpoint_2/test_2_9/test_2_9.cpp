@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SSD_SIZE 2
+#define PACKAGE_SIZE 4
+#define DIE_SIZE 1
+#define PLANE_SIZE 10
+#define BLOCK_SIZE 16
+#define BLOCK_ERASES 200
+#define OVERPROVISIONING 0.25
+#define WEAR_LEVELING_THRESHOLD 8
+#define HOT_LBAS 64
+#define HOT_WRITES 60000
+#define CHECK_EVERY 1000
+// Wear leveling moves one cold block at a time once the spread is above the
+// threshold, so it trails the hot blocks by a few erases. Without it the
+// spread here goes past 150
+#define MAX_SPREAD (2 * WEAR_LEVELING_THRESHOLD + 4)
+#include "746FlashSim.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+/*
+ * Test 2_9 - Static wear leveling keeps the erase counts of blocks holding
+ * cold data close to those of the blocks taking the hot writes
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_2_9 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    fprintf(log_file_stream, "------------------------------------------------------------\n");
+
+    init_flashsim();
+
+    int r;
+    srand(15746);
+    const size_t num_raw_blocks = SSD_SIZE * PACKAGE_SIZE * DIE_SIZE * PLANE_SIZE;
+    const size_t num_nondata_blocks = OVERPROVISIONING * num_raw_blocks;
+    const size_t num_blocks = num_raw_blocks - num_nondata_blocks;
+    const size_t num_pages = num_blocks * BLOCK_SIZE;
+    size_t max_spread = 0;
+    TEST_PAGE_TYPE data[num_pages];
+    FlashSimTest test(argv[1]);
+
+    // Cold data everywhere, never written again
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        data[addr] = rand() % 18746;
+        r = test.Write(nullptr, addr, data[addr]);
+        if (r != 1) {
+            fprintf(log_file_stream, "Writing LBA %zu failed\n", addr);
+            goto failed;
+        }
+    }
+
+    for (int i = 1; i <= HOT_WRITES; i++) {
+        const size_t addr = rand() % HOT_LBAS;
+        data[addr] = rand() % 18746;
+        r = test.Write(nullptr, addr, data[addr]);
+        if (r != 1) {
+            fprintf(log_file_stream, "Writing LBA %zu failed\n", addr);
+            goto failed;
+        }
+
+        if (i % CHECK_EVERY == 0) {
+            const EraseCounter &erases = test.EraseCounts();
+            const size_t spread = erases.Max() - erases.Min();
+            if (spread > max_spread) {
+                max_spread = spread;
+            }
+            if (spread > MAX_SPREAD) {
+                fprintf(log_file_stream, "Erase counts spread from %zu to %zu after %d writes\n",
+                        erases.Min(), erases.Max(), i);
+                goto failed;
+            }
+        }
+    }
+
+    for (size_t addr = 0; addr < num_pages; addr++) {
+        TEST_PAGE_TYPE page_value;
+        r = test.Read(nullptr, addr, &page_value);
+        if (r != 1 || page_value != data[addr]) {
+            fprintf(log_file_stream, "Reading LBA %zu does not get the right value\n", addr);
+            goto failed;
+        }
+    }
+
+    fprintf(log_file_stream, ">>> Largest erase count spread: %zu\n", max_spread);
+    fprintf(log_file_stream, ">>> Erase counts min/mean/max: %zu/%.1f/%zu\n",
+            test.EraseCounts().Min(), test.EraseCounts().Mean(), test.EraseCounts().Max());
+    fprintf(log_file_stream, ">>> Total physical writes: %llu\n",
+            (long long unsigned) test.TotalWritesPerformed());
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define NUM_CHUNKS 16
+#define RANDOM_SETS 200000
+#include "746FlashSim.h"
+#include "myFTL.h"
+
+static FILE *log_file_stream;
+static char log_file_path[255];
+
+typedef ExtentMap<uint32_t> Map;
+
+/* Checks every key of the map against a plain array */
+static bool check_map(const Map &map, const std::vector<uint32_t> &expected, const char *phase) {
+    for (size_t key = 0; key < expected.size(); key++) {
+        if (map.Get(key) != expected[key]) {
+            fprintf(log_file_stream, "%s: key %zu maps to %u instead of %u\n", phase, key,
+                    (unsigned) map.Get(key), (unsigned) expected[key]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Test 3_4 - Memory and correctness of the extent based mapping the FTL keeps
+ * its page maps in
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: test_3_4 <config_file_name> <log_file_path>\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = 1;
+    strcpy(log_file_path, argv[2]);
+    log_file_stream = fopen(log_file_path, "w+");
+    assert(log_file_stream != NULL);
+
+    init_flashsim();
+
+    srand(15746);
+    const size_t num_keys = NUM_CHUNKS * Map::CHUNK_SIZE;
+    const size_t flat_bytes = num_keys * sizeof(uint32_t);
+    const size_t fragmented = Map::CHUNK_SIZE;
+    size_t sequential_bytes;
+    Map map(num_keys);
+    std::vector<uint32_t> expected(num_keys, Map::INVALID);
+
+    // A sequential fill costs a few bytes per chunk, not one entry per key
+    for (size_t key = 0; key < num_keys; key++) {
+        map.Set(key, 1000 + key);
+        expected[key] = 1000 + key;
+    }
+    if (!check_map(map, expected, "Sequential fill")) goto failed;
+    sequential_bytes = map.MemoryUsage();
+    fprintf(log_file_stream, ">>> Sequential fill: %zu bytes, %zu flat\n", sequential_bytes, flat_bytes);
+    if (sequential_bytes > flat_bytes / 100) {
+        fprintf(log_file_stream, "Sequential fill is not compressed\n");
+        goto failed;
+    }
+
+    // Descending runs, as written from the last LBA down, compress as well
+    for (size_t key = num_keys; key-- > 0;) {
+        map.Set(key, 500000 - key);
+        expected[key] = 500000 - key;
+    }
+    if (!check_map(map, expected, "Descending fill")) goto failed;
+    if (map.MemoryUsage() > flat_bytes / 100) {
+        fprintf(log_file_stream, "Descending fill is not compressed\n");
+        goto failed;
+    }
+
+    // Overwriting and unmapping keys inside runs splits them
+    map.Set(100, 7);
+    expected[100] = 7;
+    map.Set(Map::CHUNK_SIZE - 1, 8);
+    expected[Map::CHUNK_SIZE - 1] = 8;
+    map.Set(200, Map::INVALID);
+    expected[200] = Map::INVALID;
+    map.Set(Map::CHUNK_SIZE, Map::INVALID);
+    expected[Map::CHUNK_SIZE] = Map::INVALID;
+    if (!check_map(map, expected, "Split")) goto failed;
+
+    // A chunk fragmented into more than MAX_EXTENTS runs becomes an array
+    for (size_t key = fragmented; key < fragmented + Map::CHUNK_SIZE; key += 2) {
+        const uint32_t value = 1000000 + rand() % 1000000;
+        map.Set(key, value);
+        expected[key] = value;
+    }
+    if (!check_map(map, expected, "Fragmented")) goto failed;
+    fprintf(log_file_stream, ">>> Fragmented chunk: %zu bytes\n", map.MemoryUsage());
+    if (map.MemoryUsage() < Map::CHUNK_SIZE * sizeof(uint32_t)) {
+        fprintf(log_file_stream, "Fragmented chunk did not fall back to an array\n");
+        goto failed;
+    }
+
+    // Rewriting it sequentially compresses it again
+    for (size_t key = fragmented; key < fragmented + Map::CHUNK_SIZE; key++) {
+        map.Set(key, 3000000 + key);
+        expected[key] = 3000000 + key;
+    }
+    if (!check_map(map, expected, "Rewritten")) goto failed;
+    fprintf(log_file_stream, ">>> Rewritten chunk: %zu bytes\n", map.MemoryUsage());
+    if (map.MemoryUsage() >= Map::CHUNK_SIZE * sizeof(uint32_t)) {
+        fprintf(log_file_stream, "Rewritten chunk was not compressed again\n");
+        goto failed;
+    }
+
+    // Random updates of a few chunks, mixing runs, single keys and unmaps
+    for (int i = 0; i < RANDOM_SETS; i++) {
+        const size_t key = rand() % (4 * Map::CHUNK_SIZE);
+        const size_t run = rand() % 4 == 0 ? rand() % 256 : 1;
+        const uint32_t value = rand() % 8 == 0 ? Map::INVALID : 4000000 + rand() % 1000000;
+        for (size_t k = key; k < key + run && k < num_keys; k++) {
+            const uint32_t v = value == Map::INVALID ? value : value + (k - key);
+            map.Set(k, v);
+            expected[k] = v;
+        }
+    }
+    if (!check_map(map, expected, "Random")) goto failed;
+
+    ret = 0;
+    printf("SUCCESS ...Check %s for more details.\n", log_file_path);
+    goto done;
+failed:
+    printf("FAILED ...Check %s for more details.\n", log_file_path);
+done:
+    fflush(log_file_stream);
+    fclose(log_file_stream);
+
+    deinit_flashsim();
+
+    return ret;
+}